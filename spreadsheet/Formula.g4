@@ -10,6 +10,7 @@ expr
     | expr (MUL | DIV) expr  # BinaryOp
     | expr (ADD | SUB) expr  # BinaryOp
     | CELL  # Cell
+    | SHEET_CELL  # SheetCell
     | NUMBER  # Literal
     ;
 
@@ -27,4 +28,6 @@ SUB: '-' ;
 MUL: '*' ;
 DIV: '/' ;
 CELL: [A-Z]+[0-9]+ ;
+// ссылка на ячейку другого листа книги: Sheet2!A1
+SHEET_CELL: [A-Za-z_][A-Za-z0-9_]* '!' [A-Z]+[0-9]+ ;
 WS: [ \t\n\r]+ -> skip ;
\ No newline at end of file
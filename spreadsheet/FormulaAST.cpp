@@ -3,12 +3,100 @@
 #include "FormulaBaseListener.h"
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
+#include "formula.h"
+#include "memory_usage.h"
 
+#include <algorithm>
+#include <array>
 #include <cassert>
+#include <charconv>
 #include <cmath>
+#include <functional>
 #include <memory>
 #include <optional>
 #include <sstream>
+#include <type_traits>
+#include <variant>
+#include <vector>
+
+namespace {
+    // Вложенность чтений ячеек в текущем потоке
+    thread_local size_t cell_read_depth = 0;
+
+    CellInterface::Value ReadCellValue(const CellInterface& cell) {
+        struct DepthGuard {
+            DepthGuard() {
+                ++cell_read_depth;
+            }
+            ~DepthGuard() {
+                --cell_read_depth;
+            }
+        } guard;
+        return cell.GetValue();
+    }
+}  // namespace
+
+std::optional<double> ParseCellNumber(std::string_view text) {
+    if (text.empty()) {
+        return 0.0;
+    }
+    
+    // Обычная запись числа разбирается без потока. from_chars принимает и
+    // "inf" или "nan", а слишком большие числа не принимает: такие строки,
+    // как и записи с пробелами или знаком '+', разбирает поток.
+    double res;
+    const auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), res);
+    if (error == std::errc() && end == text.data() + text.size() && std::isfinite(res)) {
+        return res;
+    }
+    
+    std::istringstream input{ std::string(text) };
+    if (!(input >> res) || !input.eof()) {
+        return std::nullopt;
+    }
+    return res;
+}
+
+size_t GetCellReadDepth() {
+    return cell_read_depth;
+}
+
+double ReadCellNumber(const Position& pos, const SheetInterface& sheet) {
+    // Ссылка на удалённую ячейку
+    if (!pos.IsValid()) {
+        throw FormulaError(FormulaError::Category::Ref);
+    }
+
+    const CellInterface* cell = sheet.GetCell(pos);
+
+    if (!cell) return 0.0;
+
+    const auto value = ReadCellValue(*cell);
+    
+    // Проверка типа значения с помощью std::holds_alternative
+    if (std::holds_alternative<std::string>(value)) {
+        const auto number = ParseCellNumber(std::get<std::string>(value));
+        if (!number) {
+            throw FormulaError(FormulaError::Category::Value);
+        }
+        return *number;
+    }
+    else if (std::holds_alternative<double>(value)) {
+        return std::get<double>(value);
+    }
+    else {
+        throw std::get<FormulaError>(value);
+    }
+}
+
+double ReadCellNumber(const SheetReference& ref, const SheetInterface& sheet) {
+    const SheetInterface* linked = sheet.GetLinkedSheet(ref.sheet);
+    if (!linked) {
+        throw FormulaError(FormulaError::Category::Ref);
+    }
+    
+    return ReadCellNumber(ref.pos, *linked);
+}
 
 namespace ASTImpl {
 
@@ -72,20 +160,184 @@ namespace ASTImpl {
                          {PR_NONE,  PR_NONE,  PR_NONE,  PR_NONE,  PR_NONE, PR_NONE},
     };
 
+    namespace {
+        // Результат бинарной операции: бесконечность и NaN - ошибка деления
+        double CheckFinite(double res) {
+            if (!std::isfinite(res)) {
+                throw FormulaError(FormulaError::Category::Div0);
+            }
+            return res;
+        }
+    }  // namespace
+
+    // Ссылки формулы: выражения обращаются к ним по индексу
+    using Cells = std::vector<PackedPosition>;
+
+    // Всё, что нужно выражению для вычисления
+    struct EvalContext {
+        const SheetInterface& sheet;
+        const Cells& cells;
+    };
+
+    // Программа стекового интерпретатора: операнды кладутся на стек, операции
+    // снимают их и кладут результат. Порядок команд совпадает с порядком
+    // вычисления дерева, поэтому ошибки возникают в той же очерёдности.
+    class RpnProgram {
+    public:
+        void PushNumber(double value) {
+            Emit({ Instruction::Number, 0, value }, 1);
+        }
+
+        void PushCell(uint32_t index) {
+            Emit({ Instruction::Cell, index, 0.0 }, 1);
+        }
+
+        void PushSheetCell(const SheetReference& ref) {
+            Emit({ Instruction::SheetCell, static_cast<uint32_t>(sheet_cells_.size()), 0.0 }, 1);
+            sheet_cells_.push_back(ref);
+        }
+
+        void Negate() {
+            Emit({ Instruction::Negate, 0, 0.0 }, 0);
+        }
+
+        void ApplyBinary(char op) {
+            Emit({ static_cast<Instruction::Code>(op), 0, 0.0 }, -1);
+        }
+
+        size_t GetMemoryUsage() const {
+            size_t bytes = sizeof(*this) + memory_usage::VectorBytes(code_) + memory_usage::VectorBytes(sheet_cells_);
+            for (const auto& ref : sheet_cells_) {
+                bytes += memory_usage::StringHeapBytes(ref.sheet);
+            }
+            return bytes;
+        }
+
+        double Evaluate(const EvalContext& context) const {
+            // Стек большинства формул помещается в массив на стеке вызовов
+            std::array<double, INLINE_STACK_SIZE> inline_stack;
+            std::vector<double> heap_stack;
+            double* stack = inline_stack.data();
+            if (max_depth_ > inline_stack.size()) {
+                heap_stack.resize(max_depth_);
+                stack = heap_stack.data();
+            }
+
+            size_t top = 0;
+            for (const auto& instruction : code_) {
+                switch (instruction.code) {
+                    case Instruction::Number:
+                        stack[top++] = instruction.value;
+                        break;
+                    case Instruction::Cell:
+                        stack[top++] = ReadCellNumber(context.cells[instruction.cell].Unpack(), context.sheet);
+                        break;
+                    case Instruction::SheetCell:
+                        stack[top++] = ReadCellNumber(sheet_cells_[instruction.cell], context.sheet);
+                        break;
+                    case Instruction::Negate:
+                        stack[top - 1] = -stack[top - 1];
+                        break;
+                    default: {
+                        const double rhs = stack[--top];
+                        stack[top - 1] = CheckFinite(Apply(instruction.code, stack[top - 1], rhs));
+                        break;
+                    }
+                }
+            }
+
+            assert(top == 1);
+            return stack[0];
+        }
+
+    private:
+        static constexpr size_t INLINE_STACK_SIZE = 32;
+
+        struct Instruction {
+            // Коды бинарных операций совпадают с их знаками
+            enum Code : char {
+                Number = 'n',
+                Cell = 'c',
+                SheetCell = 's',
+                Negate = '~',
+                Add = '+',
+                Subtract = '-',
+                Multiply = '*',
+                Divide = '/',
+            };
+
+            Code code;
+            // Индекс ссылки для Cell, для SheetCell - индекс в sheet_cells_
+            uint32_t cell;
+            // Значение для Number
+            double value;
+        };
+
+        static double Apply(Instruction::Code code, double lhs, double rhs) {
+            switch (code) {
+                case Instruction::Add:
+                    return lhs + rhs;
+                case Instruction::Subtract:
+                    return lhs - rhs;
+                case Instruction::Multiply:
+                    return lhs * rhs;
+                case Instruction::Divide:
+                    return lhs / rhs;
+                default:
+                    assert(false);
+                    return 0.0;
+            }
+        }
+
+        void Emit(Instruction instruction, int stack_change) {
+            code_.push_back(instruction);
+            depth_ += stack_change;
+            max_depth_ = std::max(max_depth_, depth_);
+        }
+
+        std::vector<Instruction> code_;
+        // Ссылки на ячейки других листов, на которые указывают команды SheetCell
+        std::vector<SheetReference> sheet_cells_;
+        // Глубина стека после последней команды и наибольшая глубина
+        size_t depth_ = 0;
+        size_t max_depth_ = 0;
+    };
+
     class Expr {
     public:
         virtual ~Expr() = default;
 
-        virtual void Print(std::ostream& out) const = 0;
+        virtual std::unique_ptr<Expr> Clone() const = 0;
+
+        // Память узла и его потомков
+        virtual size_t GetMemoryUsage() const = 0;
+
+        // Упрощённая копия выражения для вычисления. Копия ссылается на те же
+        // индексы ячеек и вычисляется в точности так же, как исходное
+        // выражение, включая ошибки и знак нуля.
+        virtual std::unique_ptr<Expr> Optimize() const = 0;
+
+        // Значение выражения, если оно не зависит от ячеек
+        virtual std::optional<double> GetConstant() const {
+            return std::nullopt;
+        }
+
+        // Перевод индексов ссылок: новый индекс ссылки i - remap[i]
+        virtual void RemapCells(const std::vector<uint32_t>& remap) = 0;
 
-        virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
+        // Запись выражения в обратной польской записи
+        virtual void CompileRpn(RpnProgram& program) const = 0;
 
-        virtual double Evaluate(const SheetInterface& sheet) const = 0;
+        virtual void Print(std::ostream& out, const Cells& cells) const = 0;
+
+        virtual void DoPrintFormula(std::ostream& out, const Cells& cells, ExprPrecedence precedence) const = 0;
+
+        virtual double Evaluate(const EvalContext& context) const = 0;
 
         // higher is tighter
         virtual ExprPrecedence GetPrecedence() const = 0;
 
-        void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
+        void PrintFormula(std::ostream& out, const Cells& cells, ExprPrecedence parent_precedence,
                           bool right_child = false) const {
             auto precedence = GetPrecedence();
             auto mask = right_child ? PR_RIGHT : PR_LEFT;
@@ -94,7 +346,7 @@ namespace ASTImpl {
                 out << '(';
             }
 
-            DoPrintFormula(out, precedence);
+            DoPrintFormula(out, cells, precedence);
 
             if (parens_needed) {
                 out << ')';
@@ -117,18 +369,39 @@ namespace ASTImpl {
                     : type_(type), lhs_(std::move(lhs)), rhs_(std::move(rhs)) {
             }
 
-            void Print(std::ostream& out) const override {
+            std::unique_ptr<Expr> Clone() const override {
+                return std::make_unique<BinaryOpExpr>(type_, lhs_->Clone(), rhs_->Clone());
+            }
+
+            size_t GetMemoryUsage() const override {
+                return sizeof(*this) + lhs_->GetMemoryUsage() + rhs_->GetMemoryUsage();
+            }
+
+            std::unique_ptr<Expr> Optimize() const override;
+
+            void RemapCells(const std::vector<uint32_t>& remap) override {
+                lhs_->RemapCells(remap);
+                rhs_->RemapCells(remap);
+            }
+
+            void CompileRpn(RpnProgram& program) const override {
+                lhs_->CompileRpn(program);
+                rhs_->CompileRpn(program);
+                program.ApplyBinary(static_cast<char>(type_));
+            }
+
+            void Print(std::ostream& out, const Cells& cells) const override {
                 out << '(' << static_cast<char>(type_) << ' ';
-                lhs_->Print(out);
+                lhs_->Print(out, cells);
                 out << ' ';
-                rhs_->Print(out);
+                rhs_->Print(out, cells);
                 out << ')';
             }
 
-            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-                lhs_->PrintFormula(out, precedence);
+            void DoPrintFormula(std::ostream& out, const Cells& cells, ExprPrecedence precedence) const override {
+                lhs_->PrintFormula(out, cells, precedence);
                 out << static_cast<char>(type_);
-                rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+                rhs_->PrintFormula(out, cells, precedence, /* right_child = */ true);
             }
 
             ExprPrecedence GetPrecedence() const override {
@@ -148,35 +421,43 @@ namespace ASTImpl {
                 }
             }
 
-            double Evaluate(const SheetInterface& sheet) const override {
-                double res;
-                switch (type_) {
-                    case Type::Add: {
-                        res = lhs_->Evaluate(sheet) + rhs_->Evaluate(sheet);
-                        break;
-                    }
-                    case Type::Subtract: {
-                        res = lhs_->Evaluate(sheet) - rhs_->Evaluate(sheet);
-                        break;
-                    }
-                    case Type::Multiply: {
-                        res = lhs_->Evaluate(sheet) * rhs_->Evaluate(sheet);
-                        break;
-                    }
-                    case Type::Divide: {
-                        res = lhs_->Evaluate(sheet) / rhs_->Evaluate(sheet);
-                        break;
-                    }
+            double Evaluate(const EvalContext& context) const override {
+                // Левый операнд вычисляется первым: его ошибка имеет приоритет
+                const double lhs = lhs_->Evaluate(context);
+                return CheckFinite(Apply(type_, lhs, rhs_->Evaluate(context)));
+            }
+
+            Type GetType() const {
+                return type_;
+            }
+
+            const Expr& GetLhs() const {
+                return *lhs_;
+            }
+
+            const Expr& GetRhs() const {
+                return *rhs_;
+            }
+
+        private:
+            static double Apply(Type type, double lhs, double rhs) {
+                switch (type) {
+                    case Type::Add:
+                        return lhs + rhs;
+                    case Type::Subtract:
+                        return lhs - rhs;
+                    case Type::Multiply:
+                        return lhs * rhs;
+                    case Type::Divide:
+                        return lhs / rhs;
                     default:
                         assert(false);
+                        return 0.0;
                 }
-                if (!std::isfinite(res)) {
-                    throw FormulaError(FormulaError::Category::Div0);
-                }
-                return res;
             }
 
-        private:
+            static std::unique_ptr<Expr> Simplify(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs);
+
             Type type_;
             std::unique_ptr<Expr> lhs_;
             std::unique_ptr<Expr> rhs_;
@@ -194,27 +475,59 @@ namespace ASTImpl {
                     : type_(type), operand_(std::move(operand)) {
             }
 
-            void Print(std::ostream& out) const override {
+            std::unique_ptr<Expr> Clone() const override {
+                return std::make_unique<UnaryOpExpr>(type_, operand_->Clone());
+            }
+
+            size_t GetMemoryUsage() const override {
+                return sizeof(*this) + operand_->GetMemoryUsage();
+            }
+
+            std::unique_ptr<Expr> Optimize() const override;
+
+            void RemapCells(const std::vector<uint32_t>& remap) override {
+                operand_->RemapCells(remap);
+            }
+
+            void CompileRpn(RpnProgram& program) const override {
+                operand_->CompileRpn(program);
+                // Унарный плюс не меняет значения
+                if (type_ == UnaryMinus) {
+                    program.Negate();
+                }
+            }
+
+            // Выражение вида -x, иначе nullptr
+            static UnaryOpExpr* AsNegation(Expr* expr) {
+                auto* unary = dynamic_cast<UnaryOpExpr*>(expr);
+                return unary && unary->type_ == UnaryMinus ? unary : nullptr;
+            }
+
+            std::unique_ptr<Expr> ReleaseOperand() {
+                return std::move(operand_);
+            }
+
+            void Print(std::ostream& out, const Cells& cells) const override {
                 out << '(' << static_cast<char>(type_) << ' ';
-                operand_->Print(out);
+                operand_->Print(out, cells);
                 out << ')';
             }
 
-            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+            void DoPrintFormula(std::ostream& out, const Cells& cells, ExprPrecedence precedence) const override {
                 out << static_cast<char>(type_);
-                operand_->PrintFormula(out, precedence);
+                operand_->PrintFormula(out, cells, precedence);
             }
 
             ExprPrecedence GetPrecedence() const override {
                 return EP_UNARY;
             }
 
-            double Evaluate(const SheetInterface& sheet) const override {
+            double Evaluate(const EvalContext& context) const override {
                 switch (type_) {
                     case Type::UnaryPlus:
-                        return +operand_->Evaluate(sheet);
+                        return +operand_->Evaluate(context);
                     case Type::UnaryMinus:
-                        return -operand_->Evaluate(sheet);
+                        return -operand_->Evaluate(context);
                     default:
                         assert(false);
                 }
@@ -227,72 +540,105 @@ namespace ASTImpl {
 
         class CellExpr final : public Expr {
         public:
-            explicit CellExpr(const Position* cell)
-                    : pos_cell_(cell) {
+            explicit CellExpr(uint32_t index)
+                    : index_(index) {
+            }
+
+            std::unique_ptr<Expr> Clone() const override {
+                return std::make_unique<CellExpr>(index_);
+            }
+
+            size_t GetMemoryUsage() const override {
+                return sizeof(*this);
+            }
+
+            std::unique_ptr<Expr> Optimize() const override {
+                return std::make_unique<CellExpr>(index_);
             }
 
-            void Print(std::ostream& out) const override {
-                if (!pos_cell_->IsValid()) {
+            void RemapCells(const std::vector<uint32_t>& remap) override {
+                index_ = remap[index_];
+            }
+
+            void CompileRpn(RpnProgram& program) const override {
+                program.PushCell(index_);
+            }
+
+            void Print(std::ostream& out, const Cells& cells) const override {
+                const Position pos = cells[index_].Unpack();
+                if (!pos.IsValid()) {
                     out << FormulaError(FormulaError::Category::Ref);
                 } else {
-                    out << pos_cell_->ToString();
+                    char buffer[Position::MAX_STRING_LENGTH];
+                    out.write(buffer, pos.ToChars(buffer));
                 }
             }
 
-            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-                Print(out);
+            void DoPrintFormula(std::ostream& out, const Cells& cells, ExprPrecedence /* precedence */) const override {
+                Print(out, cells);
             }
 
             ExprPrecedence GetPrecedence() const override {
                 return EP_ATOM;
             }
 
-            double Evaluate(const SheetInterface& sheet) const override {
-                if (!pos_cell_->IsValid()) {
-                    throw FormulaException("Invalid position: " + pos_cell_->ToString());
-                }
+            double Evaluate(const EvalContext& context) const override {
+                return ReadCellNumber(context.cells[index_].Unpack(), context.sheet);
+            }
 
-                const CellInterface* cell = sheet.GetCell(*pos_cell_);
+            uint32_t GetIndex() const {
+                return index_;
+            }
 
-                if (!cell) return 0.0;
+        private:
+            // Индекс ссылки в списке ячеек формулы
+            uint32_t index_;
+        };
 
-                const auto& value = cell->GetValue();
-                
-                // Проверка типа значения с помощью std::holds_alternative
-                if (std::holds_alternative<std::string>(value)) {
-                    // Используем std::get для безопасного получения значения
-                    const auto& str_value = std::get<std::string>(value);
-                    
-                    if (str_value.empty()) {
-                        return 0.0;
-                    }
-                    
-                    try {
-                        double res;
-                        
-                        std::istringstream input(str_value);
-                        
-                        if (!(input >> res) || !input.eof()) {
-                            throw FormulaError(FormulaError::Category::Value);
-                        }
+        // Ссылка на ячейку другого листа
+        class SheetCellExpr final : public Expr {
+        public:
+            explicit SheetCellExpr(SheetReference ref)
+                    : ref_(std::move(ref)) {
+            }
 
-                        return res;
-                    }
-                    catch (...) {
-                        throw FormulaError(FormulaError::Category::Value);
-                    }
-                }
-                else if (std::holds_alternative<double>(value)) {
-                    return std::get<double>(value);
-                }
-                else {
-                    throw std::get<FormulaError>(value);
-                }
+            std::unique_ptr<Expr> Clone() const override {
+                return std::make_unique<SheetCellExpr>(ref_);
+            }
+
+            size_t GetMemoryUsage() const override {
+                return sizeof(*this) + memory_usage::StringHeapBytes(ref_.sheet);
+            }
+
+            std::unique_ptr<Expr> Optimize() const override {
+                return Clone();
             }
 
+            // Ссылка хранится в самом узле и не входит в список ссылок листа
+            void RemapCells(const std::vector<uint32_t>& /* remap */) override {}
+
+            void CompileRpn(RpnProgram& program) const override {
+                program.PushSheetCell(ref_);
+            }
+
+            void Print(std::ostream& out, const Cells& /* cells */) const override {
+                out << ref_.sheet << '!' << ref_.pos.ToString();
+            }
+
+            void DoPrintFormula(std::ostream& out, const Cells& cells, ExprPrecedence /* precedence */) const override {
+                Print(out, cells);
+            }
+
+            ExprPrecedence GetPrecedence() const override {
+                return EP_ATOM;
+            }
+
+            double Evaluate(const EvalContext& context) const override {
+                return ReadCellNumber(ref_, context.sheet);
+            }
 
         private:
-            const Position* pos_cell_;
+            SheetReference ref_;
         };
 
         class NumberExpr final : public Expr {
@@ -301,11 +647,33 @@ namespace ASTImpl {
                     : value_(value) {
             }
 
-            void Print(std::ostream& out) const override {
+            std::unique_ptr<Expr> Clone() const override {
+                return std::make_unique<NumberExpr>(value_);
+            }
+
+            size_t GetMemoryUsage() const override {
+                return sizeof(*this);
+            }
+
+            std::unique_ptr<Expr> Optimize() const override {
+                return std::make_unique<NumberExpr>(value_);
+            }
+
+            std::optional<double> GetConstant() const override {
+                return value_;
+            }
+
+            void RemapCells(const std::vector<uint32_t>& /* remap */) override {}
+
+            void CompileRpn(RpnProgram& program) const override {
+                program.PushNumber(value_);
+            }
+
+            void Print(std::ostream& out, const Cells& /* cells */) const override {
                 out << value_;
             }
 
-            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+            void DoPrintFormula(std::ostream& out, const Cells& /* cells */, ExprPrecedence /* precedence */) const override {
                 out << value_;
             }
 
@@ -313,7 +681,7 @@ namespace ASTImpl {
                 return EP_ATOM;
             }
 
-            double Evaluate(const SheetInterface& sheet) const override {
+            double Evaluate(const EvalContext& /* context */) const override {
                 return value_;
             }
 
@@ -321,6 +689,274 @@ namespace ASTImpl {
             double value_;
         };
 
+        // Степень двойки: умножение на неё точно в нормальном диапазоне
+        bool IsPowerOfTwo(double value) {
+            int exponent;
+            return std::isfinite(value) && std::abs(std::frexp(value, &exponent)) == 0.5;
+        }
+
+        std::unique_ptr<Expr> UnaryOpExpr::Optimize() const {
+            auto operand = operand_->Optimize();
+            // Унарный плюс не меняет значения
+            if (type_ == UnaryPlus) {
+                return operand;
+            }
+            if (auto value = operand->GetConstant()) {
+                return std::make_unique<NumberExpr>(-*value);
+            }
+            // Двойная смена знака
+            if (auto* negation = AsNegation(operand.get())) {
+                return negation->ReleaseOperand();
+            }
+
+            return std::make_unique<UnaryOpExpr>(type_, std::move(operand));
+        }
+
+        std::unique_ptr<Expr> BinaryOpExpr::Optimize() const {
+            return Simplify(type_, lhs_->Optimize(), rhs_->Optimize());
+        }
+
+        // Допустимы только преобразования, которые дают тот же результат
+        // IEEE 754 для любых значений операндов, включая -0 и переполнение
+        std::unique_ptr<Expr> BinaryOpExpr::Simplify(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs) {
+            auto lhs_value = lhs->GetConstant();
+            auto rhs_value = rhs->GetConstant();
+
+            // Свёртка констант. Бесконечный результат оставляем вычислению:
+            // оно вернёт ошибку #DIV/0!
+            if (lhs_value && rhs_value) {
+                const double res = Apply(type, *lhs_value, *rhs_value);
+                if (std::isfinite(res)) {
+                    return std::make_unique<NumberExpr>(res);
+                }
+            }
+
+            switch (type) {
+                case Add:
+                    // x + (-0) = x и (-0) + x = x, а для +0 знак нуля мог бы измениться
+                    if (rhs_value && *rhs_value == 0.0 && std::signbit(*rhs_value)) {
+                        return lhs;
+                    }
+                    if (lhs_value && *lhs_value == 0.0 && std::signbit(*lhs_value)) {
+                        return rhs;
+                    }
+                    // x + (-y) = x - y
+                    if (auto* negation = UnaryOpExpr::AsNegation(rhs.get())) {
+                        return Simplify(Subtract, std::move(lhs), negation->ReleaseOperand());
+                    }
+                    break;
+                case Subtract:
+                    if (rhs_value && *rhs_value == 0.0 && !std::signbit(*rhs_value)) {
+                        return lhs;
+                    }
+                    // x - (-y) = x + y
+                    if (auto* negation = UnaryOpExpr::AsNegation(rhs.get())) {
+                        return Simplify(Add, std::move(lhs), negation->ReleaseOperand());
+                    }
+                    break;
+                case Divide:
+                    if (rhs_value && *rhs_value == 1.0) {
+                        return lhs;
+                    }
+                    // Деление на степень двойки равно умножению на обратную ей
+                    // степень, если та тоже представима точно
+                    if (rhs_value && IsPowerOfTwo(*rhs_value) && IsPowerOfTwo(1.0 / *rhs_value)) {
+                        return Simplify(Multiply, std::move(lhs), std::make_unique<NumberExpr>(1.0 / *rhs_value));
+                    }
+                    break;
+                case Multiply: {
+                    // Константа не может вернуть ошибку, поэтому её можно
+                    // перенести вправо, не меняя порядка вычисления ошибок
+                    if (lhs_value && !rhs_value) {
+                        std::swap(lhs, rhs);
+                        std::swap(lhs_value, rhs_value);
+                    }
+                    if (rhs_value && *rhs_value == 1.0) {
+                        return lhs;
+                    }
+                    // (-x) * c = x * (-c)
+                    auto* negation = UnaryOpExpr::AsNegation(lhs.get());
+                    if (negation && rhs_value) {
+                        return Simplify(Multiply, negation->ReleaseOperand(), std::make_unique<NumberExpr>(-*rhs_value));
+                    }
+                    // (x * a) * b = x * (a * b) для степеней двойки не меньше 1:
+                    // обе формы переполняются при одних и тех же x и не
+                    // округляются, а при уменьшении возможна потеря точности
+                    auto* product = dynamic_cast<BinaryOpExpr*>(lhs.get());
+                    if (product && product->type_ == Multiply && rhs_value && IsPowerOfTwo(*rhs_value) && std::abs(*rhs_value) >= 1.0) {
+                        auto inner_value = product->rhs_->GetConstant();
+                        if (inner_value && IsPowerOfTwo(*inner_value) && std::abs(*inner_value) >= 1.0
+                            && std::isfinite(*inner_value * *rhs_value)) {
+                            return Simplify(Multiply, std::move(product->lhs_), std::make_unique<NumberExpr>(*inner_value * *rhs_value));
+                        }
+                    }
+                    break;
+                }
+                default:
+                    assert(false);
+            }
+
+            return std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
+        }
+
+        // Специализированные вычислители для частых видов формул. Значения
+        // ячеек читаются напрямую, без обхода дерева и виртуальных вызовов,
+        // а операция подставляется шаблонным параметром.
+        template <typename Op>
+        struct CellOpCell {
+            uint32_t lhs;
+            uint32_t rhs;
+
+            double operator()(const EvalContext& context) const {
+                const double lhs_value = ReadCellNumber(context.cells[lhs].Unpack(), context.sheet);
+                return CheckFinite(Op{}(lhs_value, ReadCellNumber(context.cells[rhs].Unpack(), context.sheet)));
+            }
+        };
+
+        template <typename Op>
+        struct CellOpConst {
+            uint32_t lhs;
+            double rhs;
+
+            double operator()(const EvalContext& context) const {
+                return CheckFinite(Op{}(ReadCellNumber(context.cells[lhs].Unpack(), context.sheet), rhs));
+            }
+        };
+
+        template <typename Op>
+        struct ConstOpCell {
+            double lhs;
+            uint32_t rhs;
+
+            double operator()(const EvalContext& context) const {
+                return CheckFinite(Op{}(lhs, ReadCellNumber(context.cells[rhs].Unpack(), context.sheet)));
+            }
+        };
+
+        // Ячейка или сумма ячеек слева направо: A1+A2+...+An
+        struct SumOfCells {
+            std::vector<uint32_t> cells;
+
+            double operator()(const EvalContext& context) const {
+                double res = ReadCellNumber(context.cells[cells.front()].Unpack(), context.sheet);
+                for (auto it = cells.begin() + 1; it != cells.end(); ++it) {
+                    // Переполнение проверяется после каждого сложения, как в дереве
+                    res = CheckFinite(res + ReadCellNumber(context.cells[*it].Unpack(), context.sheet));
+                }
+                return res;
+            }
+        };
+
+        using Kernel = std::variant<
+            CellOpCell<std::plus<>>, CellOpCell<std::minus<>>, CellOpCell<std::multiplies<>>, CellOpCell<std::divides<>>,
+            CellOpConst<std::plus<>>, CellOpConst<std::minus<>>, CellOpConst<std::multiplies<>>, CellOpConst<std::divides<>>,
+            ConstOpCell<std::plus<>>, ConstOpCell<std::minus<>>, ConstOpCell<std::multiplies<>>, ConstOpCell<std::divides<>>,
+            SumOfCells>;
+
+        // Знак операции вычислителя
+        template <typename Op>
+        constexpr char OP_SIGN = '+';
+        template <>
+        constexpr char OP_SIGN<std::minus<>> = '-';
+        template <>
+        constexpr char OP_SIGN<std::multiplies<>> = '*';
+        template <>
+        constexpr char OP_SIGN<std::divides<>> = '/';
+
+        ElementwiseShape::Operand CellOperand(const Cells& cells, uint32_t index) {
+            return { cells[index].Unpack(), 0.0 };
+        }
+
+        ElementwiseShape::Operand NumberOperand(double value) {
+            return { std::nullopt, value };
+        }
+
+        template <typename Op>
+        ElementwiseShape GetShape(const CellOpCell<Op>& kernel, const Cells& cells) {
+            return { OP_SIGN<Op>, CellOperand(cells, kernel.lhs), CellOperand(cells, kernel.rhs) };
+        }
+
+        template <typename Op>
+        ElementwiseShape GetShape(const CellOpConst<Op>& kernel, const Cells& cells) {
+            return { OP_SIGN<Op>, CellOperand(cells, kernel.lhs), NumberOperand(kernel.rhs) };
+        }
+
+        template <typename Op>
+        ElementwiseShape GetShape(const ConstOpCell<Op>& kernel, const Cells& cells) {
+            return { OP_SIGN<Op>, NumberOperand(kernel.lhs), CellOperand(cells, kernel.rhs) };
+        }
+
+        // Вычислитель вида Shape<Op> для операции бинарного выражения
+        template <template <typename> typename Shape, typename Lhs, typename Rhs>
+        Kernel MakeKernel(BinaryOpExpr::Type type, Lhs lhs, Rhs rhs) {
+            switch (type) {
+                case BinaryOpExpr::Add:
+                    return Shape<std::plus<>>{ lhs, rhs };
+                case BinaryOpExpr::Subtract:
+                    return Shape<std::minus<>>{ lhs, rhs };
+                case BinaryOpExpr::Multiply:
+                    return Shape<std::multiplies<>>{ lhs, rhs };
+                case BinaryOpExpr::Divide:
+                    return Shape<std::divides<>>{ lhs, rhs };
+                default:
+                    assert(false);
+                    return Shape<std::plus<>>{ lhs, rhs };
+            }
+        }
+
+        // Собирает ячейки суммы A1+A2+...+An. Возвращает false, если
+        // выражение не является такой суммой.
+        bool CollectSum(const Expr& expr, std::vector<uint32_t>& cells) {
+            if (const auto* cell = dynamic_cast<const CellExpr*>(&expr)) {
+                cells.push_back(cell->GetIndex());
+                return true;
+            }
+
+            const auto* binary = dynamic_cast<const BinaryOpExpr*>(&expr);
+            if (!binary || binary->GetType() != BinaryOpExpr::Add) {
+                return false;
+            }
+
+            // Сумма левоассоциативна: справа всегда одна ячейка
+            const auto* rhs = dynamic_cast<const CellExpr*>(&binary->GetRhs());
+            if (!rhs || !CollectSum(binary->GetLhs(), cells)) {
+                return false;
+            }
+
+            cells.push_back(rhs->GetIndex());
+            return true;
+        }
+
+        // Подбор специализированного вычислителя для упрощённого дерева
+        std::optional<Kernel> CompileKernel(const Expr& expr) {
+            std::vector<uint32_t> sum;
+            if (CollectSum(expr, sum)) {
+                return SumOfCells{ std::move(sum) };
+            }
+
+            const auto* binary = dynamic_cast<const BinaryOpExpr*>(&expr);
+            if (!binary) {
+                return std::nullopt;
+            }
+
+            const auto* lhs_cell = dynamic_cast<const CellExpr*>(&binary->GetLhs());
+            const auto* rhs_cell = dynamic_cast<const CellExpr*>(&binary->GetRhs());
+            const auto lhs_value = binary->GetLhs().GetConstant();
+            const auto rhs_value = binary->GetRhs().GetConstant();
+
+            if (lhs_cell && rhs_cell) {
+                return MakeKernel<CellOpCell>(binary->GetType(), lhs_cell->GetIndex(), rhs_cell->GetIndex());
+            }
+            if (lhs_cell && rhs_value) {
+                return MakeKernel<CellOpConst>(binary->GetType(), lhs_cell->GetIndex(), *rhs_value);
+            }
+            if (lhs_value && rhs_cell) {
+                return MakeKernel<ConstOpCell>(binary->GetType(), *lhs_value, rhs_cell->GetIndex());
+            }
+
+            return std::nullopt;
+        }
+
         class ParseASTListener final : public FormulaBaseListener {
         public:
             std::unique_ptr<Expr> MoveRoot() {
@@ -331,10 +967,14 @@ namespace ASTImpl {
                 return root;
             }
 
-            std::forward_list<Position> MoveCells() {
+            std::vector<Position> MoveCells() {
                 return std::move(cells_);
             }
 
+            std::vector<SheetReference> MoveSheetCells() {
+                return std::move(sheet_cells_);
+            }
+
         public:
             void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
                 assert(args_.size() >= 1);
@@ -373,11 +1013,23 @@ namespace ASTImpl {
                     throw FormulaException("Invalid position: " + value_str);
                 }
 
-                cells_.push_front(value);
-                auto node = std::make_unique<CellExpr>(&cells_.front());
+                auto node = std::make_unique<CellExpr>(static_cast<uint32_t>(cells_.size()));
+                cells_.push_back(value);
                 args_.push_back(std::move(node));
             }
 
+            void exitSheetCell(FormulaParser::SheetCellContext* ctx) override {
+                auto value_str = ctx->SHEET_CELL()->getSymbol()->getText();
+                const auto separator = value_str.find('!');
+                SheetReference ref{ value_str.substr(0, separator), Position::FromString(value_str.substr(separator + 1)) };
+                if (!ref.pos.IsValid()) {
+                    throw FormulaException("Invalid position: " + value_str);
+                }
+
+                sheet_cells_.push_back(ref);
+                args_.push_back(std::make_unique<SheetCellExpr>(std::move(ref)));
+            }
+
             void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
                 assert(args_.size() >= 2);
 
@@ -408,7 +1060,10 @@ namespace ASTImpl {
 
         private:
             std::vector<std::unique_ptr<Expr>> args_;
-            std::forward_list<Position> cells_;
+            // Ссылки в порядке появления в формуле, по одной на каждый CellExpr
+            std::vector<Position> cells_;
+            // Ссылки на другие листы в порядке появления в формуле
+            std::vector<SheetReference> sheet_cells_;
         };
 
         class BailErrorListener : public antlr4::BaseErrorListener {
@@ -422,14 +1077,67 @@ namespace ASTImpl {
         };
 
     }  // namespace
+
+    class CompiledExpr {
+    public:
+        explicit CompiledExpr(Kernel kernel) : kernel_(std::move(kernel)) {}
+
+        double Evaluate(const EvalContext& context) const {
+            return std::visit([&context](const auto& kernel) {
+                return kernel(context);
+            }, kernel_);
+        }
+
+        size_t GetMemoryUsage() const {
+            const auto* sum = std::get_if<SumOfCells>(&kernel_);
+            return sizeof(*this) + (sum ? memory_usage::VectorBytes(sum->cells) : 0);
+        }
+
+        std::optional<ElementwiseShape> GetElementwiseShape(const Cells& cells) const {
+            return std::visit([&cells](const auto& kernel) -> std::optional<ElementwiseShape> {
+                if constexpr (std::is_same_v<std::decay_t<decltype(kernel)>, SumOfCells>) {
+                    // Сумма двух ячеек - то же, что "ячейка + ячейка"
+                    if (kernel.cells.size() != 2) {
+                        return std::nullopt;
+                    }
+                    return ElementwiseShape{ '+', CellOperand(cells, kernel.cells[0]), CellOperand(cells, kernel.cells[1]) };
+                }
+                else {
+                    return GetShape(kernel, cells);
+                }
+            }, kernel_);
+        }
+
+    private:
+        Kernel kernel_;
+    };
 }  // namespace ASTImpl
 
-std::forward_list<Position>& FormulaAST::GetCells() {
+const std::vector<PackedPosition>& FormulaAST::GetCells() const {
     return cells_;
 }
 
-const std::forward_list<Position>& FormulaAST::GetCells() const {
-    return cells_;
+void FormulaAST::SetCell(size_t index, Position pos) {
+    cells_[index] = PackedPosition(pos);
+}
+
+const std::vector<SheetReference>& FormulaAST::GetSheetCells() const {
+    return sheet_cells_;
+}
+
+size_t FormulaAST::GetMemoryUsage() const {
+    size_t bytes = root_expr_->GetMemoryUsage() + eval_expr_->GetMemoryUsage()
+        + memory_usage::VectorBytes(cells_) + memory_usage::VectorBytes(sheet_cells_);
+    for (const auto& ref : sheet_cells_) {
+        bytes += memory_usage::StringHeapBytes(ref.sheet);
+    }
+    if (compiled_expr_) {
+        bytes += compiled_expr_->GetMemoryUsage();
+    }
+    if (rpn_) {
+        bytes += rpn_->GetMemoryUsage();
+    }
+    return bytes;
 }
 
 FormulaAST ParseFormulaAST(std::istream& in) {
@@ -453,7 +1161,7 @@ FormulaAST ParseFormulaAST(std::istream& in) {
     ASTImpl::ParseASTListener listener;
     tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+    return FormulaAST(listener.MoveRoot(), listener.MoveCells(), listener.MoveSheetCells());
 }
 
 FormulaAST ParseFormulaAST(const std::string& in_str) {
@@ -461,27 +1169,106 @@ FormulaAST ParseFormulaAST(const std::string& in_str) {
     return ParseFormulaAST(in);
 }
 
+FormulaAST FormulaAST::Clone() const {
+    // Выражения ссылаются на ячейки по индексу, поэтому копия списка ссылок
+    // подходит копии дерева без перестройки
+    FormulaAST copy(root_expr_->Clone(), cells_, sheet_cells_);
+    if (rpn_) {
+        copy.rpn_ = std::make_unique<ASTImpl::RpnProgram>(*rpn_);
+    }
+    return copy;
+}
+
 void FormulaAST::PrintCells(std::ostream& out) const {
     for (auto cell: cells_) {
-        out << cell.ToString() << ' ';
+        out << cell.Unpack().ToString() << ' ';
     }
 }
 
 void FormulaAST::Print(std::ostream& out) const {
-    root_expr_->Print(out);
+    root_expr_->Print(out, cells_);
 }
 
 void FormulaAST::PrintFormula(std::ostream& out) const {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+    root_expr_->PrintFormula(out, cells_, ASTImpl::EP_ATOM);
 }
 
 double FormulaAST::Execute(const SheetInterface& sheet) const {
-    return root_expr_->Evaluate(sheet);
+    const ASTImpl::EvalContext context{ sheet, cells_ };
+    if (compiled_expr_) {
+        return compiled_expr_->Evaluate(context);
+    }
+    return eval_expr_->Evaluate(context);
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
-        : root_expr_(std::move(root_expr)), cells_(std::move(cells)) {
-    cells_.sort();  // to avoid sorting in GetReferencedCells
+double FormulaAST::ExecuteGeneric(const SheetInterface& sheet) const {
+    return eval_expr_->Evaluate({ sheet, cells_ });
 }
 
-FormulaAST::~FormulaAST() = default;
\ No newline at end of file
+void FormulaAST::CompileRpn() {
+    if (rpn_) {
+        return;
+    }
+    auto program = std::make_unique<ASTImpl::RpnProgram>();
+    eval_expr_->CompileRpn(*program);
+    rpn_ = std::move(program);
+}
+
+double FormulaAST::ExecuteRpn(const SheetInterface& sheet) const {
+    assert(rpn_ != nullptr);
+    return rpn_->Evaluate({ sheet, cells_ });
+}
+
+std::optional<ElementwiseShape> FormulaAST::GetElementwiseShape() const {
+    if (!compiled_expr_) {
+        return std::nullopt;
+    }
+    return compiled_expr_->GetElementwiseShape(cells_);
+}
+
+FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::vector<Position> cells,
+                       std::vector<SheetReference> sheet_cells)
+        : root_expr_(std::move(root_expr)), sheet_cells_(std::move(sheet_cells)) {
+    // Повторные ссылки на одну ячейку сливаются в одну запись, а список
+    // сортируется, чтобы не сортировать его в GetReferencedCells
+    std::vector<Position> unique_cells(cells);
+    std::sort(unique_cells.begin(), unique_cells.end());
+    unique_cells.erase(std::unique(unique_cells.begin(), unique_cells.end()), unique_cells.end());
+
+    std::vector<uint32_t> remap;
+    remap.reserve(cells.size());
+    for (const auto& pos : cells) {
+        const auto it = std::lower_bound(unique_cells.begin(), unique_cells.end(), pos);
+        remap.push_back(static_cast<uint32_t>(it - unique_cells.begin()));
+    }
+    root_expr_->RemapCells(remap);
+
+    cells_.reserve(unique_cells.size());
+    for (const auto& pos : unique_cells) {
+        cells_.emplace_back(pos);
+    }
+
+    // Узлы SheetCellExpr хранят ссылки сами, список нужен только снаружи
+    std::sort(sheet_cells_.begin(), sheet_cells_.end());
+    sheet_cells_.erase(std::unique(sheet_cells_.begin(), sheet_cells_.end()), sheet_cells_.end());
+    Compile();
+}
+
+FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::vector<PackedPosition> cells,
+                       std::vector<SheetReference> sheet_cells)
+        : root_expr_(std::move(root_expr)), cells_(std::move(cells)), sheet_cells_(std::move(sheet_cells)) {
+    Compile();
+}
+
+void FormulaAST::Compile() {
+    eval_expr_ = root_expr_->Optimize();
+    if (auto kernel = ASTImpl::CompileKernel(*eval_expr_)) {
+        compiled_expr_ = std::make_unique<ASTImpl::CompiledExpr>(std::move(*kernel));
+    }
+}
+
+FormulaAST::FormulaAST(FormulaAST&&) = default;
+
+FormulaAST& FormulaAST::operator=(FormulaAST&&) = default;
+
+FormulaAST::~FormulaAST() = default;
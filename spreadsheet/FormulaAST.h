@@ -3,42 +3,144 @@
 #include "FormulaLexer.h"
 #include "common.h"
 
-#include <forward_list>
+#include <cstdint>
 #include <functional>
 #include <stdexcept>
+#include <vector>
+
+#include <optional>
+
+struct ElementwiseShape;
 
 namespace ASTImpl {
     class Expr;
+    class CompiledExpr;
+    class RpnProgram;
 }
 
 class ParsingError : public std::runtime_error {
     using std::runtime_error::runtime_error;
 };
 
+// Позиция, упакованная в 32 бита: по 14 бит на строку и столбец.
+// Порядок упакованных позиций совпадает с порядком Position.
+class PackedPosition {
+public:
+    static constexpr int BITS = 14;
+
+    PackedPosition() = default;
+
+    explicit PackedPosition(Position pos)
+        : bits_(pos.IsValid() ? static_cast<uint32_t>(pos.row) << BITS | static_cast<uint32_t>(pos.col) : INVALID) {
+    }
+
+    Position Unpack() const {
+        if (!IsValid()) {
+            return Position::NONE;
+        }
+        return { static_cast<int>(bits_ >> BITS), static_cast<int>(bits_ & ((1u << BITS) - 1)) };
+    }
+
+    constexpr bool IsValid() const {
+        return bits_ != INVALID;
+    }
+
+    constexpr bool operator==(PackedPosition rhs) const {
+        return bits_ == rhs.bits_;
+    }
+
+    constexpr bool operator<(PackedPosition rhs) const {
+        return bits_ < rhs.bits_;
+    }
+
+private:
+    static constexpr uint32_t INVALID = ~0u;
+
+    uint32_t bits_ = INVALID;
+};
+
+static_assert(Position::MAX_ROWS <= 1 << PackedPosition::BITS && Position::MAX_COLS <= 1 << PackedPosition::BITS,
+              "Position does not fit into PackedPosition");
+static_assert(sizeof(PackedPosition) == sizeof(uint32_t));
+
 class FormulaAST {
 public:
+    // cells - ссылки в порядке появления в формуле: i-й узел ячейки дерева
+    // ссылается на cells[i]
     explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                        std::forward_list<Position> cells);
-    FormulaAST(FormulaAST&&) = default;
-    FormulaAST& operator=(FormulaAST&&) = default;
+                        std::vector<Position> cells, std::vector<SheetReference> sheet_cells = {});
+    FormulaAST(FormulaAST&&);
+    FormulaAST& operator=(FormulaAST&&);
     ~FormulaAST();
 
+    // Глубокая копия дерева и списка ссылок
+    FormulaAST Clone() const;
+
     double Execute(const SheetInterface& sheet) const;
+    // Вычисление обходом дерева, минуя специализированный вычислитель.
+    // Результат совпадает с Execute(); используется для сравнения в тестах
+    // и замерах.
+    double ExecuteGeneric(const SheetInterface& sheet) const;
+    // Построение обратной польской записи упрощённого дерева для ExecuteRpn().
+    // Запись строится по запросу, чтобы её не хранили формулы, которые
+    // вычисляются другими способами; копия формулы получает её вместе с деревом.
+    void CompileRpn();
+    // Вычисление интерпретатором обратной польской записи: без рекурсии и
+    // виртуальных вызовов. Результат совпадает с Execute().
+    double ExecuteRpn(const SheetInterface& sheet) const;
+    // Вид формулы для поблочного вычисления, если формула - одна бинарная
+    // операция над ячейками и числами
+    std::optional<ElementwiseShape> GetElementwiseShape() const;
     void PrintCells(std::ostream& out) const;
     void Print(std::ostream& out) const;
     void PrintFormula(std::ostream& out) const;
 
-    std::forward_list<Position>& GetCells();
-    const std::forward_list<Position>& GetCells() const;
+    // Различные ссылки формулы, отсортированные при разборе. Сдвиг строк и
+    // столбцов сохраняет их порядок, а ссылки на удалённые ячейки становятся
+    // недействительными на своих местах.
+    const std::vector<PackedPosition>& GetCells() const;
+    // Замена позиции ссылки. Порядок ссылок должен сохраниться: сдвиг
+    // строк и столбцов его не меняет.
+    void SetCell(size_t index, Position pos);
+    // Ссылки на другие листы, отсортированные и без повторов
+    const std::vector<SheetReference>& GetSheetCells() const;
+    // Память деревьев, вычислителей и списков ссылок без самого объекта
+    size_t GetMemoryUsage() const;
 
 private:
+    // Список ссылок уже отсортирован, а узлы дерева указывают в него
+    FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::vector<PackedPosition> cells,
+               std::vector<SheetReference> sheet_cells);
+
+    // Упрощение дерева и подбор специализированного вычислителя
+    void Compile();
+
+    // Дерево в том виде, в котором формула записана; по нему печатается формула
     std::unique_ptr<ASTImpl::Expr> root_expr_;
+    // Упрощённое дерево для вычисления: свёрнутые константы, без тождественных
+    // операций. Ссылается на те же индексы ячеек, что и root_expr_.
+    std::unique_ptr<ASTImpl::Expr> eval_expr_;
+    // Специализированный вычислитель для формул вида "ячейка op ячейка",
+    // "ячейка op число", "число op ячейка" и суммы ячеек; для остальных
+    // формул пуст и вычисление идёт по eval_expr_
+    std::unique_ptr<ASTImpl::CompiledExpr> compiled_expr_;
+    // Обратная польская запись eval_expr_, если она запрошена
+    std::unique_ptr<ASTImpl::RpnProgram> rpn_;
 
     // physically stores cells so that they can be
     // efficiently traversed without going through
-    // the whole AST
-    std::forward_list<Position> cells_;
+    // the whole AST; expressions refer to them by index
+    std::vector<PackedPosition> cells_;
+    // Ссылки на ячейки других листов. Вставка и удаление строк и столбцов их
+    // не сдвигают.
+    std::vector<SheetReference> sheet_cells_;
 };
 
+// Значение ячейки в виде числа, как его видит формула. Пустая ячейка - ноль,
+// текст разбирается как число. При ошибке бросает FormulaError.
+double ReadCellNumber(const Position& pos, const SheetInterface& sheet);
+// То же для ячейки другого листа книги. Если листа нет - ошибка #REF!.
+double ReadCellNumber(const SheetReference& ref, const SheetInterface& sheet);
+
 FormulaAST ParseFormulaAST(std::istream& in);
 FormulaAST ParseFormulaAST(const std::string& in_str);
\ No newline at end of file
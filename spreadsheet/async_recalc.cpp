@@ -0,0 +1,138 @@
+#include "async_recalc.h"
+
+#include "sheet_version.h"
+
+using namespace std::literals;
+
+AsyncRecalculator::AsyncRecalculator(Sheet& sheet, PendingPolicy policy)
+    : sheet_(sheet), policy_(policy), worker_([this] { Run(); }) {}
+
+AsyncRecalculator::~AsyncRecalculator() {
+    {
+        std::lock_guard guard(mutex_);
+        stopping_ = true;
+        if (running_token_) {
+            running_token_->Cancel();
+        }
+    }
+    changed_.notify_all();
+    worker_.join();
+}
+
+void AsyncRecalculator::Schedule() {
+    auto snapshot = sheet_.Snapshot();
+    {
+        std::lock_guard guard(mutex_);
+        // Устаревшая работа отменяется: и начатая, и ещё не начатая
+        if (running_token_) {
+            running_token_->Cancel();
+        }
+        if (pending_) {
+            ++cancelled_;
+        }
+        pending_ = Job{ ++scheduled_version_, std::move(snapshot), std::make_shared<CancellationToken>() };
+    }
+    changed_.notify_all();
+}
+
+void AsyncRecalculator::SetCell(Position pos, std::string text) {
+    sheet_.SetCell(pos, std::move(text));
+    Schedule();
+}
+
+std::optional<CellInterface::Value> AsyncRecalculator::GetValue(Position pos) const {
+    std::shared_ptr<const SheetInterface> published;
+    {
+        std::lock_guard guard(mutex_);
+        if (policy_ == PendingPolicy::Marker && (published_version_ != scheduled_version_ || error_)) {
+            return std::nullopt;
+        }
+        published = published_;
+    }
+    if (!published) {
+        return std::nullopt;
+    }
+
+    // Формулы опубликованного снимка уже вычислены
+    const CellInterface* cell = published->GetCell(pos);
+    return cell ? cell->GetValue() : ""s;
+}
+
+bool AsyncRecalculator::IsCurrent() const {
+    std::lock_guard guard(mutex_);
+    return published_version_ == scheduled_version_;
+}
+
+void AsyncRecalculator::Wait() const {
+    std::unique_lock lock(mutex_);
+    changed_.wait(lock, [this] {
+        return published_version_ == scheduled_version_;
+    });
+    if (error_) {
+        std::rethrow_exception(error_);
+    }
+}
+
+std::exception_ptr AsyncRecalculator::GetError() const {
+    std::lock_guard guard(mutex_);
+    return error_;
+}
+
+size_t AsyncRecalculator::GetCancelledCount() const {
+    std::lock_guard guard(mutex_);
+    return cancelled_;
+}
+
+void AsyncRecalculator::Run() {
+    while (true) {
+        Job job;
+        {
+            std::unique_lock lock(mutex_);
+            changed_.wait(lock, [this] {
+                return stopping_ || pending_.has_value();
+            });
+            if (stopping_) {
+                return;
+            }
+            job = std::move(*pending_);
+            pending_.reset();
+            running_token_ = job.token;
+        }
+
+        bool completed = true;
+        std::exception_ptr error;
+        try {
+            CancellationToken::Scope scope(*job.token);
+            VersionedStorage::ForEachCell(*job.snapshot, [](Position, const CellInterface& cell) {
+                // Текстовые ячейки не вычисляются, поэтому отмена проверяется
+                // и между ячейками
+                CancellationToken::ThrowIfCancelled();
+                cell.GetValue();
+            });
+        }
+        catch (const EvaluationCancelledException&) {
+            completed = false;
+        }
+        catch (...) {
+            // Остальные ошибки передаются ожидающим, а поток продолжает
+            // обрабатывать следующие пересчёты
+            error = std::current_exception();
+        }
+
+        {
+            std::lock_guard guard(mutex_);
+            running_token_.reset();
+            if (completed) {
+                if (!error) {
+                    published_ = std::move(job.snapshot);
+                }
+                error_ = error;
+                published_version_ = job.version;
+            }
+            else {
+                ++cancelled_;
+            }
+        }
+        changed_.notify_all();
+    }
+}
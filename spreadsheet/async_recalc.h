@@ -0,0 +1,98 @@
+#pragma once
+
+#include "common.h"
+#include "formula.h"
+#include "sheet.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+// Что видят читатели, пока пересчёт последнего изменения не завершён
+enum class PendingPolicy {
+    // Значение из последнего завершённого пересчёта
+    PreviousValue,
+    // Отметка "значение вычисляется" (nullopt)
+    Marker,
+};
+
+// Фоновый пересчёт таблицы. Schedule() делает снимок таблицы и передаёт его
+// фоновому потоку, который вычисляет все формулы снимка и публикует
+// результат. Новый вызов Schedule() отменяет незавершённый пересчёт:
+// вычисление формул проверяет признак отмены и прерывается, не дожидаясь
+// конца устаревшей работы.
+// Сама таблица при этом не вычисляется, поэтому её кэши остаются пустыми, и
+// изменение ячейки не сбрасывает кэши зависимых формул. Вместе со снимком за
+// O(1) это делает время изменения независимым от размера модели. Первый
+// снимок строится за O(n). Ссылки на другие листы книги в снимке вычисляются
+// в #REF!.
+// Цена - фоновая работа: каждый пересчёт вычисляет все формулы снимка заново,
+// за O(формул) независимо от размера изменения. Значения прошлого снимка не
+// переиспользуются: снимок не хранит связей между ячейками, и без них нельзя
+// понять, какие значения изменение не затронуло.
+class AsyncRecalculator {
+public:
+    // Таблица должна жить дольше пересчёта. Изменения таблицы и вызовы
+    // Schedule() выполняются в одном потоке (потоке писателя), GetValue(),
+    // IsCurrent() и Wait() - в любых потоках.
+    explicit AsyncRecalculator(Sheet& sheet, PendingPolicy policy = PendingPolicy::PreviousValue);
+    ~AsyncRecalculator();
+
+    AsyncRecalculator(const AsyncRecalculator&) = delete;
+    AsyncRecalculator& operator=(const AsyncRecalculator&) = delete;
+
+    // Запуск пересчёта текущего состояния таблицы
+    void Schedule();
+    // Изменение ячейки и запуск пересчёта
+    void SetCell(Position pos, std::string text);
+
+    // Значение ячейки по последнему успешному пересчёту. nullopt, пока
+    // результата нет, а при PendingPolicy::Marker - и пока последнее
+    // изменение не пересчитано или его пересчёт завершился ошибкой.
+    std::optional<CellInterface::Value> GetValue(Position pos) const;
+    // Пересчитано ли последнее запланированное состояние
+    bool IsCurrent() const;
+    // Ожидание пересчёта последнего запланированного состояния. Если пересчёт
+    // завершился ошибкой, бросает её исключение.
+    void Wait() const;
+    // Исключение, которым завершился последний пересчёт, или nullptr.
+    // Пересчёт с ошибкой считается завершённым, но его снимок не публикуется.
+    std::exception_ptr GetError() const;
+    // Число пересчётов, отменённых новыми изменениями
+    size_t GetCancelledCount() const;
+
+private:
+    struct Job {
+        uint64_t version = 0;
+        std::shared_ptr<const SheetInterface> snapshot;
+        std::shared_ptr<CancellationToken> token;
+    };
+
+    // Цикл фонового потока
+    void Run();
+
+    Sheet& sheet_;
+    const PendingPolicy policy_;
+
+    mutable std::mutex mutex_;
+    mutable std::condition_variable changed_;
+    // Запланированный, но ещё не начатый пересчёт
+    std::optional<Job> pending_;
+    // Признак отмены выполняемого пересчёта
+    std::shared_ptr<CancellationToken> running_token_;
+    // Последний вычисленный снимок и номера состояний
+    std::shared_ptr<const SheetInterface> published_;
+    // Ошибка пересчёта состояния published_version_
+    std::exception_ptr error_;
+    uint64_t published_version_ = 0;
+    uint64_t scheduled_version_ = 0;
+    size_t cancelled_ = 0;
+    bool stopping_ = false;
+
+    // Запускается последним, когда остальные поля готовы
+    std::thread worker_;
+};
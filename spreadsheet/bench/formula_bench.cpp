@@ -0,0 +1,178 @@
+#include "FormulaAST.h"
+#include "common.h"
+#include "log_duration.h"
+#include "sheet.h"
+
+#include <iostream>
+#include <cstdint>
+#include <string>
+#include <variant>
+#include <vector>
+
+// Замер вычисления формул, протянутых вниз по столбцу: специализированные
+// вычислители, обход дерева и интерпретатор обратной польской записи
+namespace {
+    constexpr int ROWS = Position::MAX_ROWS;
+    constexpr int REPEATS = 100;
+
+    // Формулы строк 1..ROWS по шаблону "prefix{row}infix{row}suffix"
+    std::vector<FormulaAST> FillDown(const std::string& prefix, const std::string& infix, const std::string& suffix) {
+        std::vector<FormulaAST> formulas;
+        formulas.reserve(ROWS);
+        for (int row = 1; row <= ROWS; ++row) {
+            const std::string r = std::to_string(row);
+            formulas.push_back(ParseFormulaAST(prefix + r + infix + (infix.empty() ? "" : r) + suffix));
+            formulas.back().CompileRpn();
+        }
+        return formulas;
+    }
+
+    template <typename Execute>
+    double Run(const std::vector<FormulaAST>& formulas, Execute execute) {
+        double checksum = 0.0;
+        for (int i = 0; i < REPEATS; ++i) {
+            for (const auto& formula : formulas) {
+                checksum += execute(formula);
+            }
+        }
+        return checksum;
+    }
+
+    void Bench(const std::string& name, const SheetInterface& sheet, const std::vector<FormulaAST>& formulas) {
+        double specialized;
+        double generic;
+        double rpn;
+        // Прогрев: кэши значений ячеек и процессора
+        Run(formulas, [&sheet](const FormulaAST& formula) {
+            return formula.Execute(sheet);
+        });
+        {
+            LOG_DURATION(name + " specialized");
+            specialized = Run(formulas, [&sheet](const FormulaAST& formula) {
+                return formula.Execute(sheet);
+            });
+        }
+        {
+            LOG_DURATION(name + " generic");
+            generic = Run(formulas, [&sheet](const FormulaAST& formula) {
+                return formula.ExecuteGeneric(sheet);
+            });
+        }
+        {
+            LOG_DURATION(name + " rpn");
+            rpn = Run(formulas, [&sheet](const FormulaAST& formula) {
+                return formula.ExecuteRpn(sheet);
+            });
+        }
+        if (specialized != generic || rpn != generic) {
+            std::cerr << name << ": results differ" << std::endl;
+        }
+    }
+    // Столбец B=A*2, C=A+B, протянутый на всю высоту таблицы
+    void FillColumns(Sheet& sheet) {
+        for (int row = 0; row < ROWS; ++row) {
+            const std::string r = std::to_string(row + 1);
+            sheet.SetCell({ row, 0 }, std::to_string(row % 97));
+            sheet.SetCell({ row, 1 }, "=A" + r + "*2");
+            sheet.SetCell({ row, 2 }, "=A" + r + "+B" + r);
+        }
+    }
+
+    void BenchRecalculate() {
+        Sheet blocks;
+        Sheet plain;
+        FillColumns(blocks);
+        FillColumns(plain);
+        {
+            LOG_DURATION("fill-down recalculate by blocks");
+            blocks.Recalculate();
+        }
+        {
+            LOG_DURATION("fill-down recalculate by cells");
+            for (int row = 0; row < ROWS; ++row) {
+                for (int col = 1; col < 3; ++col) {
+                    plain.GetCell({ row, col })->GetValue();
+                }
+            }
+        }
+    }
+
+    // Выгрузка столбцов A..C заполненной таблицы в массив чисел: по ячейкам
+    // через GetValue() и одним вызовом ExtractNumbers()
+    void BenchExtract() {
+        Sheet sheet;
+        FillColumns(sheet);
+        sheet.Recalculate();
+
+        std::vector<double> out(static_cast<size_t>(ROWS) * 3);
+        std::vector<uint8_t> status(out.size());
+        double by_cells = 0.0;
+        double bulk = 0.0;
+        {
+            LOG_DURATION("extract numbers by cells");
+            for (int i = 0; i < REPEATS; ++i) {
+                for (int row = 0; row < ROWS; ++row) {
+                    for (int col = 0; col < 3; ++col) {
+                        const auto value = sheet.GetCell({ row, col })->GetValue();
+                        const double number = std::holds_alternative<double>(value)
+                            ? std::get<double>(value) : std::stod(std::get<std::string>(value));
+                        out[static_cast<size_t>(row) * 3 + col] = number;
+                    }
+                }
+                by_cells += out.back();
+            }
+        }
+        {
+            LOG_DURATION("extract numbers in bulk");
+            for (int i = 0; i < REPEATS; ++i) {
+                sheet.ExtractNumbers({ 0, 0 }, { ROWS, 3 }, out.data(), status.data());
+                bulk += out.back();
+            }
+        }
+        if (by_cells != bulk) {
+            std::cerr << "extract numbers: results differ" << std::endl;
+        }
+    }
+
+    // Правки ячейки, от которой через формулу с неизменным значением
+    // зависит длинная цепочка: A1 -> B1=A1*0 -> C1=B1+1 -> C2=C1+B1 -> ...
+    // После каждой правки читается конец цепочки.
+    void BenchEarlyCutoff(const std::string& name, RecalculationMode mode) {
+        constexpr int edits = 1000;
+        constexpr int chain = 2000;
+        Sheet sheet(SheetOptions{ EvaluationBackend::Kernels, mode, {} });
+        sheet.SetCell({ 0, 0 }, "1");
+        sheet.SetCell({ 0, 1 }, "=A1*0");
+        sheet.SetCell({ 0, 2 }, "=B1+1");
+        for (int row = 1; row < chain; ++row) {
+            sheet.SetCell({ row, 2 }, "=C" + std::to_string(row) + "+B1");
+        }
+
+        double checksum = 0.0;
+        LOG_DURATION(name);
+        for (int i = 0; i < edits; ++i) {
+            sheet.SetCell({ 0, 0 }, std::to_string(i));
+            checksum += std::get<double>(sheet.GetCell({ chain - 1, 2 })->GetValue());
+        }
+        if (checksum != edits) {
+            std::cerr << name << ": wrong result" << std::endl;
+        }
+    }
+}  // namespace
+
+int main() {
+    auto sheet = CreateSheet();
+    for (int row = 0; row < ROWS; ++row) {
+        sheet->SetCell({ row, 0 }, "=" + std::to_string(row % 97));
+        sheet->SetCell({ row, 1 }, "=" + std::to_string(row % 89 + 1));
+    }
+
+    Bench("A*2", *sheet, FillDown("A", "", "*2"));
+    Bench("A+B", *sheet, FillDown("A", "+B", ""));
+    Bench("A+B+A+B", *sheet, FillDown("A", "+B", "+A1+B1"));
+
+    BenchRecalculate();
+    BenchExtract();
+    BenchEarlyCutoff("edits with invalidation", RecalculationMode::Invalidate);
+    BenchEarlyCutoff("edits with early cutoff", RecalculationMode::EarlyCutoff);
+}
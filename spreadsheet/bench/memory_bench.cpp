@@ -0,0 +1,140 @@
+#include "common.h"
+#include "sheet.h"
+
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <string>
+
+// Сравнение Sheet::MemoryUsage() со статистикой распределителя: глобальные
+// operator new и operator delete считают живые байты, а таблица строится
+// между двумя замерами. Журнал отмены, хранилище снимков и подписки
+// учитываются вместе с ячейками.
+namespace {
+    size_t live_bytes = 0;
+
+    // Заголовок с размером блока, выровненный как max_align_t
+    constexpr size_t HEADER = alignof(std::max_align_t);
+
+    void* Allocate(size_t size) {
+        auto* block = static_cast<char*>(std::malloc(size + HEADER));
+        if (!block) {
+            throw std::bad_alloc();
+        }
+        *reinterpret_cast<size_t*>(block) = size;
+        live_bytes += size;
+        return block + HEADER;
+    }
+
+    void Deallocate(void* ptr) {
+        if (!ptr) {
+            return;
+        }
+        char* block = static_cast<char*>(ptr) - HEADER;
+        live_bytes -= *reinterpret_cast<size_t*>(block);
+        std::free(block);
+    }
+}  // namespace
+
+void* operator new(size_t size) {
+    return Allocate(size);
+}
+
+void* operator new[](size_t size) {
+    return Allocate(size);
+}
+
+void operator delete(void* ptr) noexcept {
+    Deallocate(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    Deallocate(ptr);
+}
+
+void operator delete(void* ptr, size_t /* size */) noexcept {
+    Deallocate(ptr);
+}
+
+void operator delete[](void* ptr, size_t /* size */) noexcept {
+    Deallocate(ptr);
+}
+
+namespace {
+    constexpr int ROWS = 10000;
+
+    void PrintRow(const std::string& name, size_t bytes) {
+        std::cout << std::setw(14) << name << std::setw(12) << bytes << '\n';
+    }
+
+    // fill получает таблицу и заполняет её
+    template <typename Fill>
+    void Measure(const std::string& name, Fill fill) {
+        const size_t before = live_bytes;
+        {
+            Sheet sheet;
+            fill(sheet);
+            sheet.Recalculate();
+
+            const size_t allocated = live_bytes - before;
+            const SheetMemoryUsage usage = sheet.MemoryUsage();
+            std::cout << name << '\n';
+            PrintRow("cell_storage", usage.cell_storage);
+            PrintRow("cells", usage.cells);
+            PrintRow("impls", usage.impls);
+            PrintRow("texts", usage.texts);
+            PrintRow("formulas", usage.formulas);
+            PrintRow("dependencies", usage.dependencies);
+            PrintRow("caches", usage.caches);
+            PrintRow("history", usage.history);
+            PrintRow("snapshots", usage.snapshots);
+            PrintRow("subscriptions", usage.subscriptions);
+            PrintRow("total", usage.Total());
+            PrintRow("allocator", allocated);
+            const double error = 100.0 * (static_cast<double>(usage.Total()) - allocated) / allocated;
+            std::cout << std::setw(14) << "error" << std::setw(11) << std::fixed << std::setprecision(2) << error << "%\n\n";
+        }
+    }
+}  // namespace
+
+int main() {
+    Measure("short texts", [](Sheet& sheet) {
+        for (int row = 0; row < ROWS; ++row) {
+            sheet.SetCell({ row, 0 }, std::to_string(row));
+        }
+    });
+    Measure("long texts", [](Sheet& sheet) {
+        for (int row = 0; row < ROWS; ++row) {
+            sheet.SetCell({ row, 0 }, "a rather long text value in row " + std::to_string(row));
+        }
+    });
+    Measure("fill-down formulas", [](Sheet& sheet) {
+        for (int row = 0; row < ROWS; ++row) {
+            const std::string r = std::to_string(row + 1);
+            sheet.SetCell({ row, 0 }, r);
+            sheet.SetCell({ row, 1 }, "=A" + r + "*2");
+            sheet.SetCell({ row, 2 }, "=A" + r + "+B" + r + "+(A1-B1)/3");
+        }
+    });
+    Measure("references to empty cells", [](Sheet& sheet) {
+        for (int row = 0; row < ROWS; ++row) {
+            sheet.SetCell({ row, 1 }, "=A" + std::to_string(row + 1) + "+Z1");
+        }
+    });
+    // Правки после снимка: прежние формулы остаются в журнале, а хранилище
+    // снимков копирует изменённые блоки
+    Measure("edits after snapshot", [](Sheet& sheet) {
+        for (int row = 0; row < ROWS; ++row) {
+            sheet.SetCell({ row, 0 }, std::to_string(row));
+            sheet.SetCell({ row, 1 }, "=A" + std::to_string(row + 1) + "*2");
+        }
+        sheet.Snapshot();
+        sheet.Subscribe([](const std::vector<Sheet::CellChange>&) {});
+        for (int row = 0; row < ROWS; row += 2) {
+            sheet.SetCell({ row, 1 }, "=A" + std::to_string(row + 1) + "*3");
+        }
+        sheet.ClearCell({ 0, 0 });
+        sheet.Undo();
+    });
+}
@@ -0,0 +1,149 @@
+#include "FormulaAST.h"
+#include "common.h"
+#include "log_duration.h"
+
+#include <algorithm>
+#include <cctype>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Замер разбора и печати позиций ячеек и формул с большим числом ссылок
+namespace {
+    constexpr int REPEATS = 20;
+
+    // Прежняя реализация через std::istringstream и вставку в начало строки
+    namespace baseline {
+        std::string ToString(Position pos) {
+            if (!pos.IsValid()) return {};
+
+            std::string result;
+            int c = pos.col;
+            while (c >= 0) {
+                result.insert(result.begin(), 'A' + c % 26);
+                c = c / 26 - 1;
+            }
+
+            result += std::to_string(pos.row + 1);
+            return result;
+        }
+
+        Position FromString(std::string_view str) {
+            auto it = std::find_if(str.begin(), str.end(), [](const char c) {
+                return !(std::isalpha(c) && std::isupper(c));
+            });
+            auto letters = str.substr(0, it - str.begin());
+            auto digits = str.substr(it - str.begin());
+            if (letters.empty() || digits.empty() || letters.size() > 3 || !std::isdigit(digits[0])) {
+                return Position::NONE;
+            }
+
+            int row;
+            std::istringstream row_in{std::string{digits}};
+            if (!(row_in >> row) || !row_in.eof()) {
+                return Position::NONE;
+            }
+
+            int col = 0;
+            for (char ch : letters) {
+                col = col * 26 + ch - 'A' + 1;
+            }
+            return {row - 1, col - 1};
+        }
+    }  // namespace baseline
+
+    std::vector<Position> AllColumns() {
+        std::vector<Position> positions;
+        for (int row = 0; row < Position::MAX_ROWS; row += 7) {
+            for (int col = 0; col < Position::MAX_COLS; col += 97) {
+                positions.push_back({ row, col });
+            }
+        }
+        return positions;
+    }
+
+    void BenchPositions() {
+        const auto positions = AllColumns();
+        std::vector<std::string> texts;
+        texts.reserve(positions.size());
+        for (const auto& pos : positions) {
+            texts.push_back(pos.ToString());
+        }
+
+        size_t checksum = 0;
+        {
+            LOG_DURATION("ToString baseline");
+            for (int i = 0; i < REPEATS; ++i) {
+                for (const auto& pos : positions) {
+                    checksum += baseline::ToString(pos).size();
+                }
+            }
+        }
+        {
+            LOG_DURATION("ToChars");
+            char buffer[Position::MAX_STRING_LENGTH];
+            for (int i = 0; i < REPEATS; ++i) {
+                for (const auto& pos : positions) {
+                    checksum += pos.ToChars(buffer);
+                }
+            }
+        }
+        {
+            LOG_DURATION("FromString baseline");
+            for (int i = 0; i < REPEATS; ++i) {
+                for (const auto& text : texts) {
+                    checksum += baseline::FromString(text).row;
+                }
+            }
+        }
+        {
+            LOG_DURATION("FromString");
+            for (int i = 0; i < REPEATS; ++i) {
+                for (const auto& text : texts) {
+                    checksum += Position::FromString(text).row;
+                }
+            }
+        }
+        std::cerr << "checksum " << checksum << std::endl;
+    }
+
+    // Разбор и печать формул из 64 ссылок
+    void BenchFormulas() {
+        std::vector<std::string> expressions;
+        for (int row = 0; row < 2000; ++row) {
+            std::string expression;
+            for (int col = 0; col < 64; ++col) {
+                if (col > 0) {
+                    expression += '+';
+                }
+                expression += Position{ row, col * 11 }.ToString();
+            }
+            expressions.push_back(std::move(expression));
+        }
+
+        std::vector<FormulaAST> formulas;
+        {
+            LOG_DURATION("parse reference-heavy formulas");
+            for (const auto& expression : expressions) {
+                formulas.push_back(ParseFormulaAST(expression));
+            }
+        }
+        {
+            LOG_DURATION("print reference-heavy formulas");
+            size_t length = 0;
+            for (int i = 0; i < REPEATS; ++i) {
+                for (const auto& formula : formulas) {
+                    std::ostringstream out;
+                    formula.PrintFormula(out);
+                    length += out.str().size();
+                }
+            }
+            std::cerr << "printed " << length << std::endl;
+        }
+    }
+}  // namespace
+
+int main() {
+    BenchPositions();
+    BenchFormulas();
+}
@@ -1,68 +1,162 @@
 #include "cell.h"
 
+#include "sheet.h"
+
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cmath>
 #include <iostream>
+#include <limits>
 #include <string>
 #include <optional>
 #include <algorithm>
 
 using namespace std;
 
-Cell::Cell(SheetInterface& sheet) : sheet_(sheet), impl_(std::make_unique<EmptyImpl>()) {}
+Cell::Content::Content() = default;
+
+Cell::Content::Content(Content&&) noexcept = default;
+
+Cell::Content& Cell::Content::operator=(Content&&) noexcept = default;
+
+Cell::Content::~Content() = default;
+
+bool Cell::Content::IsEmpty() const {
+    return impl_ == nullptr;
+}
+
+void Cell::Content::AddMemoryUsage(SheetMemoryUsage& usage) const {
+    if (impl_) {
+        impl_->AddMemoryUsage(usage);
+    }
+}
+
+namespace {
+    // Состояние вычисления формул в текущем потоке для EvaluationScope
+    struct EvaluationState {
+        bool has_deadline = false;
+        std::chrono::steady_clock::time_point deadline;
+        unsigned ticks = 0;
+    };
+    thread_local EvaluationState evaluation_state;
+    
+    // Номер последней проверки циклических зависимостей. Общий для всех
+    // таблиц, потому что цикл может проходить через несколько листов книги.
+    std::atomic<uint64_t> cycle_check_epoch{ 0 };
+}  // namespace
+
+EvaluationScope::EvaluationScope(const SheetLimits& limits) {
+    auto& state = evaluation_state;
+    if (limits.max_dependency_depth != 0 && GetCellReadDepth() >= limits.max_dependency_depth) {
+        throw LimitExceededException("dependency chain is too deep"s);
+    }
+    if (state.has_deadline) {
+        if (++state.ticks % DEADLINE_CHECK_PERIOD == 0 && std::chrono::steady_clock::now() > state.deadline) {
+            throw LimitExceededException("evaluation time limit exceeded"s);
+        }
+    }
+    else if (limits.max_evaluation_time.count() > 0) {
+        state.deadline = std::chrono::steady_clock::now() + limits.max_evaluation_time;
+        state.has_deadline = true;
+        owns_deadline_ = true;
+    }
+}
+
+EvaluationScope::~EvaluationScope() {
+    if (owns_deadline_) {
+        evaluation_state.has_deadline = false;
+    }
+}
 
-void Cell::Set(std::string text) {
+Cell::Cell(Sheet& sheet) : sheet_(sheet), impl_(std::make_unique<EmptyImpl>()) {}
+
+void Cell::Set(std::string text, Content* previous) {
     // Если текст в ячейке уже совпадает - не нужно ничего делать
     if (impl_->GetText() == text) {
         return;
     }
     
-    // Сохраняем текущие зависимости
-    const auto& current_referenced = impl_->GetReferencedCells();
-    // Обновляем значение ячейки // проверяем новые зависимости
-    if (!text.empty()) {
-        if (text[0] == FORMULA_SIGN && text.size() > 1) {
-            unique_ptr<Impl> tmp_impl = make_unique<FormulaImpl>(text.substr(1), sheet_);
-            
-            // Сохраняем новые зависимости
-            const auto& new_referenced = tmp_impl->GetReferencedCells();
-            // Проверяем, есть ли циклическая зависимость
-            CheckDependency(new_referenced);
-            // Обновляем зависимости даже если new_referenced пустой
-            UpdateDependencies(new_referenced);
-            
-            impl_ = std::move(tmp_impl);
+    // Создаём новое содержимое ячейки, не трогая текущее
+    unique_ptr<Impl> new_impl;
+    if (text.empty()) {
+        new_impl = make_unique<EmptyImpl>();
+    }
+    else if (text[0] == FORMULA_SIGN && text.size() > 1) {
+        const auto& limits = sheet_.GetOptions().limits;
+        if (limits.max_formula_length != 0 && text.size() - 1 > limits.max_formula_length) {
+            throw LimitExceededException("formula is too long"s);
         }
-        else {
-            const auto& new_referenced = impl_->GetReferencedCells();
-            CheckDependency(new_referenced);
-            UpdateDependencies(new_referenced);
-            
-            impl_ = make_unique<TextImpl>(std::move(text));
+        new_impl = make_unique<FormulaImpl>(text.substr(1), sheet_, sheet_.GetOptions());
+        const size_t references = new_impl->GetReferencedCells().size() + new_impl->GetSheetReferences().size();
+        if (limits.max_references != 0 && references > limits.max_references) {
+            throw LimitExceededException("formula has too many references"s);
         }
+        // Проверяем, есть ли циклическая зависимость
+        CheckDependency(ResolveReferences(*new_impl));
     }
     else {
-        impl_ = make_unique<EmptyImpl>();
-        // Передаем пустой список зависимостей для очистки всех зависимостей
-        UpdateDependencies({});
+        new_impl = make_unique<TextImpl>(std::move(text));
     }
     
-    // Обновляем зависимости на основе сохраненных текущих зависимостей
-    UpdateDependencies(current_referenced);
+    // Формула корректна - обновляем зависимости и значение ячейки
+    const auto previous_value = GetPreviousValue();
+    UpdateDependencies(ResolveReferences(*impl_), ResolveReferences(*new_impl));
+    std::swap(impl_, new_impl);
+    
+    // Прежнее содержимое отдаём журналу изменений
+    if (previous) {
+        previous->impl_ = std::move(new_impl);
+    }
     
     // Инвалидация кэша ячейки
-    InvalidateCache();
+    InvalidateCache(previous_value);
 }
 
 // Обновляем зависимости и сбрасываем кэш ячейки при очистке,
 // передавая пустой текст в качестве аргумента
-void Cell::Clear() {
-    Set("");
+void Cell::Clear(Content* previous) {
+    Set("", previous);
+}
+
+void Cell::ExchangeContent(Content& content) {
+    const auto old_referenced = ResolveReferences(*impl_);
+    const auto previous_value = GetPreviousValue();
+    std::swap(impl_, content.impl_);
+    // Сохранённое содержимое могло кэшировать значение в другом состоянии таблицы
+    impl_->ResetCache();
+    UpdateDependencies(old_referenced, ResolveReferences(*impl_));
+    InvalidateCache(previous_value);
 }
 
 Cell::Value Cell::GetValue() const {
+    PrepareDeepEvaluation();
     return impl_->GetValue();
 }
 
+NumberStatus Cell::GetNumber(double& number) const {
+    PrepareDeepEvaluation();
+    return impl_->GetNumber(number);
+}
+
+void Cell::PrepareDeepEvaluation() const {
+    // Глубоко в цепочке невычисленные зависимости вычисляются явным стеком,
+    // и формула читает уже готовые значения, не углубляя рекурсию
+    if (GetCellReadDepth() >= MAX_RECURSIVE_READ_DEPTH && !HasCachedValue()) {
+        EvaluateDependencies(*this, [](const Cell& cell) {
+            std::vector<const Cell*> pending;
+            for (const Cell* ref : cell.reference_) {
+                if (!ref->reference_.empty() && !ref->HasCachedValue()) {
+                    pending.push_back(ref);
+                }
+            }
+            return pending;
+        }, [](const Cell& cell) {
+            cell.GetValue();
+        }, sheet_.GetOptions().limits.max_dependency_depth);
+    }
+}
+
 std::string Cell::GetText() const {
     return impl_->GetText();
 }
@@ -71,38 +165,199 @@ std::vector<Position> Cell::GetReferencedCells() const {
     return impl_->GetReferencedCells();
 }
 
+void Cell::PrintText(std::ostream& output) const {
+    impl_->PrintText(output);
+}
+
+bool Cell::IsEmpty() const {
+    return impl_->IsEmpty();
+}
+
+bool Cell::IsFormula() const {
+    return impl_->IsFormula();
+}
+
+const FormulaInterface* Cell::GetFormula() const {
+    return impl_->GetFormula();
+}
+
+std::shared_ptr<const FormulaInterface> Cell::ShareFormula() const {
+    return impl_->ShareFormula();
+}
+
+bool Cell::HasCachedValue() const {
+    return impl_->GetCache().has_value();
+}
+
+void Cell::CacheValue(const FormulaInterface::Value& value) const {
+    impl_->PutCache(value);
+}
+
+void Cell::AddMemoryUsage(SheetMemoryUsage& usage) const {
+    usage.cells += sizeof(Cell);
+    usage.dependencies += memory_usage::HashTableBytes(depend_) + memory_usage::HashTableBytes(reference_);
+    impl_->AddMemoryUsage(usage);
+}
+
+Sheet& Cell::GetSheet() const {
+    return sheet_;
+}
+
+bool Cell::HasSheetReferences() const {
+    return !impl_->GetSheetReferences().empty();
+}
+
+void Cell::UnlinkReferences() {
+    UpdateDependencies(ResolveReferences(*impl_), {});
+}
+
+void Cell::RelinkReferences() {
+    const auto previous_value = GetPreviousValue();
+    const auto referenced = ResolveReferences(*impl_);
+    UpdateDependencies(referenced, referenced);
+    InvalidateCache(previous_value);
+}
+
+Position Cell::GetPosition() const {
+    return position_;
+}
+
+void Cell::SetPosition(Position pos) {
+    position_ = pos;
+}
+
 bool Cell::IsReferenced() const {
     return !reference_.empty();
 }
 
-void Cell::CheckDependency(const std::vector<Position>& dep_cell) const {
-    unordered_set<CellInterface*> ref_cells;
-    // Проверяем, является ли текущая ячейка зависимой от других ячеек
-    CheckCircularDepend(dep_cell, ref_cells);
+bool Cell::HasDependents() const {
+    return !depend_.empty();
+}
+
+const std::unordered_set<Cell*>& Cell::GetDependents() const {
+    return depend_;
+}
+
+const std::unordered_set<Cell*>& Cell::GetReferences() const {
+    return reference_;
+}
+
+void Cell::AttachDependents(const std::vector<Cell*>& dependents) {
+    for (Cell* dependent : dependents) {
+        depend_.insert(dependent);
+        dependent->reference_.insert(this);
+    }
+}
+
+std::vector<Cell*> Cell::DetachDependents() {
+    std::vector<Cell*> dependents(depend_.begin(), depend_.end());
+    for (Cell* dependent : dependents) {
+        dependent->reference_.erase(this);
+    }
+    depend_.clear();
+    
+    return dependents;
+}
+
+FormulaInterface::HandlingResult Cell::UpdateReferences(
+    const std::function<FormulaInterface::HandlingResult(FormulaInterface&)>& update) {
+    auto* formula_impl = dynamic_cast<FormulaImpl*>(impl_.get());
+    if (!formula_impl) {
+        return FormulaInterface::HandlingResult::NothingChanged;
+    }
+    
+    const auto previous_value = GetPreviousValue();
+    const auto result = update(formula_impl->GetMutableFormula());
+    // Сдвинутые ссылки указывают на те же ячейки, зависимости не меняются.
+    // Ссылки на удалённые ячейки исчезли из списка, а оставшиеся позиции уже
+    // пересчитаны таблицей, поэтому старым и новым списком служит один и тот же.
+    if (result == FormulaInterface::HandlingResult::ReferencesChanged) {
+        const auto referenced = ResolveReferences(*impl_);
+        UpdateDependencies(referenced, referenced);
+        InvalidateCache(previous_value);
+    }
+    
+    return result;
 }
 
-void Cell::CheckCircularDepend(const std::vector<Position>& dep_cell, std::unordered_set<CellInterface*>& ref_cells) const {
+void Cell::RewriteReferences(const std::function<void(FormulaInterface&)>& rewrite, Content* previous) {
+    const auto* formula_impl = dynamic_cast<const FormulaImpl*>(impl_.get());
+    if (!formula_impl) {
+        return;
+    }
+    
+    // Текущая формула остаётся нетронутой для журнала
+    std::shared_ptr<FormulaInterface> formula = formula_impl->GetFormula()->Clone();
+    rewrite(*formula);
+    unique_ptr<Impl> new_impl = make_unique<FormulaImpl>(std::move(formula), sheet_, sheet_.GetOptions());
+    
+    const auto previous_value = GetPreviousValue();
+    UpdateDependencies(ResolveReferences(*impl_), ResolveReferences(*new_impl));
+    std::swap(impl_, new_impl);
+    if (previous) {
+        previous->impl_ = std::move(new_impl);
+    }
+    InvalidateCache(previous_value);
+}
+
+std::vector<Cell::Target> Cell::ResolveReferences(const Impl& impl) const {
+    std::vector<Target> targets;
+    const auto& cells = impl.GetReferencedCells();
+    const auto& sheet_cells = impl.GetSheetReferences();
+    targets.reserve(cells.size() + sheet_cells.size());
+    for (const auto& pos : cells) {
+        targets.push_back({ &sheet_, pos });
+    }
+    for (const auto& ref : sheet_cells) {
+        if (Sheet* sheet = sheet_.ResolveSheet(ref.sheet)) {
+            targets.push_back({ sheet, ref.pos });
+        }
+    }
+    
+    return targets;
+}
+
+void Cell::CheckDependency(const std::vector<Target>& dep_cell) const {
+    std::vector<const Cell*> stack;
     for (const auto& c : dep_cell) {
-        CellInterface* referenced = sheet_.GetCell(c);
-        // Проверяем, не является ли текущая ячейка ссылкой на себя
-        if (referenced == this) {
-            throw CircularDependencyException("The cyclic dependence is found"s);
+        // Ссылки на пустые позиции не могут замкнуть цикл
+        if (const Cell* referenced = c.sheet->FindCell(c.pos)) {
+            if (referenced == this) {
+                throw CircularDependencyException("The cyclic dependence is found"s);
+            }
+            stack.push_back(referenced);
         }
-        
-        if (referenced && ref_cells.count(referenced) == 0) {
-            const auto& another_ref = referenced->GetReferencedCells();
-            // Проверяем другие ячейки, на которые ссылается ячейка
-            if (!another_ref.empty()) {
-                CheckCircularDepend(another_ref, ref_cells);
+    }
+    // Цикл замыкается через ячейку, которая ссылается на текущую. Если таких
+    // нет, обход не нужен: так формулы, протянутые вниз, добавляются за O(1)
+    // независимо от длины цепочки.
+    if (depend_.empty()) {
+        return;
+    }
+    
+    // Каждая проверка получает новый номер, поэтому отметки прошлых проверок
+    // не нужно сбрасывать
+    const uint64_t epoch = ++cycle_check_epoch;
+    for (const Cell* cell : stack) {
+        cell->visit_epoch_ = epoch;
+    }
+    while (!stack.empty()) {
+        const Cell* cell = stack.back();
+        stack.pop_back();
+        for (const Cell* referenced : cell->reference_) {
+            if (referenced == this) {
+                throw CircularDependencyException("The cyclic dependence is found"s);
+            }
+            if (referenced->visit_epoch_ != epoch) {
+                referenced->visit_epoch_ = epoch;
+                stack.push_back(referenced);
             }
-            
-            ref_cells.insert(referenced);
         }
     }
 }
 
 // Устанавливаем новые зависимые ячейки и обновляем списки зависимостей
-void Cell::UpdateDependencies(const std::vector<Position>& new_ref) {
+void Cell::UpdateDependencies(const std::vector<Target>& old_ref, const std::vector<Target>& new_ref) {
     // Очищаем зависимость ячейки из списка ячеек,
     // на которые ранее ссылалась текущая ячейка
     for_each(reference_.begin(), reference_.end(), [this](Cell* referenced) {
@@ -110,39 +365,190 @@ void Cell::UpdateDependencies(const std::vector<Position>& new_ref) {
     });
 
     reference_.clear();
+    
+    // Ссылки на пустые позиции хранятся в таблице, а не в ячейках
+    for (const auto& c : old_ref) {
+        if (!c.sheet->FindCell(c.pos)) {
+            c.sheet->RemoveEmptyDependent(c.pos, this);
+        }
+    }
 
     for (const auto& c : new_ref) {
-        if (!sheet_.GetCell(c)) {
-            sheet_.SetCell(c, ""s);
+        Cell* new_reference = c.sheet->FindCell(c.pos);
+        if (!new_reference) {
+            c.sheet->AddEmptyDependent(c.pos, this);
+            continue;
         }
         
-        Cell* new_reference = dynamic_cast<Cell*>(sheet_.GetCell(c));
-        
         reference_.insert(new_reference);
         new_reference->depend_.insert(this);
     }
 }
 
-void Cell::InvalidateCache() {
+namespace {
+    // Совпадение значений с учётом знака нуля
+    bool IsSameValue(const CellInterface::Value& lhs, const CellInterface::Value& rhs) {
+        if (std::holds_alternative<double>(lhs) && std::holds_alternative<double>(rhs)) {
+            const double lhs_value = std::get<double>(lhs);
+            const double rhs_value = std::get<double>(rhs);
+            return lhs_value == rhs_value && std::signbit(lhs_value) == std::signbit(rhs_value);
+        }
+        return lhs == rhs;
+    }
+    
+    CellInterface::Value ToCellValue(const FormulaInterface::Value& value) {
+        if (std::holds_alternative<double>(value)) {
+            return std::get<double>(value);
+        }
+        return std::get<FormulaError>(value);
+    }
+}  // namespace
+
+std::optional<CellInterface::Value> Cell::GetPreviousValue() const {
+    if (!sheet_.UsesEarlyCutoff()) {
+        return nullopt;
+    }
+    if (!dynamic_cast<const FormulaImpl*>(impl_.get())) {
+        return impl_->GetValue();
+    }
+    if (auto cache = impl_->GetCache()) {
+        return ToCellValue(*cache);
+    }
+    return nullopt;
+}
+
+void Cell::InvalidateCache(const std::optional<Value>& previous) {
+    // Вычисленное значение может измениться - запоминаем его для подписчиков
+    if (impl_->GetCache().has_value()) {
+        sheet_.RecordChange(position_, this);
+    }
     impl_->ResetCache();
+    
+    if (sheet_.UsesEarlyCutoff()) {
+        bool changed = true;
+        try {
+            // Прежнее значение неизвестно - считаем, что оно изменилось
+            changed = !previous || !IsSameValue(*previous, GetValue());
+        }
+        catch (...) {
+            // Вычисление прервано ограничением или отменой. Изменение уже
+            // применено, поэтому кэши зависимых ячеек просто сбрасываются, а
+            // ошибка повторится при чтении значения.
+            InvalidateCacheRecursive();
+            return;
+        }
+        if (changed) {
+            RecalculateDependents();
+        }
+        return;
+    }
     InvalidateCacheRecursive();
 }
 
+void Cell::RecalculateDependents() {
+    // Зависимые ячейки с вычисленными значениями в обратном порядке обхода в
+    // глубину. Невычисленные формулы и всё, что от них зависит, вычисляются
+    // при обращении и пересчёта не требуют.
+    std::vector<Cell*> order;
+    std::unordered_set<const Cell*> visited{ this };
+    std::vector<std::pair<Cell*, std::unordered_set<Cell*>::const_iterator>> stack;
+    stack.emplace_back(this, depend_.begin());
+    while (!stack.empty()) {
+        auto& [cell, next] = stack.back();
+        if (next == cell->depend_.end()) {
+            order.push_back(cell);
+            stack.pop_back();
+            continue;
+        }
+        
+        Cell* dependent = *next++;
+        if (dependent->impl_->GetCache().has_value() && visited.insert(dependent).second) {
+            stack.emplace_back(dependent, dependent->depend_.begin());
+        }
+    }
+    
+    // Формула пересчитывается, только если изменилась одна из её ссылок
+    std::unordered_set<const Cell*> dirty(depend_.begin(), depend_.end());
+    auto it = order.rbegin() + 1;
+    try {
+        for (; it != order.rend(); ++it) {
+            Cell* cell = *it;
+            if (dirty.count(cell) == 0) {
+                continue;
+            }
+            
+            const auto previous = cell->impl_->GetCache();
+            cell->sheet_.RecordChange(cell->position_, cell);
+            cell->impl_->ResetCache();
+            if (!IsSameValue(ToCellValue(*previous), cell->GetValue())) {
+                dirty.insert(cell->depend_.begin(), cell->depend_.end());
+            }
+        }
+    }
+    catch (...) {
+        // Вычисление прервано ограничением или отменой: значения оставшихся
+        // формул неизвестны, поэтому их кэши сбрасываются вместе с кэшами
+        // всех зависимых, как без ранней остановки
+        for (; it != order.rend(); ++it) {
+            Cell* cell = *it;
+            if (dirty.count(cell) == 0) {
+                continue;
+            }
+            if (cell->impl_->GetCache().has_value()) {
+                cell->sheet_.RecordChange(cell->position_, cell);
+                cell->impl_->ResetCache();
+            }
+            cell->InvalidateCacheRecursive();
+        }
+    }
+}
+
 void Cell::InvalidateCacheRecursive() {
-    for (const auto& dep_cell : depend_) {
-        // Проверяем наличие кэша в каждой зависимой ячейке
-        if (dep_cell->impl_->GetCache().has_value()) {
-            // Если кэш присутствует - сбрасываем его
-            dep_cell->impl_->ResetCache();
-            // Выполняем повторную рекурсию для данной зависимой ячейки
-            dep_cell->InvalidateCacheRecursive();
+    // Обход с явным стеком: цепочка зависимых ячеек может быть сколь угодно
+    // длинной
+    std::vector<const Cell*> stack{ this };
+    while (!stack.empty()) {
+        const Cell* cell = stack.back();
+        stack.pop_back();
+        for (const auto& dep_cell : cell->depend_) {
+            // Проверяем наличие кэша в каждой зависимой ячейке
+            if (dep_cell->impl_->GetCache().has_value()) {
+                // Если кэш присутствует - запоминаем значение для подписчиков
+                // и сбрасываем его
+                dep_cell->sheet_.RecordChange(dep_cell->position_, dep_cell);
+                dep_cell->impl_->ResetCache();
+                // Сброшенная ячейка обходится так же, как исходная
+                stack.push_back(dep_cell);
+            }
         }
     }
 }
 
 // Impl class
-std::vector<Position> Cell::Impl::GetReferencedCells() const {
-    return {};
+const std::vector<Position>& Cell::Impl::GetReferencedCells() const {
+    static const std::vector<Position> no_references;
+    return no_references;
+}
+
+const std::vector<SheetReference>& Cell::Impl::GetSheetReferences() const {
+    static const std::vector<SheetReference> no_references;
+    return no_references;
+}
+
+bool Cell::Impl::IsEmpty() const {
+    return false;
+}
+
+bool Cell::Impl::IsFormula() const {
+    return false;
+}
+
+const FormulaInterface* Cell::Impl::GetFormula() const {
+    return nullptr;
+}
+
+std::shared_ptr<const FormulaInterface> Cell::Impl::ShareFormula() const {
+    return nullptr;
 }
 
 std::optional<FormulaInterface::Value> Cell::Impl::GetCache() const {
@@ -151,15 +557,32 @@ std::optional<FormulaInterface::Value> Cell::Impl::GetCache() const {
 
 void Cell::Impl::ResetCache() {}
 
+void Cell::Impl::PutCache(const FormulaInterface::Value& /* value */) const {}
+
 // EmptyImpl class
 CellInterface::Value Cell::EmptyImpl::GetValue() const {
     return ""s;
 }
 
+NumberStatus Cell::EmptyImpl::GetNumber(double& number) const {
+    number = 0.0;
+    return NumberStatus::Empty;
+}
+
 std::string Cell::EmptyImpl::GetText() const {
     return ""s;
 }
 
+void Cell::EmptyImpl::PrintText(std::ostream& /* output */) const {}
+
+void Cell::EmptyImpl::AddMemoryUsage(SheetMemoryUsage& usage) const {
+    usage.impls += sizeof(EmptyImpl);
+}
+
+bool Cell::EmptyImpl::IsEmpty() const {
+    return true;
+}
+
 // TextImpl class
 Cell::TextImpl::TextImpl(std::string expression) : value_(std::move(expression)) {}
 
@@ -171,20 +594,46 @@ CellInterface::Value Cell::TextImpl::GetValue() const {
     return value_;
 }
 
+NumberStatus Cell::TextImpl::GetNumber(double& number) const {
+    std::string_view text = value_;
+    if (text[0] == ESCAPE_SIGN) {
+        text.remove_prefix(1);
+    }
+    if (text.empty()) {
+        number = 0.0;
+        return NumberStatus::Empty;
+    }
+    
+    if (const auto parsed = ParseCellNumber(text)) {
+        number = *parsed;
+        return NumberStatus::Number;
+    }
+    number = std::numeric_limits<double>::quiet_NaN();
+    return NumberStatus::Text;
+}
+
 std::string Cell::TextImpl::GetText() const {
     return value_;
 }
 
+void Cell::TextImpl::PrintText(std::ostream& output) const {
+    output << value_;
+}
+
+void Cell::TextImpl::AddMemoryUsage(SheetMemoryUsage& usage) const {
+    usage.impls += sizeof(TextImpl);
+    usage.texts += memory_usage::StringHeapBytes(value_);
+}
+
 // FormulaImpl class
-Cell::FormulaImpl::FormulaImpl(std::string expression, const SheetInterface& sheet)
-    : formula_(ParseFormula(std::move(expression))), sheet_(sheet) {}
+Cell::FormulaImpl::FormulaImpl(std::string expression, const SheetInterface& sheet, const SheetOptions& options)
+    : formula_(ParseFormula(std::move(expression), options.evaluation_backend)), sheet_(sheet), limits_(options.limits) {}
+
+Cell::FormulaImpl::FormulaImpl(std::shared_ptr<FormulaInterface> formula, const SheetInterface& sheet, const SheetOptions& options)
+    : formula_(std::move(formula)), sheet_(sheet), limits_(options.limits) {}
 
 CellInterface::Value Cell::FormulaImpl::GetValue() const {
-    if (!cache_.has_value()) {
-        cache_ = formula_->Evaluate(sheet_);
-    }
-    
-    auto value = formula_->Evaluate(sheet_);
+    const auto value = Evaluate();
     if (std::holds_alternative<double>(value)) {
         return std::get<double>(value);
     }
@@ -192,18 +641,80 @@ CellInterface::Value Cell::FormulaImpl::GetValue() const {
     return std::get<FormulaError>(value);
 }
 
+NumberStatus Cell::FormulaImpl::GetNumber(double& number) const {
+    const auto value = Evaluate();
+    if (std::holds_alternative<double>(value)) {
+        number = std::get<double>(value);
+        return NumberStatus::Number;
+    }
+    
+    number = std::numeric_limits<double>::quiet_NaN();
+    return NumberStatus::Error;
+}
+
+FormulaInterface::Value Cell::FormulaImpl::Evaluate() const {
+    auto value = cache_.Get();
+    if (!value.has_value()) {
+        EvaluationScope scope(limits_);
+        value = formula_->Evaluate(sheet_);
+        cache_.Put(*value);
+    }
+    
+    return *value;
+}
+
 std::string Cell::FormulaImpl::GetText() const {
     return FORMULA_SIGN + formula_->GetExpression();
 }
 
-std::vector<Position> Cell::FormulaImpl::GetReferencedCells() const {
+void Cell::FormulaImpl::PrintText(std::ostream& output) const {
+    output << FORMULA_SIGN << formula_->GetExpression();
+}
+
+void Cell::FormulaImpl::AddMemoryUsage(SheetMemoryUsage& usage) const {
+    usage.impls += sizeof(FormulaImpl) - sizeof(ValueCache);
+    usage.caches += sizeof(ValueCache);
+    usage.formulas += formula_->GetMemoryUsage() + memory_usage::SHARED_CONTROL_BLOCK_BYTES;
+}
+
+const std::vector<Position>& Cell::FormulaImpl::GetReferencedCells() const {
     return formula_->GetReferencedCells();
 }
 
+const std::vector<SheetReference>& Cell::FormulaImpl::GetSheetReferences() const {
+    return formula_->GetSheetReferences();
+}
+
+bool Cell::FormulaImpl::IsFormula() const {
+    return true;
+}
+
+const FormulaInterface* Cell::FormulaImpl::GetFormula() const {
+    return formula_.get();
+}
+
+std::shared_ptr<const FormulaInterface> Cell::FormulaImpl::ShareFormula() const {
+    shared_ = true;
+    return formula_;
+}
+
+FormulaInterface& Cell::FormulaImpl::GetMutableFormula() {
+    if (shared_) {
+        formula_ = formula_->Clone();
+        shared_ = false;
+    }
+    
+    return *formula_;
+}
+
 void Cell::FormulaImpl::ResetCache() {
-    cache_.reset();
+    cache_.Reset();
 }
 
 std::optional<FormulaInterface::Value> Cell::FormulaImpl::GetCache() const {
-    return cache_;
+    return cache_.Get();
+}
+
+void Cell::FormulaImpl::PutCache(const FormulaInterface::Value& value) const {
+    cache_.Put(value);
 }
\ No newline at end of file
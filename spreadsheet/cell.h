@@ -2,26 +2,159 @@
 
 #include "common.h"
 #include "formula.h"
+#include "memory_usage.h"
+#include "value_cache.h"
 
+#include <cstdint>
+#include <functional>
 #include <optional>
 #include <unordered_set>
 
+class Sheet;
+
+// Учёт ограничений SheetLimits при вычислении формул в текущем потоке.
+// Область открывается на каждое вычисление формулы и на запрос таблицы;
+// глубина цепочки берётся из GetCellReadDepth(), а самая внешняя область
+// задаёт срок запроса. Время проверяется раз в DEADLINE_CHECK_PERIOD вычислений.
+class EvaluationScope {
+public:
+    explicit EvaluationScope(const SheetLimits& limits);
+    ~EvaluationScope();
+
+    EvaluationScope(const EvaluationScope&) = delete;
+    EvaluationScope& operator=(const EvaluationScope&) = delete;
+
+    static constexpr unsigned DEADLINE_CHECK_PERIOD = 64;
+
+private:
+    bool owns_deadline_ = false;
+};
+
+// Вид значения ячейки, прочитанного как число (Cell::GetNumber)
+enum class NumberStatus : uint8_t {
+    // Число, формула с числовым значением или текст, записывающий число
+    Number,
+    // Ячейки нет или её значение - пустая строка; число равно нулю
+    Empty,
+    // Текст, который не является числом; число - NaN
+    Text,
+    // Ошибка формулы; число - NaN
+    Error,
+};
+
+// Ячейка таблицы.
+// Режим одновременного чтения: пока таблица не изменяется, методы GetValue(),
+// GetText() и GetReferencedCells() можно вызывать из любого числа потоков.
+// Значения формул кэшируются без глобальной блокировки, поэтому чтение
+// масштабируется с числом потоков. Изменение ячеек (Set, Clear) требует,
+// чтобы в это время никто не читал таблицу.
 class Cell : public CellInterface {
+    class Impl;
+
 public:
-    explicit Cell(SheetInterface& sheet);
+    // Содержимое ячейки, сохранённое журналом изменений таблицы.
+    // Позволяет вернуть ячейке прежнее содержимое без повторного разбора
+    // формулы и проверки циклических зависимостей.
+    class Content {
+    public:
+        Content();
+        Content(Content&&) noexcept;
+        Content& operator=(Content&&) noexcept;
+        ~Content();
+
+        bool IsEmpty() const;
+        // Учёт памяти сохранённого содержимого в usage
+        void AddMemoryUsage(SheetMemoryUsage& usage) const;
+
+    private:
+        friend class Cell;
+        std::unique_ptr<Impl> impl_;
+    };
+
+    explicit Cell(Sheet& sheet);
     
-    // Установка текста ячейки
-    void Set(std::string text);
+    // Установка текста ячейки. Если передан previous и содержимое ячейки
+    // изменилось, прежнее содержимое переносится в previous.
+    void Set(std::string text, Content* previous = nullptr);
     // Очистка ячейки
-    void Clear();
+    void Clear(Content* previous = nullptr);
+    // Обмен содержимого ячейки с сохранённым. Зависимости восстанавливаются по
+    // ссылкам сохранённой формулы, кэш ячейки и зависимых ячеек сбрасывается.
+    // Используется для отмены и повтора изменений, когда сохранённое содержимое
+    // уже было корректным в том же состоянии таблицы.
+    void ExchangeContent(Content& content);
     // Получение значения ячейки
     Value GetValue() const override;
+    // Получение значения ячейки в виде числа, как его видит формула, без
+    // построения Value и копирования текста
+    NumberStatus GetNumber(double& number) const;
     // Получение текста ячейки
     std::string GetText() const override;
     // Получение списка ячеек, на которые ссылается текущая ячейка
     std::vector<Position> GetReferencedCells() const override;
+    // Печать текста ячейки в поток без построения строки
+    void PrintText(std::ostream& output) const;
+    // Проверка, пуст ли текст ячейки
+    bool IsEmpty() const;
+    // Проверка, содержит ли ячейка формулу, без копирования формулы
+    bool IsFormula() const;
+    // Получение разобранной формулы ячейки без передачи владения, для
+    // остальных ячеек - nullptr
+    const FormulaInterface* GetFormula() const;
+    // Передача формулы ячейки в снимок таблицы, для остальных ячеек -
+    // nullptr. Формула отмечается разделённой, и следующее изменение ссылок
+    // выполняется на копии. Вызывается только из изменяющего потока.
+    std::shared_ptr<const FormulaInterface> ShareFormula() const;
+    // Проверка, вычислено ли уже значение формулы ячейки
+    bool HasCachedValue() const;
+    // Запись значения формулы, вычисленного вне ячейки (например, поблочно).
+    // Значение должно совпадать с результатом формулы в текущем состоянии
+    // таблицы. Если значение уже вычислено, ничего не делает.
+    void CacheValue(const FormulaInterface::Value& value) const;
+
+    // Таблица, которой принадлежит ячейка
+    Sheet& GetSheet() const;
+    // Есть ли в формуле ячейки ссылки на другие листы книги
+    bool HasSheetReferences() const;
+    // Снятие и восстановление зависимостей ячейки. Нужны, когда ссылки на
+    // другие листы начинают указывать на другие ячейки: при добавлении листа
+    // в книгу и при сдвиге ячеек листа, на который ссылается формула.
+    void UnlinkReferences();
+    void RelinkReferences();
+
+    // Учёт памяти ячейки, её содержимого и связей в usage. Узел хранилища
+    // таблицы не учитывается.
+    void AddMemoryUsage(SheetMemoryUsage& usage) const;
+
+    // Позиция ячейки в таблице. Задаётся таблицей при добавлении и сдвиге
+    // ячейки; у ячейки вне таблицы - последняя позиция в ней.
+    Position GetPosition() const;
+    void SetPosition(Position pos);
 
     bool IsReferenced() const;
+    // Проверка, есть ли ячейки, которые зависят от текущей
+    bool HasDependents() const;
+    // Получение ячеек, которые зависят от текущей
+    const std::unordered_set<Cell*>& GetDependents() const;
+    // Получение ячеек, на которые ссылается формула текущей ячейки
+    const std::unordered_set<Cell*>& GetReferences() const;
+    // Привязка формул, которые ссылались на пустую позицию, к появившейся на
+    // ней ячейке
+    void AttachDependents(const std::vector<Cell*>& dependents);
+    // Отвязка зависимых формул перед удалением ячейки из таблицы.
+    // Возвращает отвязанные ячейки.
+    std::vector<Cell*> DetachDependents();
+    
+    // Применение вставки или удаления строк и столбцов к ссылкам формулы.
+    // Если часть ссылок указывала в удалённую область, зависимости ячейки
+    // перестраиваются, а кэш сбрасывается. Возвращает результат обработки.
+    FormulaInterface::HandlingResult UpdateReferences(
+        const std::function<FormulaInterface::HandlingResult(FormulaInterface&)>& update);
+    // Замена формулы копией, к ссылкам которой применено rewrite. Прежнее
+    // содержимое переносится в previous, зависимости перестраиваются по новым
+    // ссылкам, кэш сбрасывается. Нужна, когда журнал должен вернуть формуле
+    // ссылки, которые нельзя восстановить обратным изменением (#REF!).
+    void RewriteReferences(const std::function<void(FormulaInterface&)>& rewrite, Content* previous);
     
 private:
     class Impl {
@@ -30,23 +163,49 @@ private:
         
         // Виртуальная функция получения значения ячейки
         virtual Value GetValue() const = 0;
+        // Виртуальная функция получения значения ячейки в виде числа
+        virtual NumberStatus GetNumber(double& number) const = 0;
         // Виртуальная функция получения текста ячейки
         virtual std::string GetText() const = 0;
         // Виртуальная функция получения списка ячеек, на которые ссылается текущая ячейка
-        virtual std::vector<Position> GetReferencedCells() const;
+        virtual const std::vector<Position>& GetReferencedCells() const;
+        // Виртуальная функция получения ссылок на ячейки других листов
+        virtual const std::vector<SheetReference>& GetSheetReferences() const;
+        // Виртуальная функция печати текста ячейки без промежуточной строки
+        virtual void PrintText(std::ostream& output) const = 0;
+        // Виртуальная функция учёта памяти содержимого ячейки
+        virtual void AddMemoryUsage(SheetMemoryUsage& usage) const = 0;
+        // Виртуальная функция проверки, пуст ли текст ячейки
+        virtual bool IsEmpty() const;
+        // Виртуальная функция проверки, содержит ли ячейка формулу
+        virtual bool IsFormula() const;
+        // Виртуальная функция получения разобранной формулы ячейки
+        virtual const FormulaInterface* GetFormula() const;
+        // Виртуальная функция передачи формулы ячейки в снимок
+        virtual std::shared_ptr<const FormulaInterface> ShareFormula() const;
         
         // Виртуальная функция получения кэша вычисленного значения ячейки
         virtual std::optional<FormulaInterface::Value> GetCache() const;
         // Виртуальная функция сброса кэша вычисленного значения ячейки
         virtual void ResetCache();
+        // Виртуальная функция записи вычисленного значения в кэш
+        virtual void PutCache(const FormulaInterface::Value& value) const;
     };
 
     class EmptyImpl : public Impl {
     public:
         // Реализация функции получения значения пустой ячейки
         Value GetValue() const override;
+        // Реализация функции получения числа пустой ячейки
+        NumberStatus GetNumber(double& number) const override;
         // Реализация функции получения текста пустой ячейки
         std::string GetText() const override;
+        // Реализация функции печати текста пустой ячейки
+        void PrintText(std::ostream& output) const override;
+        // Реализация функции учёта памяти пустой ячейки
+        void AddMemoryUsage(SheetMemoryUsage& usage) const override;
+        // Реализация функции проверки пустой ячейки
+        bool IsEmpty() const override;
     };
 
     class TextImpl : public Impl {
@@ -56,8 +215,14 @@ private:
         
         // Реализация функции получения значения текстовой ячейки
         Value GetValue() const override;
+        // Реализация функции получения числа текстовой ячейки
+        NumberStatus GetNumber(double& number) const override;
         // Реализация функции получения текста текстовой ячейки
         std::string GetText() const override;
+        // Реализация функции печати текста текстовой ячейки
+        void PrintText(std::ostream& output) const override;
+        // Реализация функции учёта памяти текстовой ячейки
+        void AddMemoryUsage(SheetMemoryUsage& usage) const override;
         
     private:
         // Значение текстовой ячейки
@@ -67,46 +232,106 @@ private:
     class FormulaImpl : public Impl {
     public:
         // Конструктор класса FormulaImpl с формулой и ссылкой на таблицу
-        explicit FormulaImpl(std::string expression, const SheetInterface& sheet);
+        explicit FormulaImpl(std::string expression, const SheetInterface& sheet, const SheetOptions& options);
+        // Конструктор класса FormulaImpl с готовой формулой
+        FormulaImpl(std::shared_ptr<FormulaInterface> formula, const SheetInterface& sheet, const SheetOptions& options);
         
         // Реализация функции получения значения ячейки с формулой
         Value GetValue() const override;
+        // Реализация функции получения числа ячейки с формулой
+        NumberStatus GetNumber(double& number) const override;
         // Реализация функции получения текста ячейки с формулой
         std::string GetText() const override;
+        // Реализация функции печати текста ячейки с формулой
+        void PrintText(std::ostream& output) const override;
+        // Реализация функции учёта памяти ячейки с формулой. Формула,
+        // разделённая со снимками, учитывается целиком.
+        void AddMemoryUsage(SheetMemoryUsage& usage) const override;
         // Реализация функции получения списка ячеек, на которые ссылается ячейка с формулой
-        std::vector<Position> GetReferencedCells() const override;
+        const std::vector<Position>& GetReferencedCells() const override;
+        // Реализация функции получения ссылок на ячейки других листов
+        const std::vector<SheetReference>& GetSheetReferences() const override;
+        // Реализация функции проверки ячейки с формулой
+        bool IsFormula() const override;
+        // Реализация функции получения разобранной формулы
+        const FormulaInterface* GetFormula() const override;
+        // Реализация функции передачи формулы в снимок
+        std::shared_ptr<const FormulaInterface> ShareFormula() const override;
+        // Получение формулы для изменения ссылок. Если формула была передана
+        // в снимок таблицы, ячейка получает собственную копию.
+        FormulaInterface& GetMutableFormula();
         
         // Получение кэша вычисленного значения формулы ячейки
         std::optional<FormulaInterface::Value> GetCache() const;
         // Сброс кэша вычисленного значения формулы ячейки
         void ResetCache();
+        // Запись вычисленного значения формулы в кэш
+        void PutCache(const FormulaInterface::Value& value) const;
         
     private:
-        // Указатель на объект формулы
-        std::unique_ptr<FormulaInterface> formula_;
+        // Значение формулы из кэша или вычисленное
+        FormulaInterface::Value Evaluate() const;
+        
+        // Указатель на объект формулы. Формула может разделяться со снимками
+        // таблицы, поэтому изменяется только через GetMutableFormula().
+        std::shared_ptr<FormulaInterface> formula_;
+        // Формула передана в снимок. Снимки освобождают ссылки в других
+        // потоках без синхронизации, поэтому use_count() не доказывает, что
+        // формула принадлежит только ячейке; отметка снимается копированием.
+        mutable bool shared_ = false;
         // Ссылка на таблицу
         const SheetInterface& sheet_;
-        // Кэш вычисленного значения формулы ячейки
-        mutable std::optional<FormulaInterface::Value> cache_;
+        // Ограничения таблицы для вычисления
+        const SheetLimits& limits_;
+        // Кэш вычисленного значения формулы ячейки, безопасный для
+        // одновременного чтения
+        ValueCache cache_;
+    };
+    
+    // Ячейка, на которую ссылается формула: позиция в своей или другой таблице
+    struct Target {
+        Sheet* sheet;
+        Position pos;
     };
+    // Ссылки содержимого impl на ячейки этой и других таблиц книги. Ссылки
+    // на листы, которых нет в книге, пропускаются.
+    std::vector<Target> ResolveReferences(const Impl& impl) const;
     
-    // Проверка, является ли ячейка зависимой от других ячеек
-    void CheckDependency(const std::vector<Position>& dep_cell) const;
-    // Проверка на циклическую зависимость между ячейками
-    void CheckCircularDepend(const std::vector<Position>& dep_cell, std::unordered_set<CellInterface*>& ref_cells) const;
+    // Проверка, что ссылки dep_cell не замыкают цикл через текущую ячейку.
+    // Обход в глубину с явным стеком идёт по связям ячеек, посещённые ячейки
+    // отмечаются номером проверки.
+    void CheckDependency(const std::vector<Target>& dep_cell) const;
     
-    // Очистка кэша значения ячейки
-    void InvalidateCache();
+    // Значение ячейки до изменения для ранней остановки пересчёта. nullopt,
+    // если таблица не использует раннюю остановку или формула не вычислена.
+    std::optional<Value> GetPreviousValue() const;
+    // Очистка кэша значения ячейки. previous - значение до изменения: если
+    // таблица использует раннюю остановку и значение не изменилось, зависимые
+    // ячейки не пересчитываются. Не бросает исключений вычисления: если
+    // пересчёт прерван ограничением или отменой, кэши зависимых ячеек
+    // сбрасываются.
+    void InvalidateCache(const std::optional<Value>& previous = std::nullopt);
+    // Пересчёт зависимых ячеек в топологическом порядке с остановкой на
+    // формулах, значения которых не изменились. Если вычисление бросило
+    // исключение, оставшиеся формулы сбрасываются вместе с зависимыми.
+    void RecalculateDependents();
     // Рекурсивная очистка кэша значения ячейки и всех ячеек, от которых она зависит
     void InvalidateCacheRecursive();
-    // Обновление списка зависимых ячеек
-    void UpdateDependencies(const std::vector<Position>& new_ref_cells);
+    // Вычисление зависимостей явным стеком перед вычислением формулы глубоко
+    // в цепочке, чтобы не углублять рекурсию
+    void PrepareDeepEvaluation() const;
+    // Обновление списка зависимых ячеек: old_ref_cells - ссылки, по которым
+    // ячейка связана сейчас, new_ref_cells - новые ссылки
+    void UpdateDependencies(const std::vector<Target>& old_ref_cells, const std::vector<Target>& new_ref_cells);
     
     // Ссылка на таблицу
-    SheetInterface& sheet_;
+    Sheet& sheet_;
+    Position position_ = Position::NONE;
     // Указатель на реализацию ячейки
     std::unique_ptr<Impl> impl_;
     // Отслеживание связей между ячейками
     std::unordered_set<Cell*> depend_; // Ячейки, которые зависят от других ячеек
     std::unordered_set<Cell*> reference_; // Ячейки от которых зависят другие ячейки
+    // Номер последней проверки циклических зависимостей, посетившей ячейку
+    mutable uint64_t visit_epoch_ = 0;
 };
\ No newline at end of file
@@ -0,0 +1,116 @@
+#include "cell_index.h"
+
+#include <algorithm>
+
+template <typename Value>
+void PositionIndex<Value>::Insert(Position pos, Value value) {
+    InsertInto(rows_, pos.row, pos.col, value);
+    InsertInto(cols_, pos.col, pos.row, value);
+}
+
+template <typename Value>
+void PositionIndex<Value>::Erase(Position pos) {
+    EraseFrom(rows_, pos.row, pos.col);
+    EraseFrom(cols_, pos.col, pos.row);
+}
+
+template <typename Value>
+void PositionIndex<Value>::Clear() {
+    rows_.clear();
+    cols_.clear();
+}
+
+template <typename Value>
+void PositionIndex<Value>::ShiftRows(int first, int delta) {
+    Shift(rows_, cols_, first, delta);
+}
+
+template <typename Value>
+void PositionIndex<Value>::ShiftCols(int first, int delta) {
+    Shift(cols_, rows_, first, delta);
+}
+
+template <typename Value>
+Size PositionIndex<Value>::GetBounds() const {
+    if (rows_.empty()) {
+        return { 0, 0 };
+    }
+    return { rows_.rbegin()->first + 1, cols_.rbegin()->first + 1 };
+}
+
+template <typename Value>
+size_t PositionIndex<Value>::GetMemoryUsage() const {
+    // Узел красно-чёрного дерева: цвет, три указателя и элемент (libstdc++)
+    constexpr size_t NODE_HEADER = 4 * sizeof(void*);
+    size_t bytes = (NODE_HEADER + sizeof(typename Lines::value_type)) * (rows_.size() + cols_.size());
+    for (const Lines* lines : { &rows_, &cols_ }) {
+        for (const auto& [line, entries] : *lines) {
+            bytes += entries.capacity() * sizeof(Entry);
+        }
+    }
+    return bytes;
+}
+
+template <typename Value>
+void PositionIndex<Value>::InsertInto(Lines& lines, int line, int index, Value value) {
+    auto& entries = lines[line];
+    const auto it = std::lower_bound(entries.begin(), entries.end(), index, IndexLess{});
+    if (it != entries.end() && it->index == index) {
+        it->value = value;
+        return;
+    }
+    entries.insert(it, { index, value });
+}
+
+template <typename Value>
+void PositionIndex<Value>::EraseFrom(Lines& lines, int line, int index) {
+    const auto it = lines.find(line);
+    if (it == lines.end()) {
+        return;
+    }
+
+    auto& entries = it->second;
+    const auto entry = std::lower_bound(entries.begin(), entries.end(), index, IndexLess{});
+    if (entry == entries.end() || entry->index != index) {
+        return;
+    }
+    entries.erase(entry);
+    if (entries.empty()) {
+        lines.erase(it);
+    }
+}
+
+template <typename Value>
+void PositionIndex<Value>::Shift(Lines& lines, Lines& crossing, int first, int delta) {
+    // Поперечные линии, в которых есть сдвигаемые позиции: в них меняются
+    // номера позиций, порядок внутри линии сохраняется
+    std::vector<int> touched;
+    for (auto it = lines.lower_bound(first); it != lines.end(); ++it) {
+        for (const Entry& entry : it->second) {
+            touched.push_back(entry.index);
+        }
+    }
+    std::sort(touched.begin(), touched.end());
+    touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+    for (int line : touched) {
+        auto& entries = crossing.at(line);
+        for (auto it = std::lower_bound(entries.begin(), entries.end(), first, IndexLess{}); it != entries.end(); ++it) {
+            it->index += delta;
+        }
+    }
+
+    // Узлы переносятся под новые ключи без копирования массивов. Сдвиг
+    // сохраняет порядок, а новые ключи больше оставшихся, поэтому узлы
+    // вставляются в конец дерева.
+    std::vector<typename Lines::node_type> nodes;
+    for (auto it = lines.lower_bound(first); it != lines.end();) {
+        nodes.push_back(lines.extract(it++));
+    }
+    for (auto& node : nodes) {
+        node.key() += delta;
+        lines.insert(lines.end(), std::move(node));
+    }
+}
+
+template class PositionIndex<Cell*>;
+template class PositionIndex<const std::vector<Cell*>*>;
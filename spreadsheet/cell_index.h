@@ -0,0 +1,134 @@
+#pragma once
+
+#include "common.h"
+
+#include <algorithm>
+#include <map>
+#include <ostream>
+#include <vector>
+
+class Cell;
+
+// Упорядоченный индекс позиций таблицы: непустые строки хранятся в дереве по
+// номеру строки, а позиции каждой строки - в массиве, отсортированном по
+// столбцам; столбцы хранятся так же. Обход в порядке строк, поиск в
+// прямоугольнике и обход полосы строк или столбцов пропускают пустые строки
+// целиком, не ищут позиции в хэш-таблице и стоят O(занятых позиций), а не
+// O(площади). С каждой позицией хранится значение Value.
+template <typename Value>
+class PositionIndex {
+public:
+    void Insert(Position pos, Value value);
+    void Erase(Position pos);
+    void Clear();
+
+    // Сдвиг позиций строк (столбцов), начиная с first, на delta. Сдвинутые
+    // позиции не должны выходить за пределы таблицы и совпадать с оставшимися.
+    void ShiftRows(int first, int delta);
+    void ShiftCols(int first, int delta);
+
+    // Наименьший прямоугольник от A1, содержащий все позиции
+    Size GetBounds() const;
+
+    // Память индекса в байтах
+    size_t GetMemoryUsage() const;
+
+    // Обход позиций по строкам, в строке - по возрастанию столбцов:
+    // callback(Position, Value)
+    template <typename Callback>
+    void ForEach(Callback callback) const {
+        for (const auto& [row, entries] : rows_) {
+            for (const Entry& entry : entries) {
+                callback(Position{ row, entry.index }, entry.value);
+            }
+        }
+    }
+
+    // Обход позиций прямоугольника size с левым верхним углом top_left в том
+    // же порядке
+    template <typename Callback>
+    void ForEachIn(Position top_left, Size size, Callback callback) const {
+        const auto last_row = rows_.lower_bound(top_left.row + size.rows);
+        for (auto row = rows_.lower_bound(top_left.row); row != last_row; ++row) {
+            const auto& entries = row->second;
+            const auto last = std::lower_bound(entries.begin(), entries.end(), top_left.col + size.cols, IndexLess{});
+            for (auto it = std::lower_bound(entries.begin(), last, top_left.col, IndexLess{}); it != last; ++it) {
+                callback(Position{ row->first, it->index }, it->value);
+            }
+        }
+    }
+
+    // Обход позиций строк [first, last) в том же порядке
+    template <typename Callback>
+    void ForEachInRows(int first, int last, Callback callback) const {
+        const auto end = rows_.lower_bound(last);
+        for (auto row = rows_.lower_bound(first); row != end; ++row) {
+            for (const Entry& entry : row->second) {
+                callback(Position{ row->first, entry.index }, entry.value);
+            }
+        }
+    }
+
+    // Обход позиций столбцов [first, last) по столбцам, в столбце - по
+    // возрастанию строк
+    template <typename Callback>
+    void ForEachInCols(int first, int last, Callback callback) const {
+        const auto end = cols_.lower_bound(last);
+        for (auto col = cols_.lower_bound(first); col != end; ++col) {
+            for (const Entry& entry : col->second) {
+                callback(Position{ entry.index, col->first }, entry.value);
+            }
+        }
+    }
+
+private:
+    // Позиция строки (столбца): номер столбца (строки) и значение
+    struct Entry {
+        int index;
+        Value value;
+    };
+    struct IndexLess {
+        bool operator()(const Entry& entry, int index) const {
+            return entry.index < index;
+        }
+    };
+    using Lines = std::map<int, std::vector<Entry>>;
+
+    static void InsertInto(Lines& lines, int line, int index, Value value);
+    static void EraseFrom(Lines& lines, int line, int index);
+    // Сдвиг линий lines, начиная с first, и тех же позиций в поперечных
+    // линиях crossing. Стоит O(сдвигаемых позиций).
+    static void Shift(Lines& lines, Lines& crossing, int first, int delta);
+
+    // Позиции строк по столбцам и позиции столбцов по строкам
+    Lines rows_;
+    Lines cols_;
+};
+
+// Ячейки таблицы по позициям
+using CellIndex = PositionIndex<Cell*>;
+
+// Печать ячеек, которые for_each перечисляет в порядке строк, таблицей size:
+// значения разделяются табуляцией, строки - переводом строки, пропущенные
+// позиции остаются пустыми
+template <typename ForEach, typename PrintCell>
+void PrintInRowOrder(std::ostream& output, Size size, ForEach for_each, PrintCell print_cell) {
+    int row = 0;
+    int col = 0;
+    auto advance_to = [&](Position pos) {
+        for (; row < pos.row; ++row, col = 0) {
+            for (; col + 1 < size.cols; ++col) {
+                output << '\t';
+            }
+            output << '\n';
+        }
+        for (; col < pos.col; ++col) {
+            output << '\t';
+        }
+    };
+    for_each([&](Position pos, const CellInterface& cell) {
+        advance_to(pos);
+        print_cell(cell);
+    });
+    advance_to({ size.rows, 0 });
+}
@@ -0,0 +1,88 @@
+#include "column_kernels.h"
+
+#include <cassert>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define SPREADSHEET_AVX2_KERNELS
+#include <immintrin.h>
+#endif
+
+namespace {
+    template <typename Op>
+    void ApplyScalar(const double* lhs, const double* rhs, double* out, size_t count, Op op) {
+        for (size_t i = 0; i < count; ++i) {
+            out[i] = op(lhs[i], rhs[i]);
+        }
+    }
+
+    void ApplyScalar(char op, const double* lhs, const double* rhs, double* out, size_t count) {
+        switch (op) {
+            case '+':
+                ApplyScalar(lhs, rhs, out, count, [](double a, double b) { return a + b; });
+                break;
+            case '-':
+                ApplyScalar(lhs, rhs, out, count, [](double a, double b) { return a - b; });
+                break;
+            case '*':
+                ApplyScalar(lhs, rhs, out, count, [](double a, double b) { return a * b; });
+                break;
+            case '/':
+                ApplyScalar(lhs, rhs, out, count, [](double a, double b) { return a / b; });
+                break;
+            default:
+                assert(false);
+        }
+    }
+
+#ifdef SPREADSHEET_AVX2_KERNELS
+// Цикл по четыре значения; встроенные функции AVX2 можно вызывать только из
+// функции с атрибутом target("avx2"), поэтому цикл развёрнут макросом
+#define SPREADSHEET_AVX2_LOOP(INSTRUCTION)                                  \
+    for (; i + 4 <= count; i += 4) {                                        \
+        const __m256d a = _mm256_loadu_pd(lhs + i);                         \
+        const __m256d b = _mm256_loadu_pd(rhs + i);                         \
+        _mm256_storeu_pd(out + i, INSTRUCTION(a, b));                       \
+    }
+
+    __attribute__((target("avx2")))
+    void ApplyAvx2(char op, const double* lhs, const double* rhs, double* out, size_t count) {
+        size_t i = 0;
+        switch (op) {
+            case '+':
+                SPREADSHEET_AVX2_LOOP(_mm256_add_pd)
+                break;
+            case '-':
+                SPREADSHEET_AVX2_LOOP(_mm256_sub_pd)
+                break;
+            case '*':
+                SPREADSHEET_AVX2_LOOP(_mm256_mul_pd)
+                break;
+            case '/':
+                SPREADSHEET_AVX2_LOOP(_mm256_div_pd)
+                break;
+            default:
+                assert(false);
+        }
+
+        // Остаток, не кратный длине вектора
+        ApplyScalar(op, lhs + i, rhs + i, out + i, count - i);
+    }
+
+#undef SPREADSHEET_AVX2_LOOP
+
+    bool HasAvx2() {
+        static const bool has_avx2 = __builtin_cpu_supports("avx2");
+        return has_avx2;
+    }
+#endif
+}  // namespace
+
+void ApplyColumnOp(char op, const double* lhs, const double* rhs, double* out, size_t count) {
+#ifdef SPREADSHEET_AVX2_KERNELS
+    if (HasAvx2()) {
+        ApplyAvx2(op, lhs, rhs, out, count);
+        return;
+    }
+#endif
+    ApplyScalar(op, lhs, rhs, out, count);
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <cstddef>
+
+// Поэлементное применение операции op ('+', '-', '*', '/') к столбцам:
+// out[i] = lhs[i] op rhs[i]. Результат совпадает с обычной арифметикой
+// double. Если процессор поддерживает AVX2, используются векторные
+// инструкции, иначе - скалярный цикл.
+void ApplyColumnOp(char op, const double* lhs, const double* rhs, double* out, size_t count);
@@ -1,6 +1,9 @@
 #pragma once
 
+#include <chrono>
+#include <cstddef>
 #include <iosfwd>
+#include <limits>
 #include <memory>
 #include <stdexcept>
 #include <string>
@@ -18,14 +21,63 @@ struct Position {
 
     bool IsValid() const;
     std::string ToString() const;
+    // Запись позиции в буфер длиной не меньше MAX_STRING_LENGTH без выделения
+    // памяти. Возвращает количество записанных символов, для некорректной
+    // позиции - 0.
+    size_t ToChars(char* buffer) const;
 
-    static Position FromString(std::string_view str);
+    // Разбор позиции без выделения памяти. Может вычисляться при компиляции.
+    static constexpr Position FromString(std::string_view str);
 
     static const int MAX_ROWS = 16384;
     static const int MAX_COLS = 16384;
+    // Длина самой длинной корректной позиции: три буквы и пять цифр
+    static constexpr size_t MAX_STRING_LENGTH = 8;
+    static constexpr size_t MAX_LETTER_COUNT = 3;
     static const Position NONE;
 };
 
+constexpr Position Position::FromString(std::string_view str) {
+    constexpr Position none = { -1, -1 };
+
+    size_t letters = 0;
+    while (letters < str.size() && str[letters] >= 'A' && str[letters] <= 'Z') {
+        ++letters;
+    }
+    if (letters == 0 || letters > MAX_LETTER_COUNT || letters == str.size()) {
+        return none;
+    }
+
+    // Номер строки: только цифры, без знака и пробелов, в пределах int
+    int row = 0;
+    for (size_t i = letters; i < str.size(); ++i) {
+        if (str[i] < '0' || str[i] > '9') {
+            return none;
+        }
+        const int digit = str[i] - '0';
+        if (row > (std::numeric_limits<int>::max() - digit) / 10) {
+            return none;
+        }
+        row = row * 10 + digit;
+    }
+
+    int col = 0;
+    for (size_t i = 0; i < letters; ++i) {
+        col = col * 26 + (str[i] - 'A' + 1);
+    }
+
+    return { row - 1, col - 1 };
+}
+
+// Ссылка на ячейку другого листа книги: Sheet2!A1
+struct SheetReference {
+    std::string sheet;
+    Position pos;
+
+    bool operator==(const SheetReference& rhs) const;
+    bool operator<(const SheetReference& rhs) const;
+};
+
 struct Size {
     int rows = 0;
     int cols = 0;
@@ -76,6 +128,12 @@ public:
     using std::runtime_error::runtime_error;
 };
 
+// Исключение, выбрасываемое при превышении ограничения таблицы (SheetLimits)
+class LimitExceededException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
 class CellInterface {
 public:
     // Либо текст ячейки, либо значение формулы, либо сообщение об ошибке из
@@ -95,7 +153,8 @@ public:
 
     // Возвращает список ячеек, которые непосредственно задействованы в данной
     // формуле. Список отсортирован по возрастанию и не содержит повторяющихся
-    // ячеек. В случае текстовой ячейки список пуст.
+    // ячеек. В случае текстовой ячейки список пуст. Ссылки на другие листы
+    // (Sheet2!A1) в список не входят.
     virtual std::vector<Position> GetReferencedCells() const = 0;
 };
 
@@ -143,7 +202,66 @@ public:
     // соответственно. Пустая ячейка представляется пустой строкой в любом случае.
     virtual void PrintValues(std::ostream& output) const = 0;
     virtual void PrintTexts(std::ostream& output) const = 0;
+
+    // Возвращает лист с именем name из той же книги для ссылок вида
+    // name!A1 или nullptr, если такого листа нет. Отдельная таблица других
+    // листов не видит, и такие ссылки вычисляются в ошибку #REF!.
+    virtual const SheetInterface* GetLinkedSheet(std::string_view /* name */) const {
+        return nullptr;
+    }
+};
+
+// Способ вычисления формул таблицы. Все способы дают одинаковые значения,
+// включая ошибки и знак нуля.
+enum class EvaluationBackend {
+    // Обход дерева выражения
+    TreeWalk,
+    // Интерпретатор обратной польской записи
+    Rpn,
+    // Специализированные вычислители для частых видов формул и поблочное
+    // вычисление протянутых формул; остальные формулы - обходом дерева
+    Kernels,
+};
+
+// Пересчёт формул при изменении ячейки
+enum class RecalculationMode {
+    // Кэш всех зависимых формул сбрасывается, формулы вычисляются при
+    // следующем обращении
+    Invalidate,
+    // Зависимые формулы сразу пересчитываются в топологическом порядке.
+    // Формула пересчитывается, только если изменилось значение одной из
+    // ячеек, на которые она ссылается, поэтому распространение
+    // останавливается на формулах с прежним значением. Вставка и удаление
+    // строк и столбцов только сбрасывают кэш, как в Invalidate.
+    EarlyCutoff,
+};
+
+// Ограничения ресурсов таблицы. Нулевое значение снимает ограничение.
+// При превышении бросается LimitExceededException: при изменении ячейки
+// таблица не изменяется, при вычислении формулы остаются невычисленными.
+struct SheetLimits {
+    // Длина текста формулы без знака '='. Ограничивает и вложенность скобок,
+    // которую разбирает рекурсивный парсер.
+    size_t max_formula_length = 0;
+    // Число различных ячеек, на которые ссылается одна формула
+    size_t max_references = 0;
+    // Глубина цепочки зависимостей, которую нужно вычислить за один раз.
+    // Стек потока защищён и без ограничения: глубокие цепочки вычисляются
+    // с явным стеком продолжений.
+    size_t max_dependency_depth = 0;
+    // Число ячеек таблицы
+    size_t max_cells = 0;
+    // Время одного запроса на вычисление: GetValue() ячейки, Recalculate(),
+    // EvaluateRegion()
+    std::chrono::milliseconds max_evaluation_time{ 0 };
+};
+
+// Параметры создаваемой таблицы
+struct SheetOptions {
+    EvaluationBackend evaluation_backend = EvaluationBackend::Kernels;
+    RecalculationMode recalculation_mode = RecalculationMode::Invalidate;
+    SheetLimits limits;
 };
 
 // Создаёт готовую к работе пустую таблицу.
-std::unique_ptr<SheetInterface> CreateSheet();
\ No newline at end of file
+std::unique_ptr<SheetInterface> CreateSheet(SheetOptions options = {});
\ No newline at end of file
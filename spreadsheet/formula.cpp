@@ -1,9 +1,12 @@
 #include "formula.h"
 
 #include "FormulaAST.h"
+#include "column_kernels.h"
+#include "memory_usage.h"
 
+#include <algorithm>
+#include <cmath>
 #include <sstream>
-#include <set>
 
 using namespace std::literals;
 
@@ -11,16 +14,53 @@ std::ostream& operator<<(std::ostream& output, FormulaError fe) {
     return output << fe.ToString();
 }
 
+namespace {
+    // Признак отмены вычислений текущего потока
+    thread_local const CancellationToken* current_token = nullptr;
+}  // namespace
+
+CancellationToken::Scope::Scope(const CancellationToken& token) : previous_(current_token) {
+    current_token = &token;
+}
+
+CancellationToken::Scope::~Scope() {
+    current_token = previous_;
+}
+
+void CancellationToken::ThrowIfCancelled() {
+    if (current_token && current_token->IsCancelled()) {
+        throw EvaluationCancelledException("evaluation cancelled"s);
+    }
+}
+
 namespace {
     class Formula : public FormulaInterface {
     public:
-        Formula(std::string expression) : ast_(ParseFormulaAST(expression)) {};
+        Formula(FormulaAST ast, EvaluationBackend backend) : ast_(std::move(ast)), backend_(backend) {
+            if (backend_ == EvaluationBackend::Rpn) {
+                ast_.CompileRpn();
+            }
+            BuildExpressionAndReferences();
+        }
 
         Value Evaluate(const SheetInterface& sheet) const override {
+            // Отмена проверяется до вычисления, поэтому в кэш не попадает
+            // значение, вычисленное после неё
+            CancellationToken::ThrowIfCancelled();
             Value res;
             
             try {
-                res = ast_.Execute(sheet);
+                switch (backend_) {
+                    case EvaluationBackend::TreeWalk:
+                        res = ast_.ExecuteGeneric(sheet);
+                        break;
+                    case EvaluationBackend::Rpn:
+                        res = ast_.ExecuteRpn(sheet);
+                        break;
+                    case EvaluationBackend::Kernels:
+                        res = ast_.Execute(sheet);
+                        break;
+                }
             } catch (const FormulaError& err) {
                 res = err;
             }
@@ -28,28 +68,191 @@ namespace {
             return res;
         }
 
-        std::string GetExpression() const override {
+        const std::string& GetExpression() const override {
+            return expression_;
+        }
+
+        const std::vector<Position>& GetReferencedCells() const override {
+            return referenced_;
+        }
+
+        const std::vector<SheetReference>& GetSheetReferences() const override {
+            return ast_.GetSheetCells();
+        }
+
+        size_t GetMemoryUsage() const override {
+            return sizeof(*this) + ast_.GetMemoryUsage() + memory_usage::StringHeapBytes(expression_)
+                + memory_usage::VectorBytes(referenced_);
+        }
+
+        std::unique_ptr<FormulaInterface> Clone() const override {
+            return std::make_unique<Formula>(ast_.Clone(), backend_);
+        }
+
+        std::optional<ElementwiseShape> GetElementwiseShape() const override {
+            // Поблочное вычисление относится к специализированным вычислителям
+            if (backend_ != EvaluationBackend::Kernels) {
+                return std::nullopt;
+            }
+            return ast_.GetElementwiseShape();
+        }
+
+        HandlingResult HandleInsertedRows(int before, int count) override {
+            return UpdateReferences([before, count](Position& pos) {
+                return Insert(pos.row, before, count);
+            });
+        }
+
+        HandlingResult HandleInsertedCols(int before, int count) override {
+            return UpdateReferences([before, count](Position& pos) {
+                return Insert(pos.col, before, count);
+            });
+        }
+
+        HandlingResult HandleDeletedRows(int first, int count) override {
+            return UpdateReferences([first, count](Position& pos) {
+                return Delete(pos, pos.row, first, count);
+            });
+        }
+
+        HandlingResult HandleDeletedCols(int first, int count) override {
+            return UpdateReferences([first, count](Position& pos) {
+                return Delete(pos, pos.col, first, count);
+            });
+        }
+
+    private:
+        // Применение изменения к каждой корректной ссылке формулы
+        template <typename Update>
+        HandlingResult UpdateReferences(Update update) {
+            HandlingResult result = HandlingResult::NothingChanged;
+            const auto& cells = ast_.GetCells();
+            for (size_t i = 0; i < cells.size(); ++i) {
+                if (!cells[i].IsValid()) {
+                    continue;
+                }
+                Position pos = cells[i].Unpack();
+                const auto cell_result = update(pos);
+                if (cell_result != HandlingResult::NothingChanged) {
+                    ast_.SetCell(i, pos);
+                    result = std::max(result, cell_result);
+                }
+            }
+            
+            if (result != HandlingResult::NothingChanged) {
+                BuildExpressionAndReferences();
+            }
+            
+            return result;
+        }
+
+        // Построение текста формулы и списка ссылок. Ссылки дерева различны и
+        // отсортированы при разборе, а сдвиг строк и столбцов сохраняет порядок
+        // корректных ссылок, поэтому достаточно убрать удалённые ссылки.
+        void BuildExpressionAndReferences() {
             std::ostringstream out;
             ast_.PrintFormula(out);
+            expression_ = out.str();
             
-            return out.str();
+            referenced_.clear();
+            for (const auto& pos : ast_.GetCells()) {
+                // Ссылки на удалённые ячейки не участвуют в зависимостях
+                if (pos.IsValid()) {
+                    referenced_.push_back(pos.Unpack());
+                }
+            }
+            referenced_.shrink_to_fit();
         }
 
-        std::vector<Position> GetReferencedCells() const override {
-            const auto& pos_list = ast_.GetCells();
-            std::set<Position> s(pos_list.begin(), pos_list.end());
+        static HandlingResult Insert(int& index, int before, int count) {
+            if (index < before) {
+                return HandlingResult::NothingChanged;
+            }
             
-            return { s.begin(), s.end() };
+            index += count;
+            return HandlingResult::ReferencesRenamedOnly;
+        }
+
+        static HandlingResult Delete(Position& pos, int& index, int first, int count) {
+            if (index < first) {
+                return HandlingResult::NothingChanged;
+            }
+            if (index < first + count) {
+                pos = Position::NONE;
+                return HandlingResult::ReferencesChanged;
+            }
+            
+            index -= count;
+            return HandlingResult::ReferencesRenamedOnly;
         }
 
-    private:
         FormulaAST ast_;
+        EvaluationBackend backend_;
+        // Текст формулы и отсортированный список ссылок без повторов
+        std::string expression_;
+        std::vector<Position> referenced_;
     };
 }  // namespace
 
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
+bool ElementwiseShape::IsFilledDownTo(const ElementwiseShape& other) const {
+    auto shifted = [](const Operand& lhs, const Operand& rhs) {
+        if (lhs.cell.has_value() != rhs.cell.has_value()) {
+            return false;
+        }
+        if (!lhs.cell) {
+            return lhs.value == rhs.value;
+        }
+        return rhs.cell->row == lhs.cell->row + 1 && rhs.cell->col == lhs.cell->col;
+    };
+
+    return op == other.op && shifted(lhs, other.lhs) && shifted(rhs, other.rhs);
+}
+
+void EvaluateColumn(const std::vector<ElementwiseShape>& shapes, const SheetInterface& sheet,
+                    std::vector<std::optional<FormulaInterface::Value>>& values) {
+    const size_t count = shapes.size();
+    values.assign(count, std::nullopt);
+    if (count == 0) {
+        return;
+    }
+
+    // Сбор операндов в непрерывные массивы. Строки с ошибкой чтения
+    // пропускаются: ошибку вернёт обычное вычисление формулы.
+    std::vector<double> lhs(count);
+    std::vector<double> rhs(count);
+    std::vector<bool> failed(count, false);
+    auto read = [&sheet](const ElementwiseShape::Operand& operand) {
+        return operand.cell ? ReadCellNumber(*operand.cell, sheet) : operand.value;
+    };
+    for (size_t i = 0; i < count; ++i) {
+        try {
+            lhs[i] = read(shapes[i].lhs);
+            rhs[i] = read(shapes[i].rhs);
+        } catch (const FormulaError&) {
+            failed[i] = true;
+            lhs[i] = rhs[i] = 0.0;
+        }
+    }
+
+    std::vector<double> result(count);
+    ApplyColumnOp(shapes.front().op, lhs.data(), rhs.data(), result.data(), count);
+
+    for (size_t i = 0; i < count; ++i) {
+        if (failed[i]) {
+            continue;
+        }
+        if (std::isfinite(result[i])) {
+            values[i] = result[i];
+        }
+        else {
+            values[i] = FormulaError(FormulaError::Category::Div0);
+        }
+    }
+}
+
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression, EvaluationBackend backend) {
     try {
-        return std::make_unique<Formula>(expression);
+        return std::make_unique<Formula>(ParseFormulaAST(expression), backend);
     } catch (...) {
         throw FormulaException("Parsing formula from expression was failure"s);
     }
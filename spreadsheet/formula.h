@@ -2,9 +2,30 @@
 
 #include "common.h"
 
+#include <atomic>
 #include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
 #include <vector>
 
+// Формула вида "a op b", где каждый операнд - ссылка на ячейку или число.
+// Такие формулы, протянутые вниз по столбцу, вычисляются блоками.
+struct ElementwiseShape {
+    struct Operand {
+        // Ссылка на ячейку; если пуста, операнд - число value
+        std::optional<Position> cell;
+        double value = 0.0;
+    };
+
+    char op = '+';
+    Operand lhs;
+    Operand rhs;
+
+    // Проверка, что other - та же формула, протянутая на строку вниз
+    bool IsFilledDownTo(const ElementwiseShape& other) const;
+};
+
 // Формула, позволяющая вычислять и обновлять арифметическое выражение.
 // Поддерживаемые возможности:
 // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
@@ -16,6 +37,13 @@ class FormulaInterface {
 public:
     using Value = std::variant<double, FormulaError>;
 
+    // Результат обработки вставки или удаления строк и столбцов
+    enum class HandlingResult {
+        NothingChanged,         // ссылки формулы не затронуты
+        ReferencesRenamedOnly,  // ссылки сдвинулись, значение формулы не изменилось
+        ReferencesChanged,      // часть ссылок указывала в удалённую область
+    };
+
     virtual ~FormulaInterface() = default;
 
     // Обратите внимание, что в метод Evaluate() ссылка на таблицу передаётся 
@@ -27,15 +55,148 @@ public:
     virtual Value Evaluate(const SheetInterface& sheet) const = 0;
 
     // Возвращает выражение, которое описывает формулу.
-    // Не содержит пробелов и лишних скобок.
-    virtual std::string GetExpression() const = 0;
+    // Не содержит пробелов и лишних скобок. Строка строится один раз при
+    // разборе и после изменения ссылок; ссылка на неё действительна, пока
+    // формула существует и не изменяется.
+    virtual const std::string& GetExpression() const = 0;
 
     // Возвращает список ячеек, которые непосредственно задействованы в вычислении
     // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
-    // ячеек.
-    virtual std::vector<Position> GetReferencedCells() const = 0;
+    // ячеек. Как и выражение, хранится в формуле и не строится заново.
+    virtual const std::vector<Position>& GetReferencedCells() const = 0;
+
+    // Возвращает ссылки на ячейки других листов книги (Sheet2!A1), отсортированные
+    // и без повторов. В GetReferencedCells они не входят.
+    virtual const std::vector<SheetReference>& GetSheetReferences() const = 0;
+
+    // Возвращает объём памяти, занятой формулой, вместе с самим объектом
+    virtual size_t GetMemoryUsage() const = 0;
+
+    // Возвращает независимую копию формулы
+    virtual std::unique_ptr<FormulaInterface> Clone() const = 0;
+
+    // Возвращает вид формулы, если она состоит из одной бинарной операции над
+    // ячейками и числами
+    virtual std::optional<ElementwiseShape> GetElementwiseShape() const {
+        return std::nullopt;
+    }
+
+    // Сдвигают ссылки формулы при вставке count строк (столбцов) перед строкой
+    // (столбцом) before. Позиции меняются прямо в дереве формулы, без её
+    // повторного разбора.
+    virtual HandlingResult HandleInsertedRows(int before, int count = 1) = 0;
+    virtual HandlingResult HandleInsertedCols(int before, int count = 1) = 0;
+
+    // Сдвигают ссылки формулы при удалении count строк (столбцов), начиная со
+    // строки (столбца) first. Ссылки на удалённые ячейки становятся
+    // некорректными: выражение выводит их как #REF!, а вычисление возвращает
+    // ошибку FormulaError::Category::Ref.
+    virtual HandlingResult HandleDeletedRows(int first, int count = 1) = 0;
+    virtual HandlingResult HandleDeletedCols(int first, int count = 1) = 0;
+};
+
+// Исключение, выбрасываемое вычислением формулы после отмены
+class EvaluationCancelledException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Признак отмены вычисления для фоновых потоков. Пока в потоке действует
+// CancellationToken::Scope, каждое вычисление формулы проверяет признак и
+// после отмены бросает EvaluationCancelledException. Без области проверка
+// сводится к чтению пустого указателя.
+class CancellationToken {
+public:
+    // Отмена может вызываться из любого потока
+    void Cancel() {
+        cancelled_.store(true, std::memory_order_relaxed);
+    }
+
+    bool IsCancelled() const {
+        return cancelled_.load(std::memory_order_relaxed);
+    }
+
+    // Привязка признака к вычислениям текущего потока
+    class Scope {
+    public:
+        explicit Scope(const CancellationToken& token);
+        ~Scope();
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        const CancellationToken* previous_;
+    };
+
+    // Бросает EvaluationCancelledException, если признак текущего потока
+    // отменён
+    static void ThrowIfCancelled();
+
+private:
+    std::atomic<bool> cancelled_{ false };
 };
 
-// Парсит переданное выражение и возвращает объект формулы.
+// Число, записанное текстом ячейки, как его видит формула: пустой текст -
+// ноль, текст, который целиком не является числом, - nullopt
+std::optional<double> ParseCellNumber(std::string_view text);
+
+// Глубина вложенных чтений ячеек формулами в текущем потоке
+size_t GetCellReadDepth();
+
+// Глубина чтений, начиная с которой ячейка перед вычислением формулы
+// вычисляет свои зависимости функцией EvaluateDependencies, а не рекурсивно.
+// Так расход стека потока ограничен при любой длине цепочки зависимостей.
+constexpr size_t MAX_RECURSIVE_READ_DEPTH = 128;
+
+// Вычисляет зависимости ячейки cell обходом в глубину с явным стеком:
+// pending(cell) возвращает непосредственные зависимости с невычисленными
+// значениями, evaluate(cell) вычисляет ячейку, зависимости которой уже
+// вычислены. Сама cell не вычисляется. max_depth ограничивает глубину
+// цепочки вместе с текущей глубиной чтений (0 - без ограничения); при
+// превышении бросается LimitExceededException.
+template <typename Cell, typename Pending, typename Evaluate>
+void EvaluateDependencies(const Cell& cell, Pending pending, Evaluate evaluate, size_t max_depth = 0) {
+    struct Frame {
+        const Cell* cell;
+        std::vector<const Cell*> dependencies;
+        size_t next = 0;
+    };
+
+    std::vector<Frame> stack;
+    stack.push_back({ &cell, pending(cell) });
+    while (!stack.empty()) {
+        auto& frame = stack.back();
+        if (frame.next == frame.dependencies.size()) {
+            const Cell* done = frame.cell;
+            stack.pop_back();
+            if (!stack.empty()) {
+                evaluate(*done);
+            }
+            continue;
+        }
+
+        const Cell* dependency = frame.dependencies[frame.next++];
+        if (max_depth != 0 && GetCellReadDepth() + stack.size() >= max_depth) {
+            throw LimitExceededException("dependency chain is too deep");
+        }
+        // Зависимость могла быть вычислена через другую ветвь обхода, тогда
+        // её список пуст
+        stack.push_back({ dependency, pending(*dependency) });
+    }
+}
+
+// Вычисляет формулы одного вида, протянутые по столбцу: значения операндов
+// собираются в непрерывные массивы, а операция выполняется над ними целиком
+// (векторными инструкциями, если процессор их поддерживает). Все формы
+// должны иметь одну операцию. Для строк, в которых чтение операнда вернуло
+// ошибку, values[i] остаётся пустым - такие формулы нужно вычислить обычным
+// способом.
+void EvaluateColumn(const std::vector<ElementwiseShape>& shapes, const SheetInterface& sheet,
+                    std::vector<std::optional<FormulaInterface::Value>>& values);
+
+// Парсит переданное выражение и возвращает объект формулы, которая
+// вычисляется способом backend.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression,
+                                               EvaluationBackend backend = EvaluationBackend::Kernels);
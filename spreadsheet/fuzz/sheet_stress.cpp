@@ -0,0 +1,722 @@
+#include "cell.h"
+#include "common.h"
+#include "formula.h"
+#include "sheet.h"
+
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iterator>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <optional>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <variant>
+#include <vector>
+
+// Стресс-тест таблицы: случайные последовательности SetCell и ClearCell на
+// небольшом поле. После каждого шага значения и тексты всех ячеек
+// сравниваются с эталоном, который не кэширует значения и не строит граф
+// зависимостей, а формулы разбирает, вычисляет и печатает собственным
+// кодом. Связи depend_/reference_ проверяются на симметричность.
+// Собирается как отдельная программа или, с SPREADSHEET_LIBFUZZER, как цель
+// libFuzzer; в обоих случаях рассчитан на запуск с санитайзерами.
+namespace {
+    constexpr int ROWS = 6;
+    constexpr int COLS = 6;
+    constexpr int STEPS = 300;
+    constexpr int READERS = 4;
+
+    using Value = CellInterface::Value;
+
+    // Источник решений: байты входа фаззера или генератор псевдослучайных
+    // чисел. Исчерпанный вход даёт нули.
+    class Choices {
+    public:
+        explicit Choices(uint32_t seed) : random_(seed) {}
+        Choices(const uint8_t* data, size_t size) : data_(data), size_(size) {}
+
+        // Число из [0, bound), bound не больше 256
+        uint32_t Next(uint32_t bound) {
+            if (!data_) {
+                return random_() % bound;
+            }
+            if (offset_ == size_) {
+                return 0;
+            }
+            return data_[offset_++] % bound;
+        }
+
+        bool Exhausted() const {
+            return data_ && offset_ == size_;
+        }
+
+    private:
+        std::mt19937 random_;
+        const uint8_t* data_ = nullptr;
+        size_t size_ = 0;
+        size_t offset_ = 0;
+    };
+
+    Position RandomPosition(Choices& choices) {
+        const int row = static_cast<int>(choices.Next(ROWS));
+        const int col = static_cast<int>(choices.Next(COLS));
+        return { row, col };
+    }
+
+    std::string RandomExpression(Choices& choices, int depth) {
+        switch (choices.Next(depth > 0 ? 6 : 2)) {
+        case 0:
+            return RandomPosition(choices).ToString();
+        case 1:
+            return std::to_string(choices.Next(10));
+        case 2:
+            return "(" + RandomExpression(choices, depth - 1) + ")";
+        case 3:
+            return "-" + RandomExpression(choices, depth - 1);
+        default: {
+            static const char operations[] = { '+', '-', '*', '/' };
+            const std::string lhs = RandomExpression(choices, depth - 1);
+            return lhs + operations[choices.Next(4)] + RandomExpression(choices, depth - 1);
+        }
+        }
+    }
+
+    std::string RandomText(Choices& choices) {
+        static const char* const special[] = { "text", "'=A1", "=", "=1+", "=A1)", "=(A1", "=*2" };
+        switch (choices.Next(8)) {
+        case 0:
+            return std::to_string(choices.Next(100));
+        case 1:
+            return special[choices.Next(std::size(special))];
+        default:
+            return FORMULA_SIGN + RandomExpression(choices, 3);
+        }
+    }
+
+    std::string Describe(const Value& value) {
+        std::ostringstream output;
+        std::visit([&output](const auto& x) {
+            using T = std::decay_t<decltype(x)>;
+            if constexpr (std::is_same_v<T, std::string>) {
+                output << '"' << x << '"';
+            }
+            else {
+                output << x;
+            }
+        }, value);
+        return output.str();
+    }
+
+    // Формула эталона: дерево, которое разбирается, вычисляется и печатается
+    // собственным кодом по грамматике RandomExpression, без разбора,
+    // упрощения и печати формул таблицы
+    struct ModelExpr {
+        enum class Kind {
+            Number,
+            Cell,
+            Negate,
+            Binary,
+        };
+
+        Kind kind = Kind::Number;
+        double number = 0.0;
+        Position pos;
+        char operation = 0;
+        std::unique_ptr<ModelExpr> lhs;
+        std::unique_ptr<ModelExpr> rhs;
+    };
+
+    // Разбор рекурсивным спуском:
+    //   expr := term (('+' | '-') term)*
+    //   term := unary (('*' | '/') unary)*
+    //   unary := '-' unary | number | cell | '(' expr ')'
+    class ModelParser {
+    public:
+        explicit ModelParser(std::string_view text) : text_(text) {}
+
+        std::unique_ptr<ModelExpr> Parse() {
+            auto expr = ParseExpr();
+            if (offset_ != text_.size()) {
+                throw FormulaException("unexpected character");
+            }
+            return expr;
+        }
+
+    private:
+        std::unique_ptr<ModelExpr> ParseExpr() {
+            auto lhs = ParseTerm();
+            while (Peek() == '+' || Peek() == '-') {
+                const char operation = text_[offset_++];
+                lhs = MakeBinary(operation, std::move(lhs), ParseTerm());
+            }
+            return lhs;
+        }
+
+        std::unique_ptr<ModelExpr> ParseTerm() {
+            auto lhs = ParseUnary();
+            while (Peek() == '*' || Peek() == '/') {
+                const char operation = text_[offset_++];
+                lhs = MakeBinary(operation, std::move(lhs), ParseUnary());
+            }
+            return lhs;
+        }
+
+        std::unique_ptr<ModelExpr> ParseUnary() {
+            auto expr = std::make_unique<ModelExpr>();
+            const char c = Peek();
+            if (c == '-') {
+                ++offset_;
+                expr->kind = ModelExpr::Kind::Negate;
+                expr->lhs = ParseUnary();
+            }
+            else if (c == '(') {
+                ++offset_;
+                expr = ParseExpr();
+                if (Peek() != ')') {
+                    throw FormulaException("missing ')'");
+                }
+                ++offset_;
+            }
+            else if (c >= '0' && c <= '9') {
+                expr->kind = ModelExpr::Kind::Number;
+                for (; Peek() >= '0' && Peek() <= '9'; ++offset_) {
+                    expr->number = expr->number * 10 + (text_[offset_] - '0');
+                }
+            }
+            else if (c >= 'A' && c <= 'Z') {
+                // Поле теста меньше 26 столбцов и 10 строк: буква и цифра
+                if (offset_ + 1 >= text_.size() || text_[offset_ + 1] < '1' || text_[offset_ + 1] > '9') {
+                    throw FormulaException("bad cell reference");
+                }
+                expr->kind = ModelExpr::Kind::Cell;
+                expr->pos = { text_[offset_ + 1] - '1', c - 'A' };
+                offset_ += 2;
+            }
+            else {
+                throw FormulaException("unexpected character");
+            }
+            return expr;
+        }
+
+        static std::unique_ptr<ModelExpr> MakeBinary(char operation, std::unique_ptr<ModelExpr> lhs,
+                                                     std::unique_ptr<ModelExpr> rhs) {
+            auto expr = std::make_unique<ModelExpr>();
+            expr->kind = ModelExpr::Kind::Binary;
+            expr->operation = operation;
+            expr->lhs = std::move(lhs);
+            expr->rhs = std::move(rhs);
+            return expr;
+        }
+
+        char Peek() const {
+            return offset_ < text_.size() ? text_[offset_] : '\0';
+        }
+
+        std::string_view text_;
+        size_t offset_ = 0;
+    };
+
+    // Уровень связывания: сложение, умножение, унарный минус, атом
+    int Level(const ModelExpr& expr) {
+        switch (expr.kind) {
+        case ModelExpr::Kind::Binary:
+            return expr.operation == '+' || expr.operation == '-' ? 1 : 2;
+        case ModelExpr::Kind::Negate:
+            return 3;
+        default:
+            return 4;
+        }
+    }
+
+    // Печать с наименьшим числом скобок, при котором значение не меняется:
+    // сумма под умножением или минусом и правый операнд вычитания или
+    // деления того же уровня
+    void PrintModel(const ModelExpr& expr, std::ostream& output);
+
+    void PrintOperand(const ModelExpr& parent, const ModelExpr& child, bool right, std::ostream& output) {
+        const bool grouped = (Level(child) == 1 && Level(parent) > 1)
+            || (right && Level(child) == Level(parent) && (parent.operation == '-' || parent.operation == '/'));
+        if (grouped) {
+            output << '(';
+        }
+        PrintModel(child, output);
+        if (grouped) {
+            output << ')';
+        }
+    }
+
+    void PrintModel(const ModelExpr& expr, std::ostream& output) {
+        switch (expr.kind) {
+        case ModelExpr::Kind::Number:
+            output << expr.number;
+            break;
+        case ModelExpr::Kind::Cell:
+            output << static_cast<char>('A' + expr.pos.col) << expr.pos.row + 1;
+            break;
+        case ModelExpr::Kind::Negate:
+            output << '-';
+            PrintOperand(expr, *expr.lhs, false, output);
+            break;
+        case ModelExpr::Kind::Binary:
+            PrintOperand(expr, *expr.lhs, false, output);
+            output << expr.operation;
+            PrintOperand(expr, *expr.rhs, true, output);
+            break;
+        }
+    }
+
+    void CollectCells(const ModelExpr& expr, std::set<Position>& cells) {
+        if (expr.kind == ModelExpr::Kind::Cell) {
+            cells.insert(expr.pos);
+        }
+        for (const auto* child : { expr.lhs.get(), expr.rhs.get() }) {
+            if (child) {
+                CollectCells(*child, cells);
+            }
+        }
+    }
+
+    // Эталонная таблица: только тексты и деревья формул эталона. Значения
+    // вычисляются обходом дерева заново на каждой проверке.
+    class ModelSheet : public SheetInterface {
+    public:
+        class ModelCell : public CellInterface {
+        public:
+            ModelCell(const ModelSheet& sheet, std::string text) : sheet_(sheet), text_(std::move(text)) {
+                if (text_.size() > 1 && text_[0] == FORMULA_SIGN) {
+                    formula_ = ModelParser(std::string_view(text_).substr(1)).Parse();
+                }
+            }
+
+            Value GetValue() const override {
+                if (!formula_) {
+                    if (!text_.empty() && text_[0] == ESCAPE_SIGN) {
+                        return text_.substr(1);
+                    }
+                    return text_;
+                }
+                const auto value = Evaluate();
+                if (std::holds_alternative<double>(value)) {
+                    return std::get<double>(value);
+                }
+                return std::get<FormulaError>(value);
+            }
+
+            std::string GetText() const override {
+                if (!formula_) {
+                    return text_;
+                }
+                std::ostringstream output;
+                output << FORMULA_SIGN;
+                PrintModel(*formula_, output);
+                return output.str();
+            }
+
+            std::vector<Position> GetReferencedCells() const override {
+                std::set<Position> cells;
+                if (formula_) {
+                    CollectCells(*formula_, cells);
+                }
+                return { cells.begin(), cells.end() };
+            }
+
+            // Число, которое видит формула: пустой текст - ноль, текст не из
+            // одного числа - #VALUE!, ошибка формулы передаётся дальше
+            double GetNumber() const {
+                if (formula_) {
+                    const auto value = Evaluate();
+                    if (std::holds_alternative<FormulaError>(value)) {
+                        throw std::get<FormulaError>(value);
+                    }
+                    return std::get<double>(value);
+                }
+                const std::string text = !text_.empty() && text_[0] == ESCAPE_SIGN ? text_.substr(1) : text_;
+                if (text.empty()) {
+                    return 0.0;
+                }
+                char* end = nullptr;
+                const double number = std::strtod(text.c_str(), &end);
+                if (end != text.c_str() + text.size() || std::isspace(static_cast<unsigned char>(text[0]))) {
+                    throw FormulaError(FormulaError::Category::Value);
+                }
+                return number;
+            }
+
+            void ResetValue() const {
+                value_.reset();
+            }
+
+        private:
+            FormulaInterface::Value Evaluate() const {
+                if (!value_) {
+                    try {
+                        value_ = EvaluateExpr(*formula_);
+                    }
+                    catch (const FormulaError& error) {
+                        value_ = error;
+                    }
+                }
+                return *value_;
+            }
+
+            // Операнды вычисляются слева направо, первая ошибка прерывает
+            // вычисление; бесконечность и NaN - ошибка деления
+            double EvaluateExpr(const ModelExpr& expr) const {
+                switch (expr.kind) {
+                case ModelExpr::Kind::Number:
+                    return expr.number;
+                case ModelExpr::Kind::Cell:
+                    return sheet_.GetNumber(expr.pos);
+                case ModelExpr::Kind::Negate:
+                    return -EvaluateExpr(*expr.lhs);
+                case ModelExpr::Kind::Binary:
+                    break;
+                }
+                const double lhs = EvaluateExpr(*expr.lhs);
+                const double rhs = EvaluateExpr(*expr.rhs);
+                double result = 0.0;
+                switch (expr.operation) {
+                case '+':
+                    result = lhs + rhs;
+                    break;
+                case '-':
+                    result = lhs - rhs;
+                    break;
+                case '*':
+                    result = lhs * rhs;
+                    break;
+                default:
+                    result = lhs / rhs;
+                    break;
+                }
+                if (!std::isfinite(result)) {
+                    throw FormulaError(FormulaError::Category::Div0);
+                }
+                return result;
+            }
+
+            const ModelSheet& sheet_;
+            std::string text_;
+            std::unique_ptr<ModelExpr> formula_;
+            // Значение в пределах одной проверки
+            mutable std::optional<FormulaInterface::Value> value_;
+        };
+
+        void SetCell(Position pos, std::string text) override {
+            auto cell = std::make_unique<ModelCell>(*this, std::move(text));
+            if (Reaches(cell->GetReferencedCells(), pos)) {
+                throw CircularDependencyException("circular dependency");
+            }
+            cells_[pos] = std::move(cell);
+        }
+
+        const CellInterface* GetCell(Position pos) const override {
+            const auto it = cells_.find(pos);
+            return it == cells_.end() ? nullptr : it->second.get();
+        }
+
+        CellInterface* GetCell(Position pos) override {
+            const auto it = cells_.find(pos);
+            return it == cells_.end() ? nullptr : it->second.get();
+        }
+
+        void ClearCell(Position pos) override {
+            cells_.erase(pos);
+        }
+
+        Size GetPrintableSize() const override {
+            return { ROWS, COLS };
+        }
+
+        void PrintValues(std::ostream& /* output */) const override {}
+        void PrintTexts(std::ostream& /* output */) const override {}
+
+        // Число ячейки для формулы эталона: отсутствующая ячейка - ноль
+        double GetNumber(Position pos) const {
+            const auto it = cells_.find(pos);
+            return it == cells_.end() ? 0.0 : it->second->GetNumber();
+        }
+
+        // Сброс значений перед проверкой
+        void ResetValues() const {
+            for (const auto& [pos, cell] : cells_) {
+                cell->ResetValue();
+            }
+        }
+
+    private:
+        // Достижима ли target по ссылкам формул из позиций from
+        bool Reaches(std::vector<Position> stack, Position target) const {
+            std::set<Position> visited;
+            while (!stack.empty()) {
+                const Position pos = stack.back();
+                stack.pop_back();
+                if (pos == target) {
+                    return true;
+                }
+                if (!visited.insert(pos).second) {
+                    continue;
+                }
+                if (const auto* cell = GetCell(pos)) {
+                    for (Position ref : cell->GetReferencedCells()) {
+                        stack.push_back(ref);
+                    }
+                }
+            }
+            return false;
+        }
+
+        std::map<Position, std::unique_ptr<ModelCell>> cells_;
+    };
+
+    SheetOptions RandomOptions(Choices& choices) {
+        SheetOptions options;
+        options.evaluation_backend = static_cast<EvaluationBackend>(choices.Next(3));
+        options.recalculation_mode = static_cast<RecalculationMode>(choices.Next(2));
+        return options;
+    }
+
+    class Stress {
+    public:
+        Stress(Choices& choices, SheetOptions options, const std::string& origin) : choices_(choices), sheet_(options) {
+            log_.push_back(origin + ": backend " + std::to_string(static_cast<int>(options.evaluation_backend))
+                           + ", mode " + std::to_string(static_cast<int>(options.recalculation_mode)));
+        }
+
+        void Step() {
+            Change();
+            CheckGraph();
+
+            switch (choices_.Next(8)) {
+            case 0:
+                // Часть кэшей остаётся невычисленной до следующих шагов
+                for (int i = 0; i < 3; ++i) {
+                    CheckCell(RandomPosition(choices_), "partial read");
+                }
+                return;
+            case 1:
+                sheet_.Recalculate();
+                break;
+            case 2:
+                CheckConcurrentReads();
+                break;
+            case 3:
+                CheckSnapshot();
+                break;
+            default:
+                break;
+            }
+            CheckAll(choices_.Next(2) == 0);
+        }
+
+    private:
+        enum class Outcome {
+            Applied,
+            SyntaxError,
+            Cycle,
+        };
+
+        template <typename Apply>
+        static Outcome Try(Apply apply) {
+            try {
+                apply();
+            }
+            catch (const FormulaException&) {
+                return Outcome::SyntaxError;
+            }
+            catch (const CircularDependencyException&) {
+                return Outcome::Cycle;
+            }
+            return Outcome::Applied;
+        }
+
+        void Change() {
+            const Position pos = RandomPosition(choices_);
+            if (choices_.Next(4) == 0) {
+                log_.push_back("ClearCell " + pos.ToString());
+                model_.ClearCell(pos);
+                sheet_.ClearCell(pos);
+                return;
+            }
+
+            const std::string text = RandomText(choices_);
+            log_.push_back("SetCell " + pos.ToString() + " \"" + text + "\"");
+            const Outcome expected = Try([&] { model_.SetCell(pos, text); });
+            const Outcome actual = Try([&] { sheet_.SetCell(pos, text); });
+            if (actual != expected) {
+                Fail("SetCell outcome " + std::to_string(static_cast<int>(actual))
+                     + ", expected " + std::to_string(static_cast<int>(expected)));
+            }
+        }
+
+        Value ExpectedValue(Position pos) const {
+            const CellInterface* cell = model_.GetCell(pos);
+            return cell ? cell->GetValue() : Value(std::string());
+        }
+
+        void CheckCell(Position pos, const std::string& context) {
+            model_.ResetValues();
+            const CellInterface* cell = sheet_.GetCell(pos);
+            const Value actual = cell ? cell->GetValue() : Value(std::string());
+            const Value expected = ExpectedValue(pos);
+            if (!(actual == expected)) {
+                Fail(context + ": " + pos.ToString() + " = " + Describe(actual) + ", expected " + Describe(expected));
+            }
+        }
+
+        // Значения и тексты всех ячеек, в прямом или обратном порядке
+        void CheckAll(bool reverse) {
+            model_.ResetValues();
+            for (int i = 0; i < ROWS * COLS; ++i) {
+                const int index = reverse ? ROWS * COLS - 1 - i : i;
+                const Position pos{ index / COLS, index % COLS };
+                const CellInterface* cell = sheet_.GetCell(pos);
+                const CellInterface* expected = model_.GetCell(pos);
+                const std::string text = cell ? cell->GetText() : std::string();
+                const std::string expected_text = expected ? expected->GetText() : std::string();
+                if (text != expected_text) {
+                    Fail("text of " + pos.ToString() + " is \"" + text + "\", expected \"" + expected_text + "\"");
+                }
+                CheckCell(pos, "value");
+            }
+        }
+
+        // Связи ячеек: каждая ссылка - существующая ячейка таблицы, которая
+        // знает о зависимой, и наоборот; ссылки совпадают с формулой
+        void CheckGraph() {
+            for (int row = 0; row < ROWS; ++row) {
+                for (int col = 0; col < COLS; ++col) {
+                    const Position pos{ row, col };
+                    const auto* cell = static_cast<const Cell*>(sheet_.GetCell(pos));
+                    if (!cell) {
+                        continue;
+                    }
+                    Cell* self = const_cast<Cell*>(cell);
+
+                    std::set<Position> references;
+                    for (const Cell* ref : cell->GetReferences()) {
+                        if (sheet_.GetCell(ref->GetPosition()) != ref) {
+                            Fail(pos.ToString() + " references a cell outside the sheet");
+                        }
+                        if (ref->GetDependents().count(self) == 0) {
+                            Fail(ref->GetPosition().ToString() + " does not list dependent " + pos.ToString());
+                        }
+                        references.insert(ref->GetPosition());
+                    }
+                    for (const Cell* dependent : cell->GetDependents()) {
+                        if (sheet_.GetCell(dependent->GetPosition()) != dependent) {
+                            Fail(pos.ToString() + " has a dependent outside the sheet");
+                        }
+                        if (dependent->GetReferences().count(self) == 0) {
+                            Fail(dependent->GetPosition().ToString() + " does not reference " + pos.ToString());
+                        }
+                    }
+
+                    std::set<Position> expected;
+                    for (Position ref : cell->GetReferencedCells()) {
+                        if (sheet_.GetCell(ref)) {
+                            expected.insert(ref);
+                        }
+                    }
+                    if (references != expected) {
+                        Fail("references of " + pos.ToString() + " do not match its formula");
+                    }
+                }
+            }
+        }
+
+        // Одновременное чтение из нескольких потоков
+        void CheckConcurrentReads() {
+            std::vector<std::vector<Value>> values(READERS);
+            std::vector<std::thread> readers;
+            for (int r = 0; r < READERS; ++r) {
+                readers.emplace_back([this, &values, r] {
+                    for (int i = 0; i < ROWS * COLS; ++i) {
+                        // Потоки обходят поле с разных мест
+                        const int index = (i + r * ROWS) % (ROWS * COLS);
+                        const CellInterface* cell = sheet_.GetCell({ index / COLS, index % COLS });
+                        values[r].push_back(cell ? cell->GetValue() : Value(std::string()));
+                    }
+                });
+            }
+            for (auto& reader : readers) {
+                reader.join();
+            }
+
+            model_.ResetValues();
+            for (int r = 0; r < READERS; ++r) {
+                for (int i = 0; i < ROWS * COLS; ++i) {
+                    const int index = (i + r * ROWS) % (ROWS * COLS);
+                    const Position pos{ index / COLS, index % COLS };
+                    if (!(values[r][i] == ExpectedValue(pos))) {
+                        Fail("concurrent read: " + pos.ToString() + " = " + Describe(values[r][i])
+                             + ", expected " + Describe(ExpectedValue(pos)));
+                    }
+                }
+            }
+        }
+
+        void CheckSnapshot() {
+            const auto snapshot = sheet_.Snapshot();
+            model_.ResetValues();
+            for (int row = 0; row < ROWS; ++row) {
+                for (int col = 0; col < COLS; ++col) {
+                    const CellInterface* cell = snapshot->GetCell({ row, col });
+                    const Value actual = cell ? cell->GetValue() : Value(std::string());
+                    if (!(actual == ExpectedValue({ row, col }))) {
+                        Fail("snapshot: " + Position{ row, col }.ToString() + " = " + Describe(actual)
+                             + ", expected " + Describe(ExpectedValue({ row, col })));
+                    }
+                }
+            }
+        }
+
+        [[noreturn]] void Fail(const std::string& message) const {
+            std::cerr << "sheet_stress: " << message << "\nsteps:\n";
+            for (const auto& entry : log_) {
+                std::cerr << "  " << entry << '\n';
+            }
+            std::cerr.flush();
+            std::abort();
+        }
+
+        Choices& choices_;
+        Sheet sheet_;
+        ModelSheet model_;
+        std::vector<std::string> log_;
+    };
+}  // namespace
+
+#ifdef SPREADSHEET_LIBFUZZER
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    Choices choices(data, size);
+    Stress stress(choices, RandomOptions(choices), "fuzzer input");
+    while (!choices.Exhausted()) {
+        stress.Step();
+    }
+    return 0;
+}
+#else
+// sheet_stress [число прогонов] [первое зерно]
+int main(int argc, char* argv[]) {
+    const unsigned long runs = argc > 1 ? std::stoul(argv[1]) : 100;
+    const unsigned long first_seed = argc > 2 ? std::stoul(argv[2]) : 1;
+    for (unsigned long seed = first_seed; seed < first_seed + runs; ++seed) {
+        Choices choices(static_cast<uint32_t>(seed));
+        Stress stress(choices, RandomOptions(choices), "seed " + std::to_string(seed));
+        for (int step = 0; step < STEPS; ++step) {
+            stress.Step();
+        }
+    }
+    std::cerr << "sheet_stress: " << runs << " runs passed" << std::endl;
+}
+#endif
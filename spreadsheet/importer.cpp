@@ -0,0 +1,246 @@
+#include "importer.h"
+
+#include "sheet.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+using namespace std::literals;
+
+namespace {
+    constexpr char TSV_SEPARATOR = '\t';
+    constexpr char CSV_SEPARATOR = ',';
+    constexpr char CSV_QUOTE = '"';
+
+    class StreamingImporter {
+    public:
+        StreamingImporter(std::istream& input, SheetInterface& sheet, const ImportOptions& options)
+            : input_(input), sheet_(sheet), table_(dynamic_cast<Sheet*>(&sheet)), options_(options),
+              buffer_(std::max<size_t>(options.chunk_size, 1)) {
+            batch_.reserve(options_.batch_size);
+        }
+
+        ImportStats Run() {
+            bool eof = false;
+            while (!eof) {
+                eof = Refill();
+                begin_ += ParseRecords(buffer_.data() + begin_, buffer_.data() + end_, eof);
+                // Поля пакета указывают в буфер, поэтому пакет записывается до следующего чтения
+                Flush();
+            }
+
+            return stats_;
+        }
+
+    private:
+        // Переносит необработанный хвост в начало буфера и дочитывает поток.
+        // Возвращает true, если поток закончился.
+        bool Refill() {
+            const size_t tail = end_ - begin_;
+            if (begin_ > 0) {
+                std::memmove(buffer_.data(), buffer_.data() + begin_, tail);
+            }
+            begin_ = 0;
+            end_ = tail;
+
+            // Запись длиннее буфера - расширяем его
+            if (end_ == buffer_.size()) {
+                buffer_.resize(buffer_.size() * 2);
+            }
+
+            input_.read(buffer_.data() + end_, static_cast<std::streamsize>(buffer_.size() - end_));
+            end_ += static_cast<size_t>(input_.gcount());
+
+            return !input_;
+        }
+
+        // Разбирает полные записи и возвращает количество обработанных байт.
+        // Если поток закончился, последняя запись может не заканчиваться переводом строки.
+        size_t ParseRecords(char* begin, char* end, bool eof) {
+            char* current = begin;
+            while (current != end) {
+                char* record_end = options_.format == ImportFormat::Tsv
+                    ? static_cast<char*>(std::memchr(current, '\n', end - current))
+                    : FindCsvRecordEnd(current, end);
+
+                if (record_end == nullptr) {
+                    if (!eof) {
+                        break;
+                    }
+                    record_end = end;
+                }
+
+                std::string_view record(current, record_end - current);
+                if (!record.empty() && record.back() == '\r') {
+                    record.remove_suffix(1);
+                }
+
+                if (options_.format == ImportFormat::Tsv) {
+                    ParseTsvRecord(record);
+                }
+                else {
+                    ParseCsvRecord(current, current + record.size());
+                }
+                ++stats_.rows;
+
+                current = record_end == end ? end : record_end + 1;
+            }
+
+            return current - begin;
+        }
+
+        void ParseTsvRecord(std::string_view record) {
+            int col = 0;
+            while (true) {
+                const size_t separator = record.find(TSV_SEPARATOR);
+                AddField(col++, record.substr(0, separator));
+                if (separator == std::string_view::npos) {
+                    break;
+                }
+                record.remove_prefix(separator + 1);
+            }
+        }
+
+        // Перевод строки внутри кавычек не завершает запись. Как и в
+        // ParseCsvRecord, кавычки открывают поле только в его начале, а
+        // кавычка сразу после закрывающей - экранированная ("").
+        // Кавычка внутри поля без кавычек - обычный символ.
+        static char* FindCsvRecordEnd(char* begin, char* end) {
+            bool quoted = false;
+            bool field_start = true;
+            bool after_quote = false;
+            for (char* it = begin; it != end; ++it) {
+                if (quoted) {
+                    if (*it == CSV_QUOTE) {
+                        quoted = false;
+                        after_quote = true;
+                    }
+                    continue;
+                }
+                if (*it == '\n') {
+                    return it;
+                }
+                quoted = *it == CSV_QUOTE && (field_start || after_quote);
+                field_start = *it == CSV_SEPARATOR;
+                after_quote = false;
+            }
+
+            return nullptr;
+        }
+
+        // Кавычки снимаются на месте: текст поля без кавычек не длиннее исходного
+        void ParseCsvRecord(char* begin, char* end) {
+            int col = 0;
+            char* current = begin;
+            while (true) {
+                char* field_begin = current;
+                char* field_end = current;
+                if (current != end && *current == CSV_QUOTE) {
+                    ++current;
+                    while (current != end) {
+                        if (*current == CSV_QUOTE) {
+                            if (current + 1 != end && current[1] == CSV_QUOTE) {
+                                *field_end++ = CSV_QUOTE;
+                                current += 2;
+                                continue;
+                            }
+                            ++current;
+                            break;
+                        }
+                        *field_end++ = *current++;
+                    }
+                    // Символы между закрывающей кавычкой и разделителем сохраняем как есть
+                    while (current != end && *current != CSV_SEPARATOR) {
+                        *field_end++ = *current++;
+                    }
+                }
+                else {
+                    while (current != end && *current != CSV_SEPARATOR) {
+                        ++current;
+                    }
+                    field_end = current;
+                }
+
+                AddField(col++, std::string_view(field_begin, field_end - field_begin));
+                if (current == end) {
+                    break;
+                }
+                ++current;
+            }
+        }
+
+        void AddField(int col, std::string_view text) {
+            if (text.empty()) {
+                return;
+            }
+
+            const Position pos = { options_.origin.row + static_cast<int>(stats_.rows), options_.origin.col + col };
+            batch_.emplace_back(pos, text);
+            if (batch_.size() >= options_.batch_size) {
+                Flush();
+            }
+        }
+
+        // Пакет записывается в таблицу Sheet одной группой изменений: она
+        // отменяется одним Undo(), а подписчики получают одну дельту
+        void Flush() {
+            if (batch_.empty()) {
+                return;
+            }
+
+            if (table_) {
+                table_->BeginBatch();
+            }
+            try {
+                for (const auto& [pos, text] : batch_) {
+                    sheet_.SetCell(pos, std::string(text));
+                    ++stats_.cells;
+                }
+            } catch (...) {
+                if (table_) {
+                    table_->EndBatch();
+                }
+                throw;
+            }
+            if (table_) {
+                table_->EndBatch();
+            }
+            batch_.clear();
+        }
+
+        std::istream& input_;
+        SheetInterface& sheet_;
+        // Таблица, если поддерживает группы изменений
+        Sheet* table_;
+        const ImportOptions& options_;
+        // Буфер чтения и границы необработанных данных в нём
+        std::vector<char> buffer_;
+        size_t begin_ = 0;
+        size_t end_ = 0;
+        // Поля, ожидающие записи в таблицу
+        std::vector<std::pair<Position, std::string_view>> batch_;
+        ImportStats stats_;
+    };
+}  // namespace
+
+ImportStats ImportTexts(std::istream& input, SheetInterface& sheet, const ImportOptions& options) {
+    return StreamingImporter(input, sheet, options).Run();
+}
+
+ImportStats ImportTexts(const std::string& path, SheetInterface& sheet, const ImportOptions& options) {
+    if (path == "-"sv) {
+        return ImportTexts(std::cin, sheet, options);
+    }
+
+    std::ifstream input(path, std::ios::binary);
+    if (!input) {
+        throw std::runtime_error("cannot open file: "s + path);
+    }
+
+    return ImportTexts(input, sheet, options);
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <iosfwd>
+#include <string>
+
+// Формат входных данных импорта
+enum class ImportFormat {
+    Tsv,  // столбцы разделены табуляцией, как в выводе PrintTexts()
+    Csv,  // столбцы разделены запятой, поля могут быть в двойных кавычках
+};
+
+struct ImportOptions {
+    ImportFormat format = ImportFormat::Tsv;
+    // Позиция, в которую попадает первое поле первой строки
+    Position origin = { 0, 0 };
+    // Размер блока, которым читается поток. Буфер растёт только если одна
+    // запись не помещается в блок целиком.
+    size_t chunk_size = 1 << 20;
+    // Количество ячеек, которые накапливаются перед записью в таблицу
+    size_t batch_size = 4096;
+};
+
+struct ImportStats {
+    size_t rows = 0;
+    size_t cells = 0;
+};
+
+// Читает таблицу из потока и записывает непустые поля в ячейки методом
+// SetCell(). Поля передаются как есть, поэтому формулы ("=") и
+// экранирование ("'") распознаются так же, как при обычном задании ячейки.
+// Пустые поля пропускаются. Если таблица - Sheet, каждый пакет из
+// batch_size ячеек записывается одной группой изменений (Sheet::BeginBatch):
+// отменяется одним Undo() и доставляется подписчикам одной дельтой.
+// Исключения SetCell() (например, FormulaException) не перехватываются;
+// ячейки, записанные до ошибки, остаются в таблице.
+ImportStats ImportTexts(std::istream& input, SheetInterface& sheet, const ImportOptions& options = {});
+
+// То же самое для файла. Путь "-" означает стандартный ввод.
+ImportStats ImportTexts(const std::string& path, SheetInterface& sheet, const ImportOptions& options = {});
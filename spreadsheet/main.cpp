@@ -1,14 +1,29 @@
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
 #include <limits>
+#include <random>
+#include <thread>
+#include "FormulaAST.h"
+#include "async_recalc.h"
 #include "common.h"
 #include "formula.h"
+#include "importer.h"
+#include "sheet.h"
+#include "snapshot.h"
 #include "test_runner_p.h"
+#include "workbook.h"
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
     return output << "(" << pos.row << ", " << pos.col << ")";
 }
 
-inline Position operator"" _pos(const char* str, std::size_t) {
-    return Position::FromString(str);
+constexpr Position operator"" _pos(const char* str, std::size_t size) {
+    return Position::FromString({ str, size });
 }
 
 inline std::ostream& operator<<(std::ostream& output, Size size) {
@@ -50,6 +65,14 @@ void TestPositionAndStringConversion() {
     testSingle(Position{0, 702}, "AAA1");
     testSingle(Position{136, 2}, "C137");
     testSingle(Position{Position::MAX_ROWS - 1, Position::MAX_COLS - 1}, "XFD16384");
+
+    // Разбор при компиляции и запись в буфер
+    constexpr Position literal = "AB12"_pos;
+    static_assert(literal.row == 11 && literal.col == 27);
+    char buffer[Position::MAX_STRING_LENGTH];
+    const Position last{Position::MAX_ROWS - 1, Position::MAX_COLS - 1};
+    ASSERT_EQUAL(std::string_view(buffer, last.ToChars(buffer)), "XFD16384");
+    ASSERT_EQUAL(Position::NONE.ToChars(buffer), 0u);
 }
 
 void TestPositionToStringInvalid() {
@@ -71,6 +94,8 @@ void TestStringToPositionInvalid() {
     ASSERT(!Position::FromString("XFD16385").IsValid());
     ASSERT(!Position::FromString("XFE16384").IsValid());
     ASSERT(!Position::FromString("A1234567890123456789").IsValid());
+    ASSERT(!Position::FromString("A2147483648").IsValid());
+    ASSERT(!Position::FromString("A1 ").IsValid());
     ASSERT(!Position::FromString("ABCDEFGHIJKLMNOPQRS8").IsValid());
 }
 
@@ -177,6 +202,91 @@ void TestFormulaExpressionFormatting() {
     ASSERT_EQUAL(reformat("( ( (  1) ) )"), "1");
 }
 
+void TestFormulaSimplification() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "3");
+    sheet->SetCell("A2"_pos, "=1/0");
+    auto evaluate = [&](std::string expr) {
+        sheet->SetCell("C1"_pos, "=" + expr);
+        return sheet->GetCell("C1"_pos)->GetValue();
+    };
+
+    // Упрощения не видны в тексте формулы
+    ASSERT_EQUAL(evaluate("2*3+A1*1"), CellInterface::Value(9.0));
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetText(), "=2*3+A1*1");
+
+    ASSERT_EQUAL(evaluate("--A1/1-0"), CellInterface::Value(3.0));
+    ASSERT_EQUAL(evaluate("A1/4*2"), CellInterface::Value(1.5));
+    ASSERT_EQUAL(evaluate("-A1*2*4"), CellInterface::Value(-24.0));
+    ASSERT_EQUAL(evaluate("A1-(-A1)"), CellInterface::Value(6.0));
+    // Ошибки сохраняются: константа не поглощает ошибку ссылки
+    ASSERT_EQUAL(evaluate("A2*1"), CellInterface::Value(FormulaError::Category::Div0));
+    ASSERT_EQUAL(evaluate("2/0*A1"), CellInterface::Value(FormulaError::Category::Div0));
+    // -0 - 0 = -0, а -0 + 0 = +0
+    sheet->SetCell("B1"_pos, "=-0*A1");
+    ASSERT(std::signbit(std::get<double>(evaluate("B1-0"))));
+    ASSERT(!std::signbit(std::get<double>(evaluate("B1+0"))));
+
+    // Сокращение (x * a) * b не должно скрывать переполнение x * a
+    std::ostringstream overflow;
+    overflow << std::numeric_limits<double>::max() << "*A1*0.25";
+    ASSERT_EQUAL(evaluate(overflow.str()), CellInterface::Value(FormulaError::Category::Div0));
+}
+
+void TestFormulaKernels() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "3");
+    sheet->SetCell("A2"_pos, "0");
+    sheet->SetCell("A3"_pos, "text");
+    sheet->SetCell("A4"_pos, "=1/0");
+    std::ostringstream max;
+    max << std::numeric_limits<double>::max();
+    sheet->SetCell("A5"_pos, max.str());
+
+    // Результат вычислителя или его ошибка
+    auto run = [&](const std::function<double()>& execute) -> CellInterface::Value {
+        try {
+            return execute();
+        } catch (const FormulaError& error) {
+            return error;
+        }
+    };
+
+    // Специализированные вычислители и обход дерева дают один результат
+    for (const auto* formula : {"A1", "A1+A2", "A1-A5", "A1*A5", "A5*A5", "A1/A2", "A4+A1", "A1+A4",
+                                "A3*2", "A1/2", "A1-4", "A5*3", "2-A1", "1/A2", "A3/0",
+                                "A1+A2+A5+A5+A3", "A1+A3+A4", "A1+B7", "A1*2+A2"}) {
+        auto ast = ParseFormulaAST(formula);
+        ast.CompileRpn();
+        ASSERT_EQUAL(run([&] { return ast.Execute(*sheet); }), run([&] { return ast.ExecuteGeneric(*sheet); }));
+        ASSERT_EQUAL(run([&] { return ast.ExecuteRpn(*sheet); }), run([&] { return ast.ExecuteGeneric(*sheet); }));
+    }
+}
+
+void TestFormulaAstCells() {
+    // Упаковка сохраняет позицию и порядок
+    for (const auto& pos : {"A1"_pos, "B7"_pos, "XFD16384"_pos}) {
+        ASSERT_EQUAL(PackedPosition(pos).Unpack(), pos);
+    }
+    ASSERT(PackedPosition("B7"_pos) < PackedPosition("A8"_pos));
+    ASSERT(!PackedPosition(Position::NONE).IsValid());
+    ASSERT_EQUAL(PackedPosition(Position::NONE).Unpack(), Position::NONE);
+
+    // Повторные ссылки хранятся один раз, а текст формулы сохраняется
+    const auto ast = ParseFormulaAST("B2+A1*B2-A1/C3");
+    ASSERT_EQUAL(ast.GetCells().size(), 3u);
+    ASSERT_EQUAL(ast.GetCells().front().Unpack(), "A1"_pos);
+
+    auto copy = ast.Clone();
+    copy.SetCell(2, "D4"_pos);
+    std::ostringstream original;
+    ast.PrintFormula(original);
+    ASSERT_EQUAL(original.str(), "B2+A1*B2-A1/C3");
+    std::ostringstream changed;
+    copy.PrintFormula(changed);
+    ASSERT_EQUAL(changed.str(), "B2+A1*B2-A1/D4");
+}
+
 void TestFormulaReferencedCells() {
     ASSERT(ParseFormula("1")->GetReferencedCells().empty());
 
@@ -189,6 +299,16 @@ void TestFormulaReferencedCells() {
     auto tricky = ParseFormula("A1 + A2 + A1 + A3 + A1 + A2 + A1");
     ASSERT_EQUAL(tricky->GetExpression(), "A1+A2+A1+A3+A1+A2+A1");
     ASSERT_EQUAL(tricky->GetReferencedCells(), (std::vector{"A1"_pos, "A2"_pos, "A3"_pos}));
+    // Текст и ссылки строятся при разборе и не пересобираются при каждом вызове
+    ASSERT(&tricky->GetExpression() == &tricky->GetExpression());
+    ASSERT(&tricky->GetReferencedCells() == &tricky->GetReferencedCells());
+
+    tricky->HandleInsertedRows(1);
+    ASSERT_EQUAL(tricky->GetExpression(), "A1+A3+A1+A4+A1+A3+A1");
+    ASSERT_EQUAL(tricky->GetReferencedCells(), (std::vector{"A1"_pos, "A3"_pos, "A4"_pos}));
+    tricky->HandleDeletedRows(2);
+    ASSERT_EQUAL(tricky->GetExpression(), "A1+#REF!+A1+A3+A1+#REF!+A1");
+    ASSERT_EQUAL(tricky->GetReferencedCells(), (std::vector{"A1"_pos, "A3"_pos}));
 }
 
 void TestErrorValue() {
@@ -299,7 +419,7 @@ void TestCellReferences() {
 
     // Ссылка на пустую ячейку
     sheet->SetCell("B2"_pos, "=B1");
-    ASSERT(sheet->GetCell("B1"_pos)->GetReferencedCells().empty());
+    ASSERT(sheet->GetCell("B1"_pos) == nullptr);
     ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetReferencedCells(), std::vector{"B1"_pos});
 
     sheet->SetCell("A2"_pos, "");
@@ -311,6 +431,45 @@ void TestCellReferences() {
     ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetReferencedCells(), std::vector{"C3"_pos});
 }
 
+void TestReferencesToEmptyCells() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "=B1+C1");
+    // Ссылки на пустые позиции не создают ячеек
+    ASSERT(sheet.GetCell("B1"_pos) == nullptr);
+    ASSERT(sheet.GetCell("C1"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 1, 1 }));
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
+
+    // Появившаяся ячейка сбрасывает кэш зависимой формулы
+    sheet.SetCell("B1"_pos, "2");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(2.0));
+    sheet.SetCell("C1"_pos, "3");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(5.0));
+
+    // Очищенная ячейка удаляется, даже если на неё ссылаются
+    sheet.ClearCell("B1"_pos);
+    ASSERT(sheet.GetCell("B1"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(3.0));
+    sheet.Undo();
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(5.0));
+    sheet.Redo();
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(3.0));
+
+    // Ссылки на пустые позиции сдвигаются вместе с таблицей
+    sheet.InsertCols(1);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "=C1+D1");
+    sheet.SetCell("C1"_pos, "4");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(7.0));
+
+    // Циклическая зависимость через пустую позицию
+    sheet.SetCell("E1"_pos, "=A1");
+    try {
+        sheet.SetCell("C1"_pos, "=E1");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+}
+
 void TestFormulaIncorrect() {
     auto isIncorrect = [](std::string expression) {
         try {
@@ -345,6 +504,1240 @@ void TestCellCircularReferences() {
     ASSERT(caught);
     ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
 }
+
+void TestSnapshot() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "2");
+    sheet->SetCell("B1"_pos, "=A1*3");
+    sheet->SetCell("A3"_pos, "'=escaped");
+    sheet->SetCell("C2"_pos, "=B1/0");
+
+    const std::string path = "snapshot_test.bin";
+    {
+        std::ofstream output(path, std::ios::binary);
+        SaveSnapshot(*sheet, output);
+    }
+
+    {
+        auto snapshot = OpenSnapshot(path);
+        ASSERT_EQUAL(snapshot->GetPrintableSize(), (Size{3, 3}));
+        ASSERT(snapshot->GetCell("B2"_pos) == nullptr);
+        ASSERT_EQUAL(snapshot->GetCell("B1"_pos)->GetValue(), CellInterface::Value(6.0));
+        ASSERT_EQUAL(snapshot->GetCell("B1"_pos)->GetReferencedCells(), std::vector{"A1"_pos});
+        ASSERT_EQUAL(snapshot->GetCell("A3"_pos)->GetValue(), CellInterface::Value("=escaped"));
+        ASSERT_EQUAL(snapshot->GetCell("C2"_pos)->GetValue(),
+                     CellInterface::Value(FormulaError::Category::Div0));
+
+        std::ostringstream expected;
+        std::ostringstream actual;
+        sheet->PrintTexts(expected);
+        snapshot->PrintTexts(actual);
+        ASSERT_EQUAL(actual.str(), expected.str());
+
+        bool caught = false;
+        try {
+            snapshot->SetCell("A1"_pos, "1");
+        } catch (const ReadOnlySheetException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+    }
+
+    std::remove(path.c_str());
+}
+
+void TestSnapshotValidation() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "1");
+    sheet->SetCell("B2"_pos, "=A1+1");
+
+    std::ostringstream saved;
+    SaveSnapshot(*sheet, saved);
+    const std::string valid = saved.str();
+
+    // Заголовок: сигнатура, версия, число ячеек, строки, столбцы; затем
+    // записи индекса по 12 байт: ключ, смещение и длина текста
+    constexpr size_t rows_offset = 12;
+    constexpr size_t index_offset = 20;
+    constexpr size_t entry_size = 12;
+    auto open_patched = [&valid](size_t offset, const std::string& bytes, bool access = true) {
+        std::string data = valid;
+        data.replace(offset, bytes.size(), bytes);
+        const std::string path = "snapshot_validation_test.bin";
+        {
+            std::ofstream output(path, std::ios::binary);
+            output << data;
+        }
+        bool caught = false;
+        try {
+            // Записи индекса проверяются при поиске и печати
+            auto snapshot = OpenSnapshot(path);
+            if (access) {
+                snapshot->GetCell("A1"_pos);
+                snapshot->GetCell("B2"_pos);
+                std::ostringstream output;
+                snapshot->PrintTexts(output);
+            }
+        } catch (const SnapshotFormatException&) {
+            caught = true;
+        }
+        std::remove(path.c_str());
+        return caught;
+    };
+    auto int32_bytes = [](std::int32_t value) {
+        return std::string(reinterpret_cast<const char*>(&value), sizeof(value));
+    };
+
+    ASSERT(!open_patched(0, std::string(valid, 0, 4)));
+    // Размер таблицы больше допустимого
+    ASSERT(open_patched(rows_offset, int32_bytes(Position::MAX_ROWS + 1)));
+    ASSERT(open_patched(rows_offset, int32_bytes(-1)));
+    // Ячейка B2 вне печатной области 1x1
+    ASSERT(open_patched(rows_offset, int32_bytes(1) + int32_bytes(1)));
+    // Записи индекса переставлены: открытие индекс не читает, ошибка
+    // обнаруживается при обращении
+    const std::string swapped = valid.substr(index_offset + entry_size, entry_size) + valid.substr(index_offset, entry_size);
+    ASSERT(!open_patched(index_offset, swapped, false));
+    ASSERT(open_patched(index_offset, swapped));
+    // Текст ячейки за пределами файла
+    ASSERT(open_patched(index_offset + 4, int32_bytes(1 << 20)));
+}
+
+void TestImportTexts() {
+    auto source = CreateSheet();
+    source->SetCell("A1"_pos, "meow");
+    source->SetCell("C1"_pos, "=A2*2");
+    source->SetCell("A2"_pos, "21");
+    source->SetCell("B3"_pos, "'=escaped");
+
+    std::ostringstream texts;
+    source->PrintTexts(texts);
+
+    // Маленький блок чтения проверяет перенос незаконченных строк между блоками
+    ImportOptions options;
+    options.chunk_size = 4;
+    options.batch_size = 2;
+
+    auto sheet = CreateSheet();
+    std::istringstream input(texts.str());
+    const ImportStats stats = ImportTexts(input, *sheet, options);
+    ASSERT_EQUAL(stats.rows, 3u);
+    ASSERT_EQUAL(stats.cells, 4u);
+
+    std::ostringstream imported;
+    sheet->PrintTexts(imported);
+    ASSERT_EQUAL(imported.str(), texts.str());
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(42.0));
+    ASSERT_EQUAL(sheet->GetCell("B3"_pos)->GetValue(), CellInterface::Value("=escaped"));
+}
+
+void TestImportCsv() {
+    auto sheet = CreateSheet();
+    ImportOptions options;
+    options.format = ImportFormat::Csv;
+    options.origin = "B2"_pos;
+    options.chunk_size = 3;
+
+    std::istringstream input("1,\"a,b\",=B2+1\r\n\"say \"\"hi\"\"\",,\"two\nlines\"");
+    const ImportStats stats = ImportTexts(input, *sheet, options);
+    ASSERT_EQUAL(stats.rows, 2u);
+    ASSERT_EQUAL(stats.cells, 5u);
+
+    ASSERT_EQUAL(sheet->GetCell("C2"_pos)->GetText(), "a,b");
+    ASSERT_EQUAL(sheet->GetCell("D2"_pos)->GetValue(), CellInterface::Value(2.0));
+    ASSERT_EQUAL(sheet->GetCell("B3"_pos)->GetText(), "say \"hi\"");
+    ASSERT(sheet->GetCell("C3"_pos) == nullptr);
+    ASSERT_EQUAL(sheet->GetCell("D3"_pos)->GetText(), "two\nlines");
+
+    // Кавычка внутри поля без кавычек не открывает многострочное поле
+    auto quotes = CreateSheet();
+    std::istringstream quotes_input("ab\"c,d\n\"x\"\"\",2\n3");
+    options.origin = "A1"_pos;
+    ASSERT_EQUAL(ImportTexts(quotes_input, *quotes, options).rows, 3u);
+    ASSERT_EQUAL(quotes->GetCell("A1"_pos)->GetText(), "ab\"c");
+    ASSERT_EQUAL(quotes->GetCell("B1"_pos)->GetText(), "d");
+    ASSERT_EQUAL(quotes->GetCell("A2"_pos)->GetText(), "x\"");
+    ASSERT_EQUAL(quotes->GetCell("B2"_pos)->GetText(), "2");
+    ASSERT_EQUAL(quotes->GetCell("A3"_pos)->GetText(), "3");
+}
+
+void TestImportBatches() {
+    Sheet sheet;
+    size_t deltas = 0;
+    sheet.Subscribe([&deltas](const std::vector<Sheet::CellChange>&) {
+        ++deltas;
+    });
+
+    ImportOptions options;
+    options.batch_size = 2;
+    std::istringstream input("1\t2\t3\n4\t=A1+D1");
+    ASSERT_EQUAL(ImportTexts(input, sheet, options).cells, 5u);
+    ASSERT_EQUAL(deltas, 3u);
+
+    // Каждый пакет - одна группа изменений
+    ASSERT(sheet.Undo());
+    ASSERT(sheet.GetCell("B2"_pos) == nullptr);
+    ASSERT(sheet.GetCell("A2"_pos) != nullptr);
+    ASSERT(sheet.Undo());
+    ASSERT(sheet.Undo());
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 0, 0 }));
+    ASSERT(!sheet.Undo());
+}
+
+void TestSheetSnapshot() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "=A1+1");
+
+    auto first = sheet.Snapshot();
+    sheet.SetCell("A1"_pos, "10");
+    sheet.SetCell("B1"_pos, "new");
+    auto second = sheet.Snapshot();
+    sheet.ClearCell("B1"_pos);
+
+    ASSERT_EQUAL(first->GetCell("A2"_pos)->GetValue(), CellInterface::Value(2.0));
+    ASSERT(first->GetCell("B1"_pos) == nullptr);
+    ASSERT_EQUAL(first->GetPrintableSize(), (Size{2, 1}));
+    ASSERT_EQUAL(second->GetCell("A2"_pos)->GetValue(), CellInterface::Value(11.0));
+    ASSERT_EQUAL(second->GetCell("B1"_pos)->GetText(), "new");
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(11.0));
+    ASSERT(sheet.Snapshot()->GetCell("B1"_pos) == nullptr);
+
+    // Читатель работает со снимком, пока писатель меняет таблицу
+    auto frozen = sheet.Snapshot();
+    bool stable = true;
+    std::thread reader([&frozen, &stable] {
+        for (int i = 0; i < 1000; ++i) {
+            stable = stable && frozen->GetCell("A2"_pos)->GetValue() == CellInterface::Value(11.0);
+        }
+    });
+    for (int i = 0; i < 1000; ++i) {
+        sheet.SetCell("A1"_pos, std::to_string(i));
+        sheet.SetCell(Position{i, 3}, "=A1*2");
+    }
+    reader.join();
+    ASSERT(stable);
+    ASSERT_EQUAL(sheet.Snapshot()->GetCell("D1000"_pos)->GetValue(), CellInterface::Value(1998.0));
+
+    // Снимок, освобождённый в другом потоке, не позволяет изменять его
+    // формулы на месте при сдвиге ссылок
+    Sheet shifted;
+    shifted.SetCell("A1"_pos, "1");
+    shifted.SetCell("A2"_pos, "=A1+1");
+    for (int col = 0; col < 100; ++col) {
+        const Position pos{ 1, col };
+        bool unchanged = false;
+        std::atomic<bool> released{ false };
+        std::thread evaluator([snapshot = shifted.Snapshot(), pos, &unchanged, &released]() mutable {
+            const CellInterface* cell = snapshot->GetCell(pos);
+            unchanged = cell->GetReferencedCells() == std::vector{ Position{ 0, pos.col } }
+                && cell->GetValue() == CellInterface::Value(2.0);
+            snapshot.reset();
+            released.store(true, std::memory_order_relaxed);
+        });
+        while (!released.load(std::memory_order_relaxed)) {
+            std::this_thread::yield();
+        }
+        shifted.InsertCols(0);
+        evaluator.join();
+        ASSERT(unchanged);
+    }
+}
+
+void TestCacheInvalidation() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "1");
+    sheet->SetCell("B1"_pos, "=A1+1");
+    sheet->SetCell("C1"_pos, "=B1*10");
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(20.0));
+
+    sheet->SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(30.0));
+
+    // После замены формулы ячейка зависит только от новых ссылок
+    sheet->SetCell("B1"_pos, "=D1");
+    sheet->SetCell("D1"_pos, "5");
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(50.0));
+    sheet->SetCell("A1"_pos, "100");
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(50.0));
+
+    sheet->ClearCell("D1"_pos);
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(0.0));
+    sheet->SetCell("D1"_pos, "7");
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(70.0));
+}
+
+void TestConcurrentRead() {
+    auto sheet = CreateSheet();
+    const int rows = 200;
+    sheet->SetCell("A1"_pos, "1");
+    for (int r = 1; r < rows; ++r) {
+        sheet->SetCell(Position{r, 0}, "=A" + std::to_string(r) + "+1");
+        sheet->SetCell(Position{r, 1}, "=A" + std::to_string(r + 1) + "*2");
+    }
+
+    // Несколько читателей одновременно заполняют кэш одних и тех же ячеек
+    std::vector<std::thread> readers;
+    std::vector<int> mismatches(4, 0);
+    for (size_t t = 0; t < mismatches.size(); ++t) {
+        readers.emplace_back([&sheet, &mismatches, t, rows] {
+            const SheetInterface& reader = *sheet;
+            for (int r = rows - 1; r > 0; --r) {
+                if (!(reader.GetCell(Position{r, 1})->GetValue() == CellInterface::Value(2.0 * (r + 1)))) {
+                    ++mismatches[t];
+                }
+            }
+        });
+    }
+    for (auto& reader : readers) {
+        reader.join();
+    }
+
+    ASSERT_EQUAL(mismatches, std::vector<int>(mismatches.size(), 0));
+
+    // Читатели одного снимка одновременно создают его ячейки и получают одни
+    // и те же объекты
+    Sheet table;
+    table.SetCell("A1"_pos, "1");
+    for (int r = 1; r < rows; ++r) {
+        table.SetCell(Position{r, 0}, "=A" + std::to_string(r) + "+1");
+    }
+    const auto snapshot = table.Snapshot();
+    std::vector<std::vector<const CellInterface*>> cells(4);
+    readers.clear();
+    for (size_t t = 0; t < cells.size(); ++t) {
+        readers.emplace_back([&snapshot, &cells, t, rows] {
+            for (int r = rows - 1; r > 0; --r) {
+                const CellInterface* cell = snapshot->GetCell(Position{r, 0});
+                if (cell->GetValue() == CellInterface::Value(r + 1.0)) {
+                    cells[t].push_back(cell);
+                }
+            }
+        });
+    }
+    for (auto& reader : readers) {
+        reader.join();
+    }
+    for (const auto& seen : cells) {
+        ASSERT_EQUAL(seen.size(), size_t(rows - 1));
+        ASSERT(seen == cells.front());
+    }
+}
+
+void TestUndoRedo() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "=A1+1");
+    sheet.SetCell("C1"_pos, "text");
+
+    sheet.BeginBatch();
+    sheet.SetCell("A1"_pos, "5");
+    sheet.SetCell("B1"_pos, "=A2*2+D4");
+    sheet.ClearCell("C1"_pos);
+    sheet.EndBatch();
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(12.0));
+    ASSERT(sheet.GetCell("C1"_pos) == nullptr);
+
+    ASSERT(sheet.Undo());
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(2.0));
+    ASSERT(sheet.GetCell("B1"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "text");
+
+    // Восстановленные зависимости продолжают работать
+    sheet.SetCell("A1"_pos, "3");
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(4.0));
+    ASSERT(!sheet.Redo());
+
+    ASSERT(sheet.Undo());
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(2.0));
+    ASSERT(sheet.Redo());
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(4.0));
+
+    ASSERT(sheet.Undo());
+    ASSERT(sheet.Undo());
+    ASSERT(sheet.Undo());
+    ASSERT(sheet.Undo());
+    ASSERT(!sheet.Undo());
+    ASSERT(sheet.GetCell("A1"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{0, 0}));
+
+    ASSERT(sheet.Redo());
+    ASSERT(sheet.Redo());
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(2.0));
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "=A1+1");
+
+    // Ошибочная формула не попадает в журнал
+    try {
+        sheet.SetCell("A1"_pos, "=A2");
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT(sheet.Undo());
+    ASSERT(sheet.GetCell("A2"_pos) == nullptr);
+
+    // Отклонённое изменение на новой позиции не оставляет пустой ячейки и
+    // не сбрасывает отменённые группы
+    ASSERT(sheet.Undo());
+    try {
+        sheet.SetCell("B2"_pos, "=1+");
+    } catch (const FormulaException&) {
+    }
+    ASSERT(sheet.GetCell("B2"_pos) == nullptr);
+    ASSERT(sheet.Redo());
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1");
+
+    sheet.SetCell("C1"_pos, "=D1");
+    try {
+        sheet.SetCell("D1"_pos, "=C1");
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT(sheet.GetCell("D1"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 3}));
+    ASSERT(sheet.Undo());
+    ASSERT(sheet.GetCell("C1"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1");
+}
+
+void TestInsertDeleteRowsCols() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "2");
+    sheet.SetCell("A3"_pos, "=A1+A2");
+    sheet.SetCell("B1"_pos, "=A3*10");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(30.0));
+
+    auto before = sheet.Snapshot();
+    sheet.InsertRows(1, 2);
+    ASSERT_EQUAL(sheet.GetCell("A5"_pos)->GetText(), "=A1+A4");
+    // Формулы, разделённые со снимком, копируются перед изменением
+    ASSERT_EQUAL(before->GetCell("A3"_pos)->GetText(), "=A1+A2");
+    ASSERT_EQUAL(before->GetCell("A3"_pos)->GetReferencedCells(), (std::vector{"A1"_pos, "A2"_pos}));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=A5*10");
+    ASSERT(sheet.GetCell("A2"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(30.0));
+    sheet.SetCell("A4"_pos, "5");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(60.0));
+
+    sheet.InsertCols(0);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=B5*10");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(60.0));
+
+    sheet.DeleteRows(3);
+    ASSERT_EQUAL(sheet.GetCell("B4"_pos)->GetText(), "=B1+#REF!");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Ref));
+    ASSERT_EQUAL(sheet.GetCell("B4"_pos)->GetReferencedCells(), std::vector{"B1"_pos});
+
+    sheet.DeleteCols(1);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=#REF!*10");
+    ASSERT(sheet.GetCell("B1"_pos)->GetReferencedCells().empty());
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 2}));
+
+    sheet.SetCell(Position{Position::MAX_ROWS - 1, 0}, "last");
+    try {
+        sheet.InsertRows(0);
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=#REF!*10");
+}
+
+void TestUndoStructureChanges() {
+    Sheet sheet;
+    auto texts = [](const SheetInterface& table) {
+        std::ostringstream output;
+        table.PrintTexts(output);
+        return output.str();
+    };
+    auto values = [&sheet] {
+        std::ostringstream output;
+        sheet.PrintValues(output);
+        return output.str();
+    };
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "2");
+    sheet.SetCell("A3"_pos, "=A1+A2");
+    sheet.SetCell("B1"_pos, "=A3*10");
+    // Ссылка на пустую позицию
+    sheet.SetCell("C2"_pos, "=A2+D5");
+    const auto snapshot = sheet.Snapshot();
+
+    std::vector<std::pair<std::string, std::string>> states{ { texts(sheet), values() } };
+    sheet.InsertRows(1, 2);
+    states.emplace_back(texts(sheet), values());
+    sheet.DeleteRows(0);
+    ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetText(), "=#REF!+A3");
+    ASSERT_EQUAL(sheet.GetCell("C3"_pos)->GetText(), "=A3+D6");
+    states.emplace_back(texts(sheet), values());
+    sheet.DeleteCols(0);
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetText(), "=#REF!+C6");
+    states.emplace_back(texts(sheet), values());
+
+    // Хранилище снимков сдвигается вместе с таблицей, старый снимок не меняется
+    ASSERT_EQUAL(texts(*sheet.Snapshot()), texts(sheet));
+    ASSERT_EQUAL(texts(*snapshot), states[0].first);
+
+    // Отмена возвращает удалённые ячейки и прежние ссылки формул, повтор
+    // снова удаляет их
+    for (int pass = 0; pass < 2; ++pass) {
+        for (size_t i = states.size() - 1; i > 0; --i) {
+            ASSERT(sheet.Undo());
+            ASSERT_EQUAL(texts(sheet), states[i - 1].first);
+            ASSERT_EQUAL(values(), states[i - 1].second);
+        }
+        ASSERT_EQUAL(texts(*sheet.Snapshot()), states[0].first);
+        if (pass == 0) {
+            for (size_t i = 1; i < states.size(); ++i) {
+                ASSERT(sheet.Redo());
+                ASSERT_EQUAL(texts(sheet), states[i].first);
+                ASSERT_EQUAL(values(), states[i].second);
+            }
+            ASSERT(!sheet.Redo());
+        }
+    }
+
+    // Связи восстановлены: ссылки на ячейки и на пустую позицию работают
+    sheet.SetCell("A1"_pos, "5");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(70.0));
+    sheet.SetCell("D5"_pos, "4");
+    ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), CellInterface::Value(6.0));
+
+    // Изменения до структурных тоже остаются в журнале
+    ASSERT(sheet.Undo());
+    ASSERT(sheet.Undo());
+    ASSERT(sheet.Undo());
+    ASSERT(sheet.GetCell("C2"_pos) == nullptr);
+}
+
+void TestRecalculateColumns() {
+    // Столбцы протянутых формул длиннее одного блока
+    const int rows = static_cast<int>(Sheet::COLUMN_BLOCK_ROWS) * 2 + 10;
+    Sheet blocks;
+    Sheet plain;
+    auto set = [&](Position pos, std::string text) {
+        blocks.SetCell(pos, text);
+        plain.SetCell(pos, std::move(text));
+    };
+    for (int row = 0; row < rows; ++row) {
+        const std::string r = std::to_string(row + 1);
+        set({ row, 0 }, std::to_string(row % 7));
+        set({ row, 1 }, "=A" + r + "*2");
+        set({ row, 2 }, "=A" + r + "+B" + r);
+        set({ row, 3 }, "=1/A" + r);
+        set({ row, 4 }, row == 0 ? "1" : "=E" + std::to_string(row) + "*1.5");
+    }
+    set("A5"_pos, "text");
+    set("A6"_pos, "=1/0");
+
+    auto check = [&] {
+        blocks.Recalculate();
+        for (int row = 0; row < rows; ++row) {
+            for (int col = 0; col < 5; ++col) {
+                ASSERT_EQUAL(blocks.GetCell({ row, col })->GetValue(), plain.GetCell({ row, col })->GetValue());
+            }
+        }
+    };
+    check();
+
+    // Изменение сбрасывает кэш только части блоков
+    set("A300"_pos, "100");
+    check();
+}
+void TestEvaluateRegion() {
+    Sheet sheet;
+    for (int row = 0; row < 20; ++row) {
+        const std::string r = std::to_string(row + 1);
+        sheet.SetCell({ row, 0 }, r);
+        sheet.SetCell({ row, 1 }, "=A" + r + "*2");
+        sheet.SetCell({ row, 2 }, "=B" + r + "+1");
+    }
+    auto is_cached = [&sheet](Position pos) {
+        return static_cast<const Cell*>(sheet.GetCell(pos))->HasCachedValue();
+    };
+
+    // Видимая область: C2:D3, столбец D пуст
+    const auto values = sheet.EvaluateRegion("C2"_pos, { 2, 2 });
+    ASSERT_EQUAL(values.size(), 4u);
+    ASSERT_EQUAL(values[0], CellInterface::Value(5.0));
+    ASSERT_EQUAL(values[1], CellInterface::Value(""));
+    ASSERT_EQUAL(values[2], CellInterface::Value(7.0));
+
+    // Вычислены видимые формулы и их зависимости, но не соседние строки
+    ASSERT(is_cached("C2"_pos) && is_cached("B2"_pos) && is_cached("B3"_pos));
+    ASSERT(!is_cached("C1"_pos) && !is_cached("C4"_pos) && !is_cached("B10"_pos));
+
+    // Подсказка вычисляет соседние строки заранее
+    sheet.EvaluateRegion("C2"_pos, { 2, 2 }, { 2, 0 });
+    ASSERT(is_cached("C1"_pos) && is_cached("C5"_pos));
+    ASSERT(!is_cached("C6"_pos));
+
+    // Область за пределами таблицы пуста
+    const auto edge = sheet.EvaluateRegion({ Position::MAX_ROWS - 1, 0 }, { 2, 1 }, { 1, 1 });
+    ASSERT_EQUAL(edge.size(), 2u);
+    ASSERT_EQUAL(edge[1], CellInterface::Value(""));
+
+    try {
+        sheet.EvaluateRegion(Position::NONE, { 1, 1 });
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+}
+
+void TestChangeSubscription() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1*0");
+    sheet.SetCell("C1"_pos, "=A1+1");
+    sheet.SetCell("D1"_pos, "=C1*2");
+
+    std::vector<std::vector<Sheet::CellChange>> deltas;
+    const size_t id = sheet.Subscribe([&deltas](const std::vector<Sheet::CellChange>& changes) {
+        deltas.push_back(changes);
+    });
+    auto positions = [&deltas] {
+        std::vector<Position> result;
+        for (const auto& change : deltas.back()) {
+            result.push_back(change.pos);
+        }
+        return result;
+    };
+
+    // B1 пересчитана, но значение не изменилось
+    sheet.SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(deltas.size(), 1u);
+    ASSERT_EQUAL(positions(), (std::vector<Position>{ "A1"_pos, "C1"_pos, "D1"_pos }));
+    ASSERT_EQUAL(deltas.back()[2].value, CellInterface::Value(6.0));
+
+    // Формула, которая не меняет значения, не порождает дельты
+    sheet.SetCell("B1"_pos, "=0*A1");
+    ASSERT_EQUAL(deltas.size(), 1u);
+
+    // Изменения группы сливаются в одну дельту
+    sheet.BeginBatch();
+    sheet.SetCell("A1"_pos, "5");
+    sheet.SetCell("A1"_pos, "2");
+    sheet.SetCell("E1"_pos, "=D1");
+    sheet.EndBatch();
+    ASSERT_EQUAL(deltas.size(), 2u);
+    ASSERT_EQUAL(positions(), std::vector<Position>{ "E1"_pos });
+
+    sheet.ClearCell("C1"_pos);
+    ASSERT_EQUAL(positions(), (std::vector<Position>{ "C1"_pos, "D1"_pos, "E1"_pos }));
+    ASSERT_EQUAL(deltas.back()[0].value, CellInterface::Value(""));
+
+    sheet.Undo();
+    ASSERT_EQUAL(positions(), (std::vector<Position>{ "C1"_pos, "D1"_pos, "E1"_pos }));
+    ASSERT_EQUAL(deltas.back()[2].value, CellInterface::Value(6.0));
+
+    // Удаление столбца: значения передаются по новым позициям
+    sheet.DeleteCols(0);
+    ASSERT_EQUAL(positions(), (std::vector<Position>{ "A1"_pos, "B1"_pos, "C1"_pos, "D1"_pos }));
+    ASSERT_EQUAL(deltas.back()[0].value, CellInterface::Value(FormulaError(FormulaError::Category::Ref)));
+
+    sheet.Unsubscribe(id);
+    sheet.SetCell("A2"_pos, "1");
+    ASSERT_EQUAL(deltas.size(), 5u);
+}
+
+// Случайное выражение глубины не больше depth над ячейками строк выше row
+std::string GenerateExpression(std::mt19937& random, int depth, int row, int cols) {
+    static const char* const NUMBERS[] = { "0", "1", "2", "3", "0.5", "7", "1e308" };
+    std::uniform_int_distribution<int> kind(0, depth > 0 ? 5 : 1);
+    switch (kind(random)) {
+        case 0:
+            return Position{ std::uniform_int_distribution<int>(0, row - 1)(random),
+                             std::uniform_int_distribution<int>(0, cols - 1)(random) }.ToString();
+        case 1:
+            return NUMBERS[std::uniform_int_distribution<size_t>(0, std::size(NUMBERS) - 1)(random)];
+        case 2:
+            return "-(" + GenerateExpression(random, depth - 1, row, cols) + ")";
+        default: {
+            const char op = "+-*/"[std::uniform_int_distribution<int>(0, 3)(random)];
+            return "(" + GenerateExpression(random, depth - 1, row, cols) + ")" + op
+                + "(" + GenerateExpression(random, depth - 1, row, cols) + ")";
+        }
+    }
+}
+
+// Побитовое совпадение значений: +0 и -0 различаются
+bool IsSameValue(const CellInterface::Value& lhs, const CellInterface::Value& rhs) {
+    if (std::holds_alternative<double>(lhs) && std::holds_alternative<double>(rhs)) {
+        const double lhs_value = std::get<double>(lhs);
+        const double rhs_value = std::get<double>(rhs);
+        return std::memcmp(&lhs_value, &rhs_value, sizeof(double)) == 0;
+    }
+    return lhs == rhs;
+}
+
+void TestEvaluationBackends() {
+    constexpr int rows = 60;
+    constexpr int cols = 4;
+    const EvaluationBackend backends[] = { EvaluationBackend::TreeWalk, EvaluationBackend::Rpn, EvaluationBackend::Kernels };
+
+    std::mt19937 random(38);
+    std::vector<std::pair<Position, std::string>> workload;
+    const char* const first_row[] = { "1", "text", "1e308", "-2" };
+    for (int col = 0; col < cols; ++col) {
+        workload.push_back({ { 0, col }, first_row[col] });
+    }
+    for (int row = 1; row < rows; ++row) {
+        for (int col = 0; col < cols; ++col) {
+            workload.push_back({ { row, col }, "=" + GenerateExpression(random, 3, row, cols) });
+        }
+    }
+
+    std::vector<std::unique_ptr<Sheet>> sheets;
+    for (auto backend : backends) {
+        sheets.push_back(std::make_unique<Sheet>(SheetOptions{ backend, RecalculationMode::Invalidate, {} }));
+        for (const auto& [pos, text] : workload) {
+            sheets.back()->SetCell(pos, text);
+        }
+    }
+
+    auto check = [&] {
+        for (int row = 0; row < rows; ++row) {
+            for (int col = 0; col < cols; ++col) {
+                const Position pos{ row, col };
+                const auto* expected = sheets.front()->GetCell(pos);
+                for (const auto& sheet : sheets) {
+                    const auto* cell = sheet->GetCell(pos);
+                    ASSERT_EQUAL(cell == nullptr, expected == nullptr);
+                    if (cell) {
+                        Assert(IsSameValue(cell->GetValue(), expected->GetValue()), cell->GetText());
+                    }
+                }
+            }
+        }
+    };
+    check();
+
+    // Ссылки на удалённые ячейки и изменённые операнды
+    for (auto& sheet : sheets) {
+        sheet->DeleteRows(5, 2);
+        sheet->SetCell("B1"_pos, "0");
+        sheet->Recalculate();
+    }
+    check();
+}
+
+void TestEarlyCutoff() {
+    constexpr int rows = 30;
+    constexpr int cols = 4;
+    Sheet cutoff(SheetOptions{ EvaluationBackend::Kernels, RecalculationMode::EarlyCutoff, {} });
+    Sheet invalidate;
+    auto set = [&](Position pos, const std::string& text) {
+        cutoff.SetCell(pos, text);
+        invalidate.SetCell(pos, text);
+    };
+    auto check = [&] {
+        for (int row = 0; row < rows; ++row) {
+            for (int col = 0; col < cols; ++col) {
+                const auto* cell = cutoff.GetCell({ row, col });
+                const auto* expected = invalidate.GetCell({ row, col });
+                ASSERT_EQUAL(cell == nullptr, expected == nullptr);
+                if (cell) {
+                    Assert(IsSameValue(cell->GetValue(), expected->GetValue()), cell->GetText());
+                }
+            }
+        }
+    };
+
+    // Формула, значение которой не меняется, останавливает пересчёт, но
+    // зависимые формулы других ссылок пересчитываются
+    set("A1"_pos, "1");
+    set("B1"_pos, "=A1*0");
+    set("C1"_pos, "=B1+A1");
+    set("D1"_pos, "=C1");
+    check();
+    set("A1"_pos, "2");
+    ASSERT_EQUAL(cutoff.GetCell("D1"_pos)->GetValue(), CellInterface::Value(2.0));
+    set("A1"_pos, "text");
+    check();
+    set("A1"_pos, "=2");
+    check();
+
+    std::mt19937 random(42);
+    for (int row = 1; row < rows; ++row) {
+        for (int col = 0; col < cols; ++col) {
+            set({ row, col }, "=" + GenerateExpression(random, 2, row, cols));
+        }
+    }
+    check();
+
+    // Случайные правки: числа в первой строке и новые формулы ниже
+    std::uniform_int_distribution<int> random_row(0, rows - 1);
+    std::uniform_int_distribution<int> random_col(0, cols - 1);
+    for (int i = 0; i < 50; ++i) {
+        const Position pos{ random_row(random), random_col(random) };
+        if (pos.row == 0) {
+            set(pos, std::to_string(i % 3));
+        } else {
+            set(pos, "=" + GenerateExpression(random, 2, pos.row, cols));
+        }
+        check();
+    }
+
+    cutoff.Undo();
+    invalidate.Undo();
+    check();
+    cutoff.DeleteRows(0);
+    invalidate.DeleteRows(0);
+    check();
+}
+
+void TestEarlyCutoffInterrupted() {
+    Sheet sheet(SheetOptions{ EvaluationBackend::Kernels, RecalculationMode::EarlyCutoff, {} });
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1*2");
+    sheet.SetCell("C1"_pos, "=B1+1");
+    sheet.SetCell("D1"_pos, "=A1+100");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(3.0));
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(101.0));
+
+    // Пересчёт зависимых прерывается отменой: изменения применяются и
+    // попадают в журнал, а кэши зависимых формул не остаются устаревшими
+    CancellationToken token;
+    token.Cancel();
+    {
+        CancellationToken::Scope scope(token);
+        sheet.SetCell("A1"_pos, "5");
+        sheet.SetCell("B1"_pos, "=A1*3");
+    }
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(15.0));
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(16.0));
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(105.0));
+
+    ASSERT(sheet.Undo());
+    ASSERT(sheet.Undo());
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(3.0));
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(101.0));
+}
+
+void TestWorkbook() {
+    using Value = CellInterface::Value;
+    const Value ref_error = FormulaError(FormulaError::Category::Ref);
+    Workbook book;
+    Sheet& data = book.AddSheet("Data");
+    Sheet& report = book.AddSheet("Report");
+    ASSERT_EQUAL(book.GetSheetNames(), (std::vector<std::string>{ "Data", "Report" }));
+    ASSERT(book.GetSheet("Report") == &report);
+    ASSERT(book.GetSheet("Other") == nullptr);
+
+    // Ссылки на другой лист, в том числе на пустые ячейки
+    data.SetCell("A1"_pos, "2");
+    report.SetCell("A1"_pos, "=Data!A1*10+Data!B1");
+    ASSERT_EQUAL(report.GetCell("A1"_pos)->GetText(), "=Data!A1*10+Data!B1");
+    ASSERT_EQUAL(report.GetCell("A1"_pos)->GetValue(), Value(20.0));
+    ASSERT(report.GetCell("A1"_pos)->GetReferencedCells().empty());
+    data.SetCell("B1"_pos, "1");
+    ASSERT_EQUAL(report.GetCell("A1"_pos)->GetValue(), Value(21.0));
+    data.SetCell("A1"_pos, "=B1+1");
+    ASSERT_EQUAL(report.GetCell("A1"_pos)->GetValue(), Value(21.0));
+    data.ClearCell("B1"_pos);
+    ASSERT_EQUAL(report.GetCell("A1"_pos)->GetValue(), Value(10.0));
+
+    // Лист, которого ещё нет, даёт #REF!, пока его не добавят
+    report.SetCell("B1"_pos, "=Later!A1+1");
+    ASSERT_EQUAL(report.GetCell("B1"_pos)->GetValue(), ref_error);
+    Sheet& later = book.AddSheet("Later");
+    ASSERT_EQUAL(report.GetCell("B1"_pos)->GetValue(), Value(1.0));
+    later.SetCell("A1"_pos, "5");
+    ASSERT_EQUAL(report.GetCell("B1"_pos)->GetValue(), Value(6.0));
+
+    // Подписчики листа узнают об изменениях, вызванных другим листом
+    std::vector<Sheet::CellChange> changes;
+    const size_t id = report.Subscribe([&changes](const std::vector<Sheet::CellChange>& delta) {
+        changes.insert(changes.end(), delta.begin(), delta.end());
+    });
+    later.SetCell("A1"_pos, "7");
+    ASSERT_EQUAL(changes.size(), 1u);
+    ASSERT_EQUAL(changes[0].pos, "B1"_pos);
+    ASSERT_EQUAL(changes[0].value, Value(8.0));
+    report.Unsubscribe(id);
+
+    // Цикл через несколько листов
+    data.SetCell("C1"_pos, "=Report!A1");
+    try {
+        later.SetCell("B1"_pos, "=Data!C1");
+        data.SetCell("B1"_pos, "=Later!B1");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT(data.GetCell("B1"_pos) == nullptr || data.GetCell("B1"_pos)->GetText().empty());
+
+    // Ссылки на другой лист не сдвигаются вместе с его ячейками
+    data.SetCell("A1"_pos, "3");
+    data.SetCell("A2"_pos, "4");
+    ASSERT_EQUAL(report.GetCell("A1"_pos)->GetValue(), Value(30.0));
+    data.InsertRows(0);
+    ASSERT_EQUAL(report.GetCell("A1"_pos)->GetText(), "=Data!A1*10+Data!B1");
+    ASSERT_EQUAL(report.GetCell("A1"_pos)->GetValue(), Value(0.0));
+    data.DeleteRows(0, 2);
+    ASSERT_EQUAL(report.GetCell("A1"_pos)->GetValue(), Value(40.0));
+    data.SetCell("A1"_pos, "1");
+    ASSERT_EQUAL(report.GetCell("A1"_pos)->GetValue(), Value(10.0));
+    // Собственные ссылки листа со ссылками на другие листы сдвигаются как обычно
+    report.SetCell("C2"_pos, "=A1+Data!A1");
+    report.InsertRows(0);
+    ASSERT_EQUAL(report.GetCell("C3"_pos)->GetText(), "=A2+Data!A1");
+    ASSERT_EQUAL(report.GetCell("C3"_pos)->GetValue(), Value(11.0));
+    data.SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(report.GetCell("C3"_pos)->GetValue(), Value(22.0));
+
+    // Снимок других листов не видит
+    ASSERT_EQUAL(report.Snapshot()->GetCell("C3"_pos)->GetValue(), ref_error);
+
+    try {
+        book.AddSheet("Data");
+        ASSERT(false);
+    } catch (const std::invalid_argument&) {
+    }
+    try {
+        book.AddSheet("1st");
+        ASSERT(false);
+    } catch (const std::invalid_argument&) {
+    }
+    try {
+        ParseFormula("Data!ZZZZ1");
+        ASSERT(false);
+    } catch (const FormulaException&) {
+    }
+
+    // Независимые листы вычисляются параллельно
+    Workbook parallel;
+    for (int i = 0; i < 8; ++i) {
+        Sheet& sheet = parallel.AddSheet("S" + std::to_string(i));
+        sheet.SetCell("A1"_pos, std::to_string(i));
+        for (int row = 1; row < 200; ++row) {
+            sheet.SetCell({ row, 0 }, "=A" + std::to_string(row) + "+1");
+        }
+    }
+    parallel.GetSheet("S7")->SetCell("B1"_pos, "=S6!A200+S5!A1");
+    parallel.Recalculate(4);
+    for (int i = 0; i < 8; ++i) {
+        const auto* cell = parallel.GetSheet("S" + std::to_string(i))->GetCell({ 199, 0 });
+        ASSERT(static_cast<const Cell*>(cell)->HasCachedValue());
+        ASSERT_EQUAL(cell->GetValue(), Value(199.0 + i));
+    }
+    ASSERT_EQUAL(parallel.GetSheet("S7")->GetCell("B1"_pos)->GetValue(), Value(210.0));
+}
+
+void TestMemoryUsage() {
+    Sheet sheet;
+    const auto empty = sheet.MemoryUsage();
+    ASSERT_EQUAL(empty.cells, 0u);
+    ASSERT_EQUAL(empty.snapshots, 0u);
+    ASSERT_EQUAL(empty.subscriptions, 0u);
+    ASSERT_EQUAL(empty.Total(), empty.cell_storage + empty.history);
+
+    sheet.SetCell("A1"_pos, "short");
+    sheet.SetCell("A2"_pos, std::string(100, 'x'));
+    auto usage = sheet.MemoryUsage();
+    ASSERT_EQUAL(usage.cells, 2 * sizeof(Cell));
+    ASSERT(usage.texts > 100);
+    ASSERT_EQUAL(usage.formulas, 0u);
+    ASSERT_EQUAL(usage.caches, 0u);
+
+    sheet.SetCell("B1"_pos, "=A1+A2*(A1-3)");
+    sheet.SetCell("B2"_pos, "=C5");
+    usage = sheet.MemoryUsage();
+    ASSERT(usage.formulas > 0);
+    ASSERT(usage.caches > 0);
+    ASSERT(usage.dependencies > 0);
+    ASSERT_EQUAL(usage.Total(), usage.cell_storage + usage.cells + usage.impls + usage.texts
+        + usage.formulas + usage.dependencies + usage.caches + usage.history + usage.snapshots
+        + usage.subscriptions);
+
+    // Очищенные ячейки и их формулы остаются в журнале отмены
+    sheet.ClearCell("B1"_pos);
+    sheet.ClearCell("B2"_pos);
+    const auto cleared = sheet.MemoryUsage();
+    ASSERT_EQUAL(cleared.formulas, 0u);
+    ASSERT_EQUAL(cleared.cells, 2 * sizeof(Cell));
+    ASSERT(cleared.history > usage.history + 2 * sizeof(Cell));
+    sheet.SetUndoLimit(0);
+    ASSERT(sheet.MemoryUsage().Total() < usage.Total());
+    ASSERT_EQUAL(sheet.MemoryUsage().history, empty.history);
+
+    sheet.Snapshot();
+    sheet.Subscribe([](const std::vector<Sheet::CellChange>&) {});
+    const auto shared = sheet.MemoryUsage();
+    ASSERT(shared.snapshots > 0);
+    ASSERT(shared.subscriptions > 0);
+}
+
+void TestSheetLimits() {
+    using Value = CellInterface::Value;
+    SheetOptions options;
+    options.limits.max_formula_length = 20;
+    options.limits.max_references = 3;
+    options.limits.max_cells = 4;
+    Sheet sheet(options);
+
+    auto expect_limit = [](const std::function<void()>& action) {
+        try {
+            action();
+            ASSERT(false);
+        } catch (const LimitExceededException&) {
+        }
+    };
+
+    sheet.SetCell("A1"_pos, "=B1+B2+B3");
+    expect_limit([&] { sheet.SetCell("A1"_pos, "=B1+B2+B3+B4"); });
+    expect_limit([&] { sheet.SetCell("A1"_pos, "=1+2+3+4+5+6+7+8+9+10+11"); });
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "=B1+B2+B3");
+    // Повторные ссылки на одну ячейку считаются один раз
+    sheet.SetCell("A2"_pos, "=B1+B1+B1+B1");
+    sheet.SetCell("A3"_pos, "text");
+    sheet.SetCell("A4"_pos, "text");
+    expect_limit([&] { sheet.SetCell("A5"_pos, "text"); });
+    ASSERT(sheet.GetCell("A5"_pos) == nullptr);
+    sheet.SetCell("A4"_pos, "changed");
+
+    // Длинная цепочка строится за линейное время, а вычисление глубже
+    // ограничения даёт ошибку
+    constexpr int chain = 20000;
+    SheetOptions depth_options;
+    depth_options.limits.max_dependency_depth = 4096;
+    Sheet deep(depth_options);
+    deep.SetUndoLimit(0);
+    deep.SetCell("A1"_pos, "1");
+    for (int row = 1; row < chain; ++row) {
+        deep.SetCell({ row % Position::MAX_ROWS, row / Position::MAX_ROWS },
+                     "=" + Position{ (row - 1) % Position::MAX_ROWS, (row - 1) / Position::MAX_ROWS }.ToString() + "+1");
+    }
+    const Position last{ (chain - 1) % Position::MAX_ROWS, (chain - 1) / Position::MAX_ROWS };
+    expect_limit([&] { deep.GetCell(last)->GetValue(); });
+    ASSERT(!static_cast<const Cell*>(deep.GetCell(last))->HasCachedValue());
+    // Вычисление по частям укладывается в ограничение
+    for (int row = 1000; row < chain; row += 1000) {
+        deep.GetCell({ row % Position::MAX_ROWS, row / Position::MAX_ROWS })->GetValue();
+    }
+    ASSERT_EQUAL(deep.GetCell(last)->GetValue(), Value(double(chain)));
+    try {
+        deep.SetCell("A1"_pos, "=" + last.ToString());
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+
+    // Время запроса
+    SheetOptions timed;
+    timed.limits.max_evaluation_time = std::chrono::milliseconds(1);
+    Sheet slow(timed);
+    for (int col = 0; col < 10; ++col) {
+        slow.SetCell({ 0, col }, "1.5");
+    }
+    for (int row = 1; row < Position::MAX_ROWS; ++row) {
+        slow.SetCell({ row, 0 }, "=A1+B1+C1+D1+E1+F1+G1+H1+I1+J1");
+    }
+    expect_limit([&] { slow.Recalculate(); });
+    ASSERT_EQUAL(slow.GetCell("A2"_pos)->GetValue(), Value(15.0));
+
+    // Ошибка в потоке пересчёта книги бросается в вызывающем потоке
+    SheetOptions book_options;
+    book_options.limits.max_dependency_depth = 4;
+    Workbook book(book_options);
+    for (const char* name : { "First", "Second" }) {
+        Sheet& page = book.AddSheet(name);
+        for (int row = 0; row < 20; ++row) {
+            page.SetCell({ row, 0 }, row + 1 < 20 ? "=" + Position{ row + 1, 0 }.ToString() + "+1" : "1");
+        }
+    }
+    expect_limit([&] { book.Recalculate(2); });
+    expect_limit([&] { book.Recalculate(1); });
+}
+
+void TestDeepChains() {
+    using Value = CellInterface::Value;
+    auto at = [](int index) {
+        return Position{ index % Position::MAX_ROWS, index / Position::MAX_ROWS };
+    };
+
+    // Цепочка много длиннее, чем позволил бы рекурсивный обход
+    constexpr int chain = 100000;
+    Sheet sheet;
+    sheet.SetUndoLimit(0);
+    sheet.SetCell(at(0), "1");
+    for (int i = 1; i < chain; ++i) {
+        sheet.SetCell(at(i), "=" + at(i - 1).ToString() + "+1");
+    }
+    auto snapshot = sheet.Snapshot();
+    ASSERT_EQUAL(sheet.GetCell(at(chain - 1))->GetValue(), Value(double(chain)));
+    ASSERT_EQUAL(snapshot->GetCell(at(chain - 1))->GetValue(), Value(double(chain)));
+
+    // Сброс кэшей вдоль всей цепочки и ошибка, дошедшая до её конца
+    sheet.SetCell(at(0), "=1/0");
+    ASSERT_EQUAL(sheet.GetCell(at(chain - 1))->GetValue(), Value(FormulaError::Category::Div0));
+    sheet.SetCell(at(0), "2");
+    ASSERT_EQUAL(sheet.GetCell(at(chain - 1))->GetValue(), Value(double(chain + 1)));
+
+    const std::string path = "deep_snapshot_test.bin";
+    {
+        std::ofstream output(path, std::ios::binary);
+        SaveSnapshot(sheet, output);
+    }
+    ASSERT_EQUAL(OpenSnapshot(path)->GetCell(at(chain - 1))->GetValue(), Value(double(chain + 1)));
+    std::remove(path.c_str());
+
+    // Каждая ячейка ссылается на две предыдущие: отложенные вычисления
+    // возобновляются на развилках
+    Sheet branching;
+    branching.SetUndoLimit(0);
+    branching.SetCell(at(0), "1");
+    branching.SetCell(at(1), "1");
+    constexpr int branches = 3000;
+    for (int i = 2; i < branches; ++i) {
+        branching.SetCell(at(i), "=" + at(i - 1).ToString() + "-" + at(i - 2).ToString() + "+1");
+    }
+    // x(i) = x(i-1) - x(i-2) + 1 при x(0) = x(1) = 1 даёт единицы
+    ASSERT_EQUAL(branching.GetCell(at(branches - 1))->GetValue(), Value(1.0));
+}
+
+void TestForEachCell() {
+    Sheet sheet;
+    auto positions = [&sheet] {
+        std::vector<Position> result;
+        sheet.ForEachCell([&result](Position pos, const CellInterface&) {
+            result.push_back(pos);
+        });
+        return result;
+    };
+
+    sheet.SetCell("C3"_pos, "=A1+1");
+    sheet.SetCell("B1"_pos, "text");
+    sheet.SetCell("Z9000"_pos, "far");
+    sheet.SetCell("A3"_pos, "1");
+    sheet.SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(positions(), (std::vector{ "A1"_pos, "B1"_pos, "A3"_pos, "C3"_pos, "Z9000"_pos }));
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 9000, 26 }));
+
+    // Удалённая крайняя ячейка сужает печатную область
+    sheet.ClearCell("Z9000"_pos);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 3, 3 }));
+    sheet.InsertRows(1);
+    sheet.DeleteCols(1);
+    ASSERT_EQUAL(positions(), (std::vector{ "A1"_pos, "A4"_pos, "B4"_pos }));
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 4, 2 }));
+    ASSERT(sheet.Undo());
+    ASSERT(sheet.Undo());
+    ASSERT_EQUAL(positions(), (std::vector{ "A1"_pos, "B1"_pos, "A3"_pos, "C3"_pos }));
+    ASSERT(sheet.Redo());
+    ASSERT(sheet.Redo());
+    ASSERT_EQUAL(positions(), (std::vector{ "A1"_pos, "A4"_pos, "B4"_pos }));
+
+    std::ostringstream values;
+    sheet.PrintValues(values);
+    ASSERT_EQUAL(values.str(), "2\t\n\t\n\t\n1\t3\n");
+
+    const std::vector<CellInterface::Value> expected{ std::string("2"), std::string(), std::string(), std::string() };
+    ASSERT_EQUAL(sheet.EvaluateRegion("A1"_pos, { 2, 2 }), expected);
+
+    // Ячейка с пустым текстом остаётся в таблице, но не перечисляется
+    sheet.SetCell("B2"_pos, std::string());
+    ASSERT(sheet.GetCell("B2"_pos) != nullptr);
+    ASSERT_EQUAL(positions(), (std::vector{ "A1"_pos, "A4"_pos, "B4"_pos }));
+}
+
+void TestExtractNumbers() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1.5");
+    sheet.SetCell("A2"_pos, "text");
+    sheet.SetCell("A3"_pos, "'7");
+    sheet.SetCell("B1"_pos, "=A1*2");
+    sheet.SetCell("B2"_pos, "=A2*2");
+    sheet.SetCell("B3"_pos, "=A3*2");
+    sheet.SetCell("C1"_pos, "=1/0");
+    // Протянутые формулы вычисляются блоком
+    for (int row = 0; row < 300; ++row) {
+        sheet.SetCell({ row, 3 }, std::to_string(row));
+        sheet.SetCell({ row, 4 }, "=D" + std::to_string(row + 1) + "+1");
+    }
+
+    std::vector<double> out(4 * 3);
+    std::vector<uint8_t> status(out.size());
+    sheet.ExtractNumbers("A1"_pos, { 4, 3 }, out.data(), status.data());
+    auto expect = [&](Position pos, NumberStatus expected_status, double expected) {
+        const size_t i = static_cast<size_t>(pos.row) * 3 + pos.col;
+        ASSERT_EQUAL(static_cast<int>(status[i]), static_cast<int>(expected_status));
+        if (expected_status == NumberStatus::Number || expected_status == NumberStatus::Empty) {
+            ASSERT_EQUAL(out[i], expected);
+        }
+        else {
+            ASSERT(std::isnan(out[i]));
+        }
+    };
+    expect("A1"_pos, NumberStatus::Number, 1.5);
+    expect("A2"_pos, NumberStatus::Text, 0.0);
+    expect("A3"_pos, NumberStatus::Number, 7.0);
+    expect("B1"_pos, NumberStatus::Number, 3.0);
+    expect("B2"_pos, NumberStatus::Error, 0.0);
+    expect("B3"_pos, NumberStatus::Number, 14.0);
+    expect("C1"_pos, NumberStatus::Error, 0.0);
+    expect("C2"_pos, NumberStatus::Empty, 0.0);
+    expect("A4"_pos, NumberStatus::Empty, 0.0);
+
+    std::vector<double> column(300);
+    std::vector<uint8_t> column_status(column.size());
+    sheet.ExtractNumbers("E1"_pos, { 300, 1 }, column.data(), column_status.data());
+    for (int row = 0; row < 300; ++row) {
+        ASSERT_EQUAL(column[row], row + 1.0);
+        ASSERT_EQUAL(static_cast<int>(column_status[row]), static_cast<int>(NumberStatus::Number));
+        ASSERT(static_cast<const Cell*>(sheet.GetCell({ row, 4 }))->HasCachedValue());
+    }
+
+    // Разбор текста совпадает с потоковым: пробелы, знак и переполнение
+    ASSERT_EQUAL(ParseCellNumber("+2").value_or(0.0), 2.0);
+    ASSERT_EQUAL(ParseCellNumber(" 2").value_or(0.0), 2.0);
+    ASSERT(!ParseCellNumber("2 ").has_value());
+    ASSERT(!ParseCellNumber("inf").has_value());
+    ASSERT(!ParseCellNumber("1e999").has_value());
+}
+
+void TestAsyncRecalculation() {
+    using Value = CellInterface::Value;
+    Sheet sheet;
+    for (int col = 0; col < 10; ++col) {
+        sheet.SetCell({ 0, col }, "1.5");
+    }
+    for (int row = 1; row < Position::MAX_ROWS; ++row) {
+        sheet.SetCell({ row, 0 }, "=A1+B1+C1+D1+E1+F1+G1+H1+I1+J1");
+    }
+    sheet.SetCell("B2"_pos, "=A2*2");
+
+    {
+        AsyncRecalculator recalculator(sheet, PendingPolicy::Marker);
+        ASSERT(!recalculator.GetValue("B2"_pos).has_value());
+        recalculator.Schedule();
+        recalculator.Wait();
+        ASSERT(recalculator.IsCurrent());
+        ASSERT(recalculator.GetError() == nullptr);
+        ASSERT_EQUAL(*recalculator.GetValue("B2"_pos), Value(30.0));
+        ASSERT_EQUAL(*recalculator.GetValue("C2"_pos), Value(std::string()));
+
+        // Изменение не вычисляет таблицу, а новые изменения отменяют устаревший пересчёт
+        for (int i = 0; i < 5; ++i) {
+            recalculator.SetCell("A1"_pos, std::to_string(i));
+        }
+        ASSERT(!static_cast<const Cell*>(sheet.GetCell("B2"_pos))->HasCachedValue());
+        recalculator.Wait();
+        ASSERT(recalculator.GetCancelledCount() > 0);
+        ASSERT_EQUAL(*recalculator.GetValue("B2"_pos), Value(2 * (4 + 13.5)));
+    }
+
+    // Читатели видят прежнее значение, пока новое не вычислено
+    AsyncRecalculator recalculator(sheet);
+    recalculator.Schedule();
+    recalculator.Wait();
+    std::thread reader([&recalculator] {
+        for (int i = 0; i < 100; ++i) {
+            const auto value = recalculator.GetValue("B2"_pos);
+            ASSERT(value == Value(35.0) || value == Value(37.0));
+        }
+    });
+    recalculator.SetCell("A1"_pos, "5");
+    reader.join();
+    recalculator.Wait();
+    ASSERT_EQUAL(*recalculator.GetValue("A2"_pos), Value(18.5));
+}
 }  // namespace
 
 int main() {
@@ -359,6 +1752,9 @@ int main() {
     RUN_TEST(tr, TestFormulaArithmetic);
     RUN_TEST(tr, TestFormulaReferences);
     RUN_TEST(tr, TestFormulaExpressionFormatting);
+    RUN_TEST(tr, TestFormulaSimplification);
+    RUN_TEST(tr, TestFormulaKernels);
+    RUN_TEST(tr, TestFormulaAstCells);
     RUN_TEST(tr, TestFormulaReferencedCells);
     RUN_TEST(tr, TestErrorValue);
     RUN_TEST(tr, TestErrorDiv0);
@@ -366,7 +1762,32 @@ int main() {
     RUN_TEST(tr, TestFormulaInvalidPosition);
     RUN_TEST(tr, TestPrint);
     RUN_TEST(tr, TestCellReferences);
+    RUN_TEST(tr, TestReferencesToEmptyCells);
     RUN_TEST(tr, TestFormulaIncorrect);
     RUN_TEST(tr, TestCellCircularReferences);
+    RUN_TEST(tr, TestSnapshot);
+    RUN_TEST(tr, TestSnapshotValidation);
+    RUN_TEST(tr, TestImportTexts);
+    RUN_TEST(tr, TestImportCsv);
+    RUN_TEST(tr, TestImportBatches);
+    RUN_TEST(tr, TestSheetSnapshot);
+    RUN_TEST(tr, TestCacheInvalidation);
+    RUN_TEST(tr, TestConcurrentRead);
+    RUN_TEST(tr, TestUndoRedo);
+    RUN_TEST(tr, TestInsertDeleteRowsCols);
+    RUN_TEST(tr, TestUndoStructureChanges);
+    RUN_TEST(tr, TestRecalculateColumns);
+    RUN_TEST(tr, TestEvaluationBackends);
+    RUN_TEST(tr, TestEvaluateRegion);
+    RUN_TEST(tr, TestChangeSubscription);
+    RUN_TEST(tr, TestEarlyCutoff);
+    RUN_TEST(tr, TestEarlyCutoffInterrupted);
+    RUN_TEST(tr, TestWorkbook);
+    RUN_TEST(tr, TestMemoryUsage);
+    RUN_TEST(tr, TestSheetLimits);
+    RUN_TEST(tr, TestAsyncRecalculation);
+    RUN_TEST(tr, TestDeepChains);
+    RUN_TEST(tr, TestForEachCell);
+    RUN_TEST(tr, TestExtractNumbers);
     return 0;
 }
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <deque>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Память таблицы в байтах по подсистемам. Считаются запрошенные у
+// распределителя размеры без его служебных заголовков и выравнивания.
+struct SheetMemoryUsage {
+    // Хэш-таблицы ячеек и ссылок на пустые позиции, упорядоченный индекс ячеек
+    size_t cell_storage = 0;
+    // Объекты Cell
+    size_t cells = 0;
+    // Содержимое ячеек (объекты Impl) без кэшей значений
+    size_t impls = 0;
+    // Строки текстовых ячеек, не поместившиеся в сам объект строки
+    size_t texts = 0;
+    // Разобранные формулы: деревья, вычислители, текст выражения и ссылки
+    size_t formulas = 0;
+    // Множества зависимых ячеек и ячеек, на которые ссылается формула
+    size_t dependencies = 0;
+    // Кэши вычисленных значений формул
+    size_t caches = 0;
+    // Журнал отмены и повтора: записи, ячейки вне таблицы и их прежнее
+    // содержимое
+    size_t history = 0;
+    // Постоянное хранилище снимков: узлы и записи ячеек, достижимые из
+    // текущего состояния. Формулы разделяются с ячейками и учтены в formulas.
+    size_t snapshots = 0;
+    // Подписчики и накопленные для них изменения, без состояния самих
+    // обработчиков
+    size_t subscriptions = 0;
+
+    size_t Total() const {
+        return cell_storage + cells + impls + texts + formulas + dependencies + caches
+            + history + snapshots + subscriptions;
+    }
+};
+
+namespace memory_usage {
+    // Счётчики shared_ptr, созданного из готового указателя
+    constexpr size_t SHARED_CONTROL_BLOCK_BYTES = 2 * sizeof(void*) + 2 * sizeof(int);
+
+    // Объект, созданный make_shared: счётчики и объект в одном блоке
+    template <typename T>
+    constexpr size_t MakeSharedBytes() {
+        constexpr size_t header = sizeof(void*) + 2 * sizeof(int);
+        return (header + alignof(T) - 1) / alignof(T) * alignof(T) + sizeof(T);
+    }
+
+    // Память строки вне объекта: короткие строки хранятся в нём самом
+    inline size_t StringHeapBytes(const std::string& str) {
+        const char* data = str.data();
+        const char* object = reinterpret_cast<const char*>(&str);
+        if (data >= object && data < object + sizeof(str)) {
+            return 0;
+        }
+        return str.capacity() + 1;
+    }
+
+    template <typename T>
+    size_t VectorBytes(const std::vector<T>& vector) {
+        return vector.capacity() * sizeof(T);
+    }
+
+    // Блоки элементов и карта блоков дека (как в libstdc++: блок - 512 байт,
+    // карта - не меньше 8 указателей). Карта растёт с запасом, поэтому
+    // оценка снизу.
+    template <typename T>
+    size_t DequeBytes(const std::deque<T>& deque) {
+        constexpr size_t block = sizeof(T) < 512 ? 512 / sizeof(T) * sizeof(T) : sizeof(T);
+        const size_t blocks = deque.size() * sizeof(T) / block + 1;
+        return blocks * block + std::max<size_t>(8, blocks + 2) * sizeof(void*);
+    }
+
+    // Массив корзин и узлы хэш-таблицы. Узел хранит указатель на следующий
+    // узел, элемент и, если хэш-функция может бросать исключения, её
+    // значение (как в libstdc++).
+    template <typename HashTable>
+    size_t HashTableBytes(const HashTable& table) {
+        using Hasher = typename HashTable::hasher;
+        using Key = typename HashTable::key_type;
+        constexpr bool cached_hash = !std::is_nothrow_invocable_v<const Hasher&, const Key&>;
+        constexpr size_t node = sizeof(void*) + sizeof(typename HashTable::value_type) + (cached_hash ? sizeof(size_t) : 0);
+        // Таблица из одной корзины хранит её в самом объекте
+        const size_t buckets = table.bucket_count() > 1 ? table.bucket_count() * sizeof(void*) : 0;
+        return buckets + table.size() * node;
+    }
+}  // namespace memory_usage
@@ -2,23 +2,71 @@
 
 #include "cell.h"
 #include "common.h"
+#include "workbook.h"
 
+#include <algorithm>
 #include <iostream>
 #include <cassert>
+#include <tuple>
+#include <unordered_set>
 
 using namespace std::literals;
 
+Sheet::Sheet(SheetOptions options) : options_(options) {}
+
+Sheet::Sheet(SheetOptions options, Workbook* workbook, std::string name)
+    : options_(options), workbook_(workbook), name_(std::move(name)) {}
+
+const SheetOptions& Sheet::GetOptions() const {
+    return options_;
+}
+
 void Sheet::SetCell(Position pos, std::string text) {
     // Проверяем, является ли позиция допустимой
     CheckValidPosition(pos);
-
-    // Если ячейка на данной позиции не существует, создаем новую
-    if (sheet_.count(pos) == 0) {
-        sheet_[pos] = std::make_unique<Cell>(*this);
+    
+    // Изменения вложенных ячеек попадают в ту же группу журнала
+    BeginBatch();
+    try {
+        Cell* cell = FindCell(pos);
+        RecordChange(pos, cell);
+        
+        // Если ячейка на данной позиции не существует, создаем новую. Она
+        // добавляется в таблицу до установки текста, чтобы проверка циклов
+        // видела формулы, которые ссылаются на эту позицию.
+        const bool created = cell == nullptr;
+        if (created) {
+            if (options_.limits.max_cells != 0 && sheet_.size() >= options_.limits.max_cells) {
+                throw LimitExceededException("too many cells"s);
+            }
+            cell = &AttachCell(pos, std::make_unique<Cell>(*this));
+        }
+        
+        // Устанавливаем значение текста в ячейке. Отклонённый текст не
+        // оставляет в таблице новой ячейки, а в журнале - записей.
+        Cell::Content previous;
+        try {
+            cell->Set(std::move(text), &previous);
+        }
+        catch (...) {
+            if (created) {
+                DetachCell(pos);
+            }
+            throw;
+        }
+        if (created) {
+            Record({ pos, true, nullptr, {}, {} });
+        }
+        if (!previous.IsEmpty()) {
+            Record({ pos, false, nullptr, std::move(previous), {} });
+        }
+        UpdateVersion(pos);
     }
-
-    // Устанавливаем значение текста в ячейке
-    sheet_[pos]->Set(text);
+    catch (...) {
+        EndBatch();
+        throw;
+    }
+    EndBatch();
 }
 
 const CellInterface* Sheet::GetCell(Position pos) const {
@@ -30,13 +78,9 @@ CellInterface* Sheet::GetCell(Position pos) {
     // Проверяем, является ли позиция допустимой
     CheckValidPosition(pos);
     
-    // Если ячейка на данной позиции не существует, возвращаем nullptr
-    if (sheet_.count(pos) == 0) {
-        return nullptr;
-    }
-    
-    // Возвращаем указатель на ячейку на данной позиции
-    return sheet_.at(pos).get();
+    // Если ячейка на данной позиции не существует, возвращаем nullptr.
+    // Поиск выполняется один раз: метод вызывается на каждую ссылку формулы.
+    return FindCell(pos);
 }
 
 void Sheet::ClearCell(Position pos) {
@@ -51,76 +95,831 @@ void Sheet::ClearCell(Position pos) {
         return;
     }
 
-    // Если у ячейки есть зависимости, сбрасываем только значение ячейки
-    if (cell->second->IsReferenced()) {
-        cell->second->Clear();
+    BeginBatch();
+    RecordChange(pos, cell->second.get());
+    
+    // Очистка снимает ссылки ячейки и сбрасывает кэш зависимых от неё ячеек
+    Cell::Content previous;
+    cell->second->Clear(&previous);
+    if (!previous.IsEmpty()) {
+        Record({ pos, false, nullptr, std::move(previous), {} });
     }
-    else {
-        // Если у ячейки нет зависимостей, удаляем её из хранилища
-        sheet_.erase(cell);
+    
+    // Удаляем ячейку из хранилища, зависимые формулы запоминаются таблицей.
+    // Журнал сохраняет саму ячейку, чтобы вернуть её при отмене.
+    Record({ pos, true, DetachCell(pos), {}, {} });
+    
+    if (versions_) {
+        versions_->Clear(pos);
     }
+    
+    EndBatch();
 }
 
 Size Sheet::GetPrintableSize() const {
-    // Инициализируем размер таблицы для вывода на печать
-    Size printable_size = { 0, 0 };
+    // Границы хранятся в индексе позиций
+    return index_.GetBounds();
+}
+
+void Sheet::PrintValues(std::ostream& output) const {
+    // Выводим значения ячеек по строкам, разделяя их табуляцией. Значение
+    // пустой позиции - пустая строка.
+    PrintInRowOrder(output, GetPrintableSize(), [this](const auto& callback) {
+        ForEachCell(callback);
+    }, [&output](const CellInterface& cell) {
+        std::visit([&](const auto& value) {
+            output << value;
+        }, cell.GetValue());
+    });
+}
+
+void Sheet::PrintTexts(std::ostream& output) const {
+    // Печатаем тексты ячеек без промежуточной строки
+    PrintInRowOrder(output, GetPrintableSize(), [this](const auto& callback) {
+        ForEachCell(callback);
+    }, [&output](const CellInterface& cell) {
+        static_cast<const Cell&>(cell).PrintText(output);
+    });
+}
+
+void Sheet::ForEachCell(const std::function<void(Position, const CellInterface&)>& callback) const {
+    index_.ForEach([&callback](Position pos, const Cell* cell) {
+        if (!cell->IsEmpty()) {
+            callback(pos, *cell);
+        }
+    });
+}
+
+const SheetInterface* Sheet::GetLinkedSheet(std::string_view name) const {
+    return ResolveSheet(name);
+}
+
+const std::string& Sheet::GetName() const {
+    return name_;
+}
+
+std::shared_ptr<const SheetInterface> Sheet::Snapshot() {
+    // При первом снимке переносим все ячейки в постоянное хранилище
+    if (!versions_) {
+        versions_ = std::make_unique<VersionedStorage>();
+        ForEachCell([this](Position pos, const CellInterface& cell) {
+            versions_->Set(pos, cell.GetText(), static_cast<const Cell&>(cell).ShareFormula());
+        });
+    }
+    
+    return versions_->Snapshot();
+}
+
+void Sheet::BeginBatch() {
+    ++batch_depth_;
+}
+
+void Sheet::EndBatch() {
+    if (--batch_depth_ > 0) {
+        return;
+    }
     
-    // Находим максимальную позицию в таблице
-    for (auto it = sheet_.begin(); it != sheet_.end(); ++it) {
-        if (it->second != nullptr) {
-            const int col = it->first.col;
-            const int row = it->first.row;
-            
-            printable_size.cols = std::max(printable_size.cols, col + 1);
-            printable_size.rows = std::max(printable_size.rows, row + 1);
+    if (!current_batch_.empty()) {
+        // Новое изменение делает отменённые группы недоступными для повтора
+        redo_.clear();
+        undo_.push_back(std::move(current_batch_));
+        current_batch_.clear();
+        
+        while (undo_.size() > undo_limit_) {
+            undo_.pop_front();
         }
     }
     
-    // Возвращаем размер таблицы
-    return printable_size;
+    DeliverChanges();
 }
 
-void Sheet::PrintValues(std::ostream& output) const {
-    // Получаем размер таблицы
-    Size size = GetPrintableSize();
-    
-    // Выводим значение ячейки в поток вывода, разделяя значения тбауляцией
-    for (int r = 0; r < size.rows; ++r) {
-        for (int c = 0; c < size.cols; ++c) {
-            if (c > 0) {
-                output << "\t";
+bool Sheet::Undo() {
+    if (batch_depth_ > 0) {
+        throw std::logic_error("cannot undo inside a batch"s);
+    }
+    if (undo_.empty()) {
+        return false;
+    }
+    
+    Batch batch = std::move(undo_.back());
+    undo_.pop_back();
+    
+    // Записи применяются в обратном порядке
+    replaying_ = true;
+    for (auto it = batch.rbegin(); it != batch.rend(); ++it) {
+        Apply(*it);
+    }
+    replaying_ = false;
+    
+    redo_.push_back(std::move(batch));
+    DeliverChanges();
+    return true;
+}
+
+bool Sheet::Redo() {
+    if (batch_depth_ > 0) {
+        throw std::logic_error("cannot redo inside a batch"s);
+    }
+    if (redo_.empty()) {
+        return false;
+    }
+    
+    Batch batch = std::move(redo_.back());
+    redo_.pop_back();
+    
+    replaying_ = true;
+    for (auto& entry : batch) {
+        Apply(entry);
+    }
+    replaying_ = false;
+    
+    undo_.push_back(std::move(batch));
+    DeliverChanges();
+    return true;
+}
+
+void Sheet::SetUndoLimit(size_t limit) {
+    undo_limit_ = limit;
+    while (undo_.size() > undo_limit_) {
+        undo_.pop_front();
+    }
+}
+
+void Sheet::InsertRows(int before, int count) {
+    CheckStructureArguments(before, count, Position::MAX_ROWS);
+    ChangeStructure({ true, true, before, count });
+}
+
+void Sheet::InsertCols(int before, int count) {
+    CheckStructureArguments(before, count, Position::MAX_COLS);
+    ChangeStructure({ false, true, before, count });
+}
+
+void Sheet::DeleteRows(int first, int count) {
+    CheckStructureArguments(first, count, Position::MAX_ROWS);
+    ChangeStructure({ true, false, first, count });
+}
+
+void Sheet::DeleteCols(int first, int count) {
+    CheckStructureArguments(first, count, Position::MAX_COLS);
+    ChangeStructure({ false, false, first, count });
+}
+
+Position Sheet::StructureChange::Move(Position pos) const {
+    int& line = rows ? pos.row : pos.col;
+    if (line < index) {
+        return pos;
+    }
+    if (inserting) {
+        line += count;
+    }
+    else if (line >= index + count) {
+        line -= count;
+    }
+    else {
+        return Position::NONE;
+    }
+    // За пределами таблицы позиция тоже недействительна
+    return pos.IsValid() ? pos : Position::NONE;
+}
+
+FormulaInterface::HandlingResult Sheet::StructureChange::Update(FormulaInterface& formula) const {
+    if (inserting) {
+        return rows ? formula.HandleInsertedRows(index, count) : formula.HandleInsertedCols(index, count);
+    }
+    return rows ? formula.HandleDeletedRows(index, count) : formula.HandleDeletedCols(index, count);
+}
+
+Sheet::StructureChange Sheet::StructureChange::Inverse() const {
+    return { rows, !inserting, index, count };
+}
+
+void Sheet::ChangeStructure(const StructureChange& change) {
+    if (change.count == 0) {
+        return;
+    }
+    
+    BeginBatch();
+    try {
+        if (!change.inserting) {
+            ClearDeletedRange(change);
+        }
+        ShiftCells(change);
+        Record({ Position::NONE, false, nullptr, {}, change });
+    }
+    catch (...) {
+        EndBatch();
+        throw;
+    }
+    EndBatch();
+}
+
+void Sheet::ClearDeletedRange(const StructureChange& change) {
+    const int last = change.index + change.count;
+    auto for_each_deleted = [&](const auto& index, auto callback) {
+        if (change.rows) {
+            index.ForEachInRows(change.index, last, callback);
+        }
+        else {
+            index.ForEachInCols(change.index, last, callback);
+        }
+    };
+    
+    // Удаляемые ячейки очищаются так же, как ClearCell(): журнал хранит их
+    // содержимое, а формулы, которые на них ссылаются, начинают ссылаться на
+    // пустые позиции
+    std::vector<Position> removed;
+    for_each_deleted(index_, [&removed](Position pos, const Cell*) {
+        removed.push_back(pos);
+    });
+    for (Position pos : removed) {
+        ClearCell(pos);
+    }
+    
+    // Формулы этой таблицы, которые ссылаются на удаляемую область. Ссылки на
+    // другие листы не сдвигаются и не переписываются.
+    std::vector<Cell*> rewritten;
+    for_each_deleted(empty_index_, [&](Position, const std::vector<Cell*>* dependents) {
+        for (Cell* cell : *dependents) {
+            const auto refs = cell->GetReferencedCells();
+            const bool deleted = std::any_of(refs.begin(), refs.end(), [&change](Position ref) {
+                return !change.Move(ref).IsValid();
+            });
+            if (&cell->GetSheet() == this && deleted) {
+                rewritten.push_back(cell);
+            }
+        }
+    });
+    std::sort(rewritten.begin(), rewritten.end(), [](const Cell* lhs, const Cell* rhs) {
+        return lhs->GetPosition() < rhs->GetPosition();
+    });
+    rewritten.erase(std::unique(rewritten.begin(), rewritten.end()), rewritten.end());
+    
+    // Удаление с последующей вставкой тех же строк (столбцов) заменяет ссылки
+    // на область на #REF!, а остальные ссылки оставляет на месте. Формула
+    // получает новую копию, а прежняя остаётся в журнале.
+    const StructureChange restore = change.Inverse();
+    for (Cell* cell : rewritten) {
+        const Position pos = cell->GetPosition();
+        RecordChange(pos, cell);
+        Cell::Content previous;
+        cell->RewriteReferences([&change, &restore](FormulaInterface& formula) {
+            change.Update(formula);
+            restore.Update(formula);
+        }, &previous);
+        Record({ pos, false, nullptr, std::move(previous), {} });
+        UpdateVersion(pos);
+    }
+}
+
+void Sheet::ShiftCells(const StructureChange& change) {
+    // Сдвигаются только позиции за точкой изменения, их перечисляют индексы
+    const int limit = change.rows ? Position::MAX_ROWS : Position::MAX_COLS;
+    auto for_each_shifted = [&](const auto& index, auto callback) {
+        if (change.rows) {
+            index.ForEachInRows(change.index, limit, callback);
+        }
+        else {
+            index.ForEachInCols(change.index, limit, callback);
+        }
+    };
+    
+    // Находим сдвигаемые ячейки и формулы, которые на них ссылаются. Таблица
+    // ещё не изменена - при выходе за пределы можно просто отказаться.
+    std::vector<std::pair<Position, Position>> moved;
+    std::unordered_set<Cell*> affected;
+    for_each_shifted(index_, [&](Position pos, Cell* cell) {
+        const Position new_pos = change.Move(pos);
+        if (!new_pos.IsValid()) {
+            throw InvalidPositionException("table is too big"s);
+        }
+        moved.emplace_back(pos, new_pos);
+        const auto& dependents = cell->GetDependents();
+        affected.insert(dependents.begin(), dependents.end());
+    });
+    
+    // Ссылки на пустые позиции сдвигаются вместе с ячейками. В удаляемой
+    // области остаются только ссылки других листов.
+    std::vector<std::pair<Position, Position>> moved_empty;
+    std::vector<Position> removed_empty;
+    for_each_shifted(empty_index_, [&](Position pos, const std::vector<Cell*>* dependents) {
+        const Position new_pos = change.Move(pos);
+        if (new_pos.IsValid()) {
+            moved_empty.emplace_back(pos, new_pos);
+        }
+        else if (!change.inserting) {
+            removed_empty.push_back(pos);
+        }
+        else {
+            throw InvalidPositionException("table is too big"s);
+        }
+        affected.insert(dependents->begin(), dependents->end());
+    });
+    
+    changing_structure_ = true;
+    
+    // Ссылки на другие листы, в том числе ссылки других листов на этот, не
+    // сдвигаются: после переноса ячеек они указывают на те же позиции, но уже
+    // на другие ячейки. Такие формулы отвязываются, пока позиции на своих
+    // местах, и привязываются заново после переноса.
+    std::vector<Cell*> relinked;
+    for (Cell* cell : affected) {
+        if (cell->HasSheetReferences()) {
+            cell->UnlinkReferences();
+            relinked.push_back(cell);
+        }
+    }
+    for (Position pos : removed_empty) {
+        if (empty_dependents_.erase(pos) > 0) {
+            empty_index_.Erase(pos);
+        }
+    }
+    
+    // Переносим узлы хранилища под новые ключи без копирования ячеек.
+    // Индексы сдвигаются целиком, с сохранением порядка.
+    const int delta = change.inserting ? change.count : -change.count;
+    const int first = change.inserting ? change.index : change.index + change.count;
+    std::vector<decltype(sheet_)::node_type> nodes;
+    nodes.reserve(moved.size());
+    for (const auto& [pos, new_pos] : moved) {
+        nodes.push_back(sheet_.extract(pos));
+        nodes.back().key() = new_pos;
+        if (versions_) {
+            versions_->Clear(pos);
+        }
+    }
+    for (auto& node : nodes) {
+        node.mapped()->SetPosition(node.key());
+        sheet_.insert(std::move(node));
+    }
+    
+    std::vector<decltype(empty_dependents_)::node_type> empty_nodes;
+    empty_nodes.reserve(moved_empty.size());
+    for (const auto& [pos, new_pos] : moved_empty) {
+        // Отвязанные формулы могли освободить позицию
+        if (empty_dependents_.count(pos) == 0) {
+            continue;
+        }
+        empty_nodes.push_back(empty_dependents_.extract(pos));
+        empty_nodes.back().key() = new_pos;
+    }
+    for (auto& node : empty_nodes) {
+        empty_dependents_.insert(std::move(node));
+    }
+    
+    if (change.rows) {
+        index_.ShiftRows(first, delta);
+        empty_index_.ShiftRows(first, delta);
+    }
+    else {
+        index_.ShiftCols(first, delta);
+        empty_index_.ShiftCols(first, delta);
+    }
+    
+    // Значения, запомненные для подписчиков, переходят на новые позиции
+    if (!pending_changes_.empty()) {
+        decltype(pending_changes_) pending;
+        for (auto& [pos, value] : pending_changes_) {
+            const Position new_pos = change.Move(pos);
+            if (new_pos.IsValid()) {
+                pending.emplace(new_pos, std::move(value));
             }
-            
-            const auto& it = sheet_.find({ r, c });
-            // Получаем значение ячейки
-            if (it != sheet_.end() && it->second != nullptr && !it->second->GetText().empty()) {
-                std::visit([&](const auto value) {
-                    output << value;
-                }, it->second->GetValue());
+        }
+        pending_changes_ = std::move(pending);
+    }
+    
+    for (Cell* cell : affected) {
+        if (&cell->GetSheet() == this) {
+            cell->UpdateReferences([&change](FormulaInterface& formula) {
+                return change.Update(formula);
+            });
+        }
+    }
+    for (Cell* cell : relinked) {
+        cell->RelinkReferences();
+    }
+    changing_structure_ = false;
+    
+    // Снимки получают ячейки на новых позициях и переписанные формулы
+    if (versions_) {
+        for (const auto& [pos, new_pos] : moved) {
+            UpdateVersion(new_pos);
+        }
+        for (Cell* cell : affected) {
+            if (&cell->GetSheet() == this) {
+                UpdateVersion(cell->GetPosition());
             }
         }
-        output << "\n";
     }
 }
 
-void Sheet::PrintTexts(std::ostream& output) const {
-    // Получаем размер таблицы
-    Size size = GetPrintableSize();
-    
-    // Выводим значение ячейки в поток вывода, разделяя значения табуляцией
-    for (int r = 0; r < size.rows; ++r) {
-        for (int c = 0; c < size.cols; ++c) {
-            if (c > 0) {
-                output << "\t";
+Cell* Sheet::FindCell(Position pos) const {
+    const auto it = sheet_.find(pos);
+    return it == sheet_.end() ? nullptr : it->second.get();
+}
+
+void Sheet::AddEmptyDependent(Position pos, Cell* dependent) {
+    const auto [it, inserted] = empty_dependents_.try_emplace(pos);
+    it->second.push_back(dependent);
+    if (inserted) {
+        empty_index_.Insert(pos, &it->second);
+    }
+}
+
+void Sheet::RemoveEmptyDependent(Position pos, Cell* dependent) {
+    const auto it = empty_dependents_.find(pos);
+    if (it == empty_dependents_.end()) {
+        return;
+    }
+    
+    auto& dependents = it->second;
+    dependents.erase(std::remove(dependents.begin(), dependents.end(), dependent), dependents.end());
+    if (dependents.empty()) {
+        empty_dependents_.erase(it);
+        empty_index_.Erase(pos);
+    }
+}
+
+Cell& Sheet::AttachCell(Position pos, std::unique_ptr<Cell> cell) {
+    Cell& attached = *(sheet_[pos] = std::move(cell));
+    attached.SetPosition(pos);
+    index_.Insert(pos, &attached);
+    
+    const auto it = empty_dependents_.find(pos);
+    if (it != empty_dependents_.end()) {
+        attached.AttachDependents(it->second);
+        empty_dependents_.erase(it);
+        empty_index_.Erase(pos);
+    }
+    
+    return attached;
+}
+
+std::unique_ptr<Cell> Sheet::DetachCell(Position pos) {
+    auto node = sheet_.extract(pos);
+    index_.Erase(pos);
+    const auto dependents = node.mapped()->DetachDependents();
+    for (Cell* dependent : dependents) {
+        AddEmptyDependent(pos, dependent);
+    }
+    
+    return std::move(node.mapped());
+}
+
+void Sheet::Recalculate() {
+    // Весь пересчёт - один запрос с общим сроком
+    EvaluationScope scope(options_.limits);
+    std::vector<const Cell*> cells;
+    cells.reserve(sheet_.size());
+    for (const auto& [pos, cell] : sheet_) {
+        cells.push_back(cell.get());
+    }
+    EvaluateFormulas(cells);
+}
+
+void Sheet::EvaluateFormulas(const std::vector<const Cell*>& cells) const {
+    // Формулы, которые можно вычислять поблочно, в порядке столбцов и строк
+    struct Entry {
+        Position pos;
+        const Cell* cell;
+        ElementwiseShape shape;
+    };
+    std::vector<Entry> entries;
+    std::vector<const Cell*> others;
+    for (const Cell* cell : cells) {
+        const auto formula = cell->GetFormula();
+        if (!formula) {
+            continue;
+        }
+        if (auto shape = formula->GetElementwiseShape()) {
+            entries.push_back({ cell->GetPosition(), cell, *shape });
+        }
+        else {
+            others.push_back(cell);
+        }
+    }
+    std::sort(entries.begin(), entries.end(), [](const Entry& lhs, const Entry& rhs) {
+        return std::tie(lhs.pos.col, lhs.pos.row) < std::tie(rhs.pos.col, rhs.pos.row);
+    });
+    
+    // Делим столбцы на участки протянутых формул, а участки - на блоки
+    std::vector<const Cell*> block_cells;
+    std::vector<ElementwiseShape> block_shapes;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        block_cells.push_back(entries[i].cell);
+        block_shapes.push_back(entries[i].shape);
+        const bool run_continues = i + 1 < entries.size()
+            && entries[i + 1].pos.col == entries[i].pos.col
+            && entries[i + 1].pos.row == entries[i].pos.row + 1
+            && entries[i].shape.IsFilledDownTo(entries[i + 1].shape);
+        if (!run_continues || block_cells.size() == COLUMN_BLOCK_ROWS) {
+            RecalculateBlock(block_cells, block_shapes);
+            block_cells.clear();
+            block_shapes.clear();
+        }
+    }
+    
+    // Остальные формулы и строки блоков с ошибками вычисляются обычным образом
+    for (const auto& entry : entries) {
+        if (!entry.cell->HasCachedValue()) {
+            entry.cell->GetValue();
+        }
+    }
+    for (const Cell* cell : others) {
+        cell->GetValue();
+    }
+}
+
+std::vector<CellInterface::Value> Sheet::EvaluateRegion(Position top_left, Size size, Size prefetch) const {
+    CheckValidPosition(top_left);
+    if (size.rows < 0 || size.cols < 0 || prefetch.rows < 0 || prefetch.cols < 0) {
+        throw InvalidPositionException("invalid region"s);
+    }
+    // Видимая область и соседние - один запрос с общим сроком
+    EvaluationScope scope(options_.limits);
+    
+    // Обходятся только занятые позиции области
+    std::vector<CellInterface::Value> values(static_cast<size_t>(size.rows) * size.cols, ""s);
+    index_.ForEachIn(top_left, size, [&](Position pos, const Cell* cell) {
+        const size_t index = static_cast<size_t>(pos.row - top_left.row) * size.cols + (pos.col - top_left.col);
+        values[index] = cell->GetValue();
+    });
+    
+    if (prefetch.rows == 0 && prefetch.cols == 0) {
+        return values;
+    }
+    
+    // Соседние области в пределах таблицы; видимые ячейки уже в кэше
+    const int first_row = std::max(top_left.row - prefetch.rows, 0);
+    const int last_row = std::min(top_left.row + size.rows + prefetch.rows, int{ Position::MAX_ROWS });
+    const int first_col = std::max(top_left.col - prefetch.cols, 0);
+    const int last_col = std::min(top_left.col + size.cols + prefetch.cols, int{ Position::MAX_COLS });
+    index_.ForEachIn({ first_row, first_col }, { last_row - first_row, last_col - first_col }, [](Position, const Cell* cell) {
+        if (cell->IsFormula()) {
+            cell->GetValue();
+        }
+    });
+    
+    return values;
+}
+
+void Sheet::ExtractNumbers(Position top_left, Size size, double* out, uint8_t* status) const {
+    CheckValidPosition(top_left);
+    if (size.rows < 0 || size.cols < 0) {
+        throw InvalidPositionException("invalid region"s);
+    }
+    // Вся выгрузка - один запрос с общим сроком
+    EvaluationScope scope(options_.limits);
+    
+    // Позиции без ячеек - нули
+    const size_t count = static_cast<size_t>(size.rows) * size.cols;
+    std::fill_n(out, count, 0.0);
+    std::fill_n(status, count, static_cast<uint8_t>(NumberStatus::Empty));
+    
+    // Готовые значения выгружаются сразу, невычисленные формулы - после
+    // вычисления всех вместе: протянутые формулы вычисляются блоками
+    std::vector<const Cell*> dirty;
+    auto extract = [&](const Cell& cell) {
+        const Position pos = cell.GetPosition();
+        const size_t index = static_cast<size_t>(pos.row - top_left.row) * size.cols + (pos.col - top_left.col);
+        status[index] = static_cast<uint8_t>(cell.GetNumber(out[index]));
+    };
+    index_.ForEachIn(top_left, size, [&](Position, const Cell* cell) {
+        if (cell->IsFormula() && !cell->HasCachedValue()) {
+            dirty.push_back(cell);
+        }
+        else {
+            extract(*cell);
+        }
+    });
+    
+    if (!dirty.empty()) {
+        EvaluateFormulas(dirty);
+        for (const Cell* cell : dirty) {
+            extract(*cell);
+        }
+    }
+}
+
+void Sheet::RecalculateBlock(const std::vector<const Cell*>& cells, const std::vector<ElementwiseShape>& shapes) const {
+    // Одиночную формулу выгоднее вычислить обычным образом
+    if (cells.size() < 2) {
+        return;
+    }
+    
+    const bool dirty = std::any_of(cells.begin(), cells.end(), [](const Cell* cell) {
+        return !cell->HasCachedValue();
+    });
+    if (!dirty) {
+        return;
+    }
+    
+    std::vector<std::optional<FormulaInterface::Value>> values;
+    EvaluateColumn(shapes, *this, values);
+    for (size_t i = 0; i < cells.size(); ++i) {
+        if (values[i]) {
+            cells[i]->CacheValue(*values[i]);
+        }
+    }
+}
+
+void Sheet::Record(JournalEntry entry) {
+    if (replaying_ || undo_limit_ == 0) {
+        return;
+    }
+    
+    current_batch_.push_back(std::move(entry));
+}
+
+void Sheet::Apply(JournalEntry& entry) {
+    if (entry.structure) {
+        // Удаляемая обратным сдвигом область к этому моменту снова пуста
+        entry.structure = entry.structure->Inverse();
+        ShiftCells(*entry.structure);
+        return;
+    }
+    
+    RecordChange(entry.pos, FindCell(entry.pos));
+    if (entry.presence) {
+        if (entry.detached) {
+            // Возвращаем ячейку в таблицу
+            AttachCell(entry.pos, std::move(entry.detached));
+            UpdateVersion(entry.pos);
+        }
+        else {
+            // Ячейка к этому моменту пуста и не ссылается на другие ячейки
+            entry.detached = DetachCell(entry.pos);
+            if (versions_) {
+                versions_->Clear(entry.pos);
             }
-            
-            const auto& it = sheet_.find({ r, c });
-            // Получаем значение ячейки
-            if (it != sheet_.end() && it->second != nullptr && !it->second->GetText().empty()) {
-                output << it->second->GetText();
+        }
+    }
+    else {
+        sheet_.at(entry.pos)->ExchangeContent(entry.content);
+        UpdateVersion(entry.pos);
+    }
+}
+
+size_t Sheet::Subscribe(ChangeHandler handler) {
+    // Дельты строятся по сброшенным кэшам, поэтому все формулы должны быть
+    // вычислены к моменту первого изменения
+    if (subscribers_.empty()) {
+        Recalculate();
+    }
+    
+    subscribers_.emplace_back(next_subscription_id_, std::move(handler));
+    return next_subscription_id_++;
+}
+
+void Sheet::Unsubscribe(size_t id) {
+    subscribers_.erase(std::remove_if(subscribers_.begin(), subscribers_.end(), [id](const auto& subscriber) {
+        return subscriber.first == id;
+    }), subscribers_.end());
+    if (subscribers_.empty()) {
+        pending_changes_.clear();
+    }
+}
+
+void Sheet::RecordChange(Position pos, const Cell* cell) {
+    if (subscribers_.empty() || pending_changes_.count(pos) > 0) {
+        return;
+    }
+    
+    pending_changes_.emplace(pos, cell ? cell->GetValue() : ""s);
+}
+
+bool Sheet::UsesEarlyCutoff() const {
+    return options_.recalculation_mode == RecalculationMode::EarlyCutoff && !changing_structure_;
+}
+
+void Sheet::DeliverChanges() {
+    if (workbook_) {
+        workbook_->DeliverChanges();
+    }
+    else {
+        DeliverOwnChanges();
+    }
+}
+
+void Sheet::DeliverOwnChanges() {
+    if (pending_changes_.empty()) {
+        return;
+    }
+    
+    // Новые значения вычисляются сразу, чтобы следующие изменения снова
+    // сбрасывали кэши и попадали в дельту
+    std::vector<CellChange> changes;
+    for (auto& [pos, old_value] : pending_changes_) {
+        const Cell* cell = FindCell(pos);
+        CellInterface::Value value = cell ? cell->GetValue() : ""s;
+        if (!(value == old_value)) {
+            changes.push_back({ pos, std::move(value) });
+        }
+    }
+    pending_changes_.clear();
+    if (changes.empty()) {
+        return;
+    }
+    
+    std::sort(changes.begin(), changes.end(), [](const CellChange& lhs, const CellChange& rhs) {
+        return lhs.pos < rhs.pos;
+    });
+    // Подписчик может отписаться из обработчика
+    const auto subscribers = subscribers_;
+    for (const auto& [id, handler] : subscribers) {
+        handler(changes);
+    }
+}
+
+SheetMemoryUsage Sheet::MemoryUsage() const {
+    SheetMemoryUsage usage;
+    usage.cell_storage = memory_usage::HashTableBytes(sheet_) + memory_usage::HashTableBytes(empty_dependents_)
+        + index_.GetMemoryUsage() + empty_index_.GetMemoryUsage();
+    for (const auto& [pos, dependents] : empty_dependents_) {
+        usage.cell_storage += memory_usage::VectorBytes(dependents);
+    }
+    for (const auto& [pos, cell] : sheet_) {
+        cell->AddMemoryUsage(usage);
+    }
+    
+    // Журнал: ячейки вне таблицы и прежнее содержимое учитываются по тем же
+    // подсистемам, а затем относятся к журналу целиком
+    SheetMemoryUsage history;
+    auto add_batch = [&history](const Batch& batch) {
+        history.history += memory_usage::VectorBytes(batch);
+        for (const JournalEntry& entry : batch) {
+            if (entry.detached) {
+                entry.detached->AddMemoryUsage(history);
+            }
+            entry.content.AddMemoryUsage(history);
+        }
+    };
+    history.history += memory_usage::DequeBytes(undo_) + memory_usage::VectorBytes(redo_);
+    for (const Batch& batch : undo_) {
+        add_batch(batch);
+    }
+    for (const Batch& batch : redo_) {
+        add_batch(batch);
+    }
+    add_batch(current_batch_);
+    usage.history = history.Total();
+    
+    if (versions_) {
+        usage.snapshots = sizeof(VersionedStorage) + versions_->GetMemoryUsage();
+    }
+    
+    usage.subscriptions = memory_usage::VectorBytes(subscribers_) + memory_usage::HashTableBytes(pending_changes_);
+    for (const auto& [pos, value] : pending_changes_) {
+        if (const auto* text = std::get_if<std::string>(&value)) {
+            usage.subscriptions += memory_usage::StringHeapBytes(*text);
+        }
+    }
+    
+    return usage;
+}
+
+Sheet* Sheet::ResolveSheet(std::string_view name) const {
+    return workbook_ ? workbook_->GetSheet(name) : nullptr;
+}
+
+void Sheet::RelinkReferencesTo(std::string_view name) {
+    for (const auto& [pos, cell] : sheet_) {
+        const auto formula = cell->GetFormula();
+        if (!formula) {
+            continue;
+        }
+        const auto& refs = formula->GetSheetReferences();
+        if (std::any_of(refs.begin(), refs.end(), [name](const SheetReference& ref) { return ref.sheet == name; })) {
+            cell->RelinkReferences();
+        }
+    }
+}
+
+std::vector<std::string> Sheet::GetReferencedSheetNames() const {
+    std::vector<std::string> names;
+    for (const auto& [pos, cell] : sheet_) {
+        if (const auto formula = cell->GetFormula()) {
+            for (const auto& ref : formula->GetSheetReferences()) {
+                names.push_back(ref.sheet);
             }
         }
-        output << "\n";
+    }
+    std::sort(names.begin(), names.end());
+    names.erase(std::unique(names.begin(), names.end()), names.end());
+    
+    return names;
+}
+
+void Sheet::UpdateVersion(Position pos) {
+    if (versions_) {
+        const auto& cell = sheet_.at(pos);
+        versions_->Set(pos, cell->GetText(), cell->ShareFormula());
+    }
+}
+
+void Sheet::CheckStructureArguments(int index, int count, int limit) {
+    if (index < 0 || index >= limit || count < 0 || count > limit) {
+        throw InvalidPositionException("invalid structure change"s);
     }
 }
 
@@ -132,6 +931,6 @@ void Sheet::CheckValidPosition(Position pos) {
 }
 
 // Функция для создания экземпляра класса SheetInterface
-std::unique_ptr<SheetInterface> CreateSheet() {
-    return std::make_unique<Sheet>();
+std::unique_ptr<SheetInterface> CreateSheet(SheetOptions options) {
+    return std::make_unique<Sheet>(options);
 }
\ No newline at end of file
@@ -1,16 +1,27 @@
 #pragma once
 
 #include "cell.h"
+#include "cell_index.h"
 #include "common.h"
+#include "sheet_version.h"
 
 #include <functional>
+#include <string>
+#include <string_view>
 #include <vector>
 #include <memory>
+#include <optional>
 #include <deque>
 #include <unordered_map>
 
+class Workbook;
+
+// Таблица поддерживает режим одновременного чтения (см. описание Cell):
+// константные методы можно вызывать из нескольких потоков, пока таблица
+// не изменяется.
 class Sheet : public SheetInterface {
 public:
+    explicit Sheet(SheetOptions options = {});
     ~Sheet() override = default;
     
     // Установка значения ячейки на заданной позиции
@@ -27,8 +38,122 @@ public:
     void PrintValues(std::ostream& output) const override;
     // Печать текстов ячеек в поток вывода
     void PrintTexts(std::ostream& output) const override;
+    // Лист той же книги для ссылок вида name!A1
+    const SheetInterface* GetLinkedSheet(std::string_view name) const override;
+    
+    // Обход ячеек таблицы по строкам, в строке - по столбцам. Пустые строки
+    // пропускаются, поэтому время зависит от числа ячеек, а не от размера
+    // таблицы. Ячейки с пустым текстом (например, после SetCell(pos, ""))
+    // не перечисляются. Изменять таблицу из callback нельзя.
+    void ForEachCell(const std::function<void(Position, const CellInterface&)>& callback) const;
+    
+    // Имя листа в книге, у отдельной таблицы - пустая строка
+    const std::string& GetName() const;
+    
+    // Получение неизменяемого снимка таблицы. Снимок можно читать из других
+    // потоков, пока эта таблица изменяется. Первый вызов переносит ячейки в
+    // постоянное хранилище за O(n), после чего таблица поддерживает его при
+    // каждом изменении, а следующие снимки создаются за O(1).
+    // Вызывается в том же потоке, в котором изменяется таблица.
+    std::shared_ptr<const SheetInterface> Snapshot();
+    
+    // Начало группы изменений, которая отменяется и повторяется целиком.
+    // Группы могут вкладываться, изменения вне группы образуют отдельные группы.
+    void BeginBatch();
+    // Завершение группы изменений
+    void EndBatch();
+    // Отмена последней группы изменений. Возвращает false, если отменять нечего.
+    // Журнал хранит прежнее содержимое изменённых ячеек, поэтому формулы не
+    // разбираются заново, а циклические зависимости не проверяются.
+    bool Undo();
+    // Повтор последней отменённой группы изменений
+    bool Redo();
+    // Ограничение количества групп изменений, которые можно отменить
+    void SetUndoLimit(size_t limit);
+    
+    // Вставка count строк (столбцов) перед строкой (столбцом) before.
+    // Ячейки ниже (правее) сдвигаются, ссылки формул на них переписываются на
+    // месте, без повторного разбора. Если сдвинутые ячейки выходят за пределы
+    // таблицы, бросается InvalidPositionException и таблица не изменяется.
+    // Время зависит от числа сдвинутых ячеек и формул, которые на них
+    // ссылаются, а не от размера таблицы.
+    void InsertRows(int before, int count = 1);
+    void InsertCols(int before, int count = 1);
+    // Удаление count строк (столбцов), начиная со строки (столбца) first.
+    // Ссылки на удалённые ячейки выводятся как #REF! и вычисляются в ошибку
+    // FormulaError::Category::Ref.
+    // Вставка и удаление - группы изменений журнала: отмена возвращает
+    // удалённые ячейки и прежние ссылки формул. Снимки, созданные до
+    // изменения, его не видят.
+    void DeleteRows(int first, int count = 1);
+    void DeleteCols(int first, int count = 1);
+
+    // Параметры, с которыми создана таблица
+    const SheetOptions& GetOptions() const;
+
+    // Вычисление значений всех формул таблицы. Формулы одного вида,
+    // протянутые вниз по столбцу (B1=A1*2, B2=A2*2, ...), вычисляются блоками
+    // по COLUMN_BLOCK_ROWS строк: операнды собираются в массивы, а операция
+    // выполняется векторно. Блок, все формулы которого уже вычислены,
+    // пропускается. Последующие GetValue() берут значения из кэша.
+    void Recalculate();
+
+    // Значения прямоугольника size с левым верхним углом top_left по строкам.
+    // Вычисляются только видимые формулы и ячейки, от которых они зависят,
+    // остальные формулы остаются невычисленными, поэтому время зависит от
+    // размера области, а не таблицы. Позиции без ячеек, в том числе за
+    // пределами таблицы, дают пустую строку.
+    // prefetch - подсказка о соседних областях: формулы в полосе шириной
+    // prefetch.rows строк и prefetch.cols столбцов вокруг прямоугольника
+    // вычисляются после видимых и попадают в кэш.
+    std::vector<CellInterface::Value> EvaluateRegion(Position top_left, Size size, Size prefetch = {}) const;
+
+    // Выгрузка значений прямоугольника size с левым верхним углом top_left
+    // по строкам в массивы out и status по size.rows * size.cols элементов.
+    // out[i] - значение как число, как его видит формула; status[i] - вид
+    // значения (NumberStatus): у текста, который не является числом, и у
+    // ошибок формул число равно NaN. Невычисленные формулы области
+    // вычисляются, протянутые вниз - блоками, как в Recalculate(). Обходятся
+    // только занятые позиции, значения не копируются в CellInterface::Value.
+    void ExtractNumbers(Position top_left, Size size, double* out, uint8_t* status) const;
+
+    // Изменение видимого значения ячейки
+    struct CellChange {
+        Position pos;
+        CellInterface::Value value;
+    };
+    using ChangeHandler = std::function<void(const std::vector<CellChange>& changes)>;
+
+    // Подписка на изменения значений. После каждого SetCell(), ClearCell(),
+    // внешней группы изменений, отмены и повтора подписчик получает ячейки,
+    // видимое значение которых изменилось, с новыми значениями по возрастанию
+    // позиций. Изменения группы сливаются в одну дельту, а значения, которые
+    // после пересчёта совпали с прежними, не передаются. Пока есть
+    // подписчики, затронутые изменением формулы вычисляются сразу.
+    // Вставка и удаление строк и столбцов передают только изменившиеся
+    // значения по новым позициям, сам сдвиг ячеек в дельту не попадает.
+    // Возвращает идентификатор подписки для Unsubscribe().
+    size_t Subscribe(ChangeHandler handler);
+    void Unsubscribe(size_t id);
+
+    // Память таблицы по подсистемам: ячейки, журнал отмены, хранилище
+    // снимков и подписки. Считается за один проход по ячейкам, записям
+    // журнала и хранилища без выделения памяти. Узлы, которые остались только
+    // у полученных снимков, и состояние обработчиков подписок не учитываются.
+    SheetMemoryUsage MemoryUsage() const;
+
+    static constexpr size_t DEFAULT_UNDO_LIMIT = 100;
+    static constexpr size_t COLUMN_BLOCK_ROWS = 256;
 
 private:
+    // Ячейки связывают зависимости через таблицу
+    friend class Cell;
+    // Книга создаёт свои листы и связывает ссылки между ними
+    friend class Workbook;
+    
+    // Лист книги workbook с именем name
+    Sheet(SheetOptions options, Workbook* workbook, std::string name);
+    
     struct PositionHasher {
         size_t operator()(const Position& pos) const {
             return pos.row + pos.col * 37;
@@ -37,7 +162,131 @@ private:
     
     // Проверка, является ли позиция допустимой
     static void CheckValidPosition(Position pos);
+    // Проверка аргументов вставки или удаления строк и столбцов
+    static void CheckStructureArguments(int index, int count, int limit);
+    
+    // Обновление ячейки в постоянном хранилище снимков, если оно используется
+    void UpdateVersion(Position pos);
+    
+    // Поиск ячейки без проверки позиции, nullptr если ячейки нет
+    Cell* FindCell(Position pos) const;
+    // Учёт формулы, которая ссылается на пустую позицию
+    void AddEmptyDependent(Position pos, Cell* dependent);
+    void RemoveEmptyDependent(Position pos, Cell* dependent);
+    // Добавление ячейки в таблицу. Формулы, которые ссылались на пустую
+    // позицию, становятся зависимыми от новой ячейки.
+    Cell& AttachCell(Position pos, std::unique_ptr<Cell> cell);
+    // Извлечение ячейки из таблицы. Зависимые формулы снова ссылаются на
+    // пустую позицию.
+    std::unique_ptr<Cell> DetachCell(Position pos);
+    
+    // Вставка или удаление строк или столбцов
+    struct StructureChange {
+        // Строки или столбцы
+        bool rows = true;
+        // Вставка или удаление
+        bool inserting = true;
+        // Первая вставленная или удалённая строка (столбец) и их количество
+        int index = 0;
+        int count = 0;
+        
+        // Позиция после изменения, Position::NONE для удалённой позиции
+        Position Move(Position pos) const;
+        // Применение изменения к ссылкам формулы
+        FormulaInterface::HandlingResult Update(FormulaInterface& formula) const;
+        // Изменение, которое возвращает строки (столбцы) на место
+        StructureChange Inverse() const;
+    };
     
+    // Вставка или удаление строк и столбцов одной группой журнала. Удаление
+    // сначала очищает удалённую область и переписывает ссылки на неё на #REF!
+    // (ClearDeletedRange), после чего остаётся сдвиг без потери данных, который
+    // журнал обращает обратным сдвигом.
+    void ChangeStructure(const StructureChange& change);
+    // Очистка ячеек удаляемой области и замена ссылок формул этой таблицы на
+    // неё на #REF! с записью прежнего содержимого в журнал
+    void ClearDeletedRange(const StructureChange& change);
+    // Сдвиг ячеек и пустых позиций, на которые ссылаются формулы, за точкой
+    // изменения. Позиции находятся по упорядоченным индексам, ячейки
+    // переносятся под новые ключи без копирования, а переписываются только
+    // формулы, которые ссылаются на сдвинутые позиции. Удаляемая область
+    // должна быть пуста.
+    void ShiftCells(const StructureChange& change);
+    // Запоминание прежнего значения позиции для дельты подписчиков. Первое
+    // значение позиции в дельте не перезаписывается.
+    void RecordChange(Position pos, const Cell* cell);
+    // Передача накопленных дельт подписчикам этой таблицы и, если таблица
+    // входит в книгу, остальных листов: изменение одного листа может изменить
+    // значения формул другого
+    void DeliverChanges();
+    // Передача дельты подписчикам этой таблицы
+    void DeliverOwnChanges();
+    
+    // Лист книги с именем name, nullptr у отдельной таблицы и для
+    // отсутствующего листа
+    Sheet* ResolveSheet(std::string_view name) const;
+    // Перепривязка формул, которые ссылаются на лист name, после его
+    // появления в книге
+    void RelinkReferencesTo(std::string_view name);
+    // Имена листов, на которые ссылаются формулы таблицы, без повторов
+    std::vector<std::string> GetReferencedSheetNames() const;
+    // Пересчитываются ли формулы сразу с ранней остановкой. Во время вставки
+    // и удаления строк и столбцов ссылки формул ещё не согласованы с
+    // таблицей, поэтому кэши только сбрасываются.
+    bool UsesEarlyCutoff() const;
+    // Вычисление блока формул одного вида, если хотя бы одна из них не вычислена
+    void RecalculateBlock(const std::vector<const Cell*>& cells, const std::vector<ElementwiseShape>& shapes) const;
+    // Вычисление формул среди cells: протянутые формулы - блоками, остальные
+    // - обычным образом
+    void EvaluateFormulas(const std::vector<const Cell*>& cells) const;
+    
+    // Запись журнала изменений. Применение записи обращает изменение, поэтому
+    // одна и та же запись служит и для отмены, и для повтора.
+    struct JournalEntry {
+        Position pos;
+        // Запись о создании или удалении ячейки, иначе - о смене содержимого
+        bool presence = false;
+        // Ячейка, которая сейчас находится вне таблицы
+        std::unique_ptr<Cell> detached;
+        // Содержимое, которое нужно вернуть ячейке
+        Cell::Content content;
+        // Запись о сдвиге строк или столбцов: применение выполняет обратный
+        // сдвиг и запоминает его
+        std::optional<StructureChange> structure;
+    };
+    using Batch = std::vector<JournalEntry>;
+    
+    // Добавление записи в текущую группу изменений
+    void Record(JournalEntry entry);
+    // Применение записи журнала
+    void Apply(JournalEntry& entry);
+    
+    SheetOptions options_;
+    // Книга, которой принадлежит лист, и имя листа в ней
+    Workbook* workbook_ = nullptr;
+    std::string name_;
     // Хранение ячеек таблицы
     std::unordered_map<Position, std::unique_ptr<Cell>, PositionHasher> sheet_;
+    // Позиции ячеек sheet_ в порядке строк и столбцов
+    CellIndex index_;
+    // Формулы, которые ссылаются на позиции без ячеек. Для таких ссылок
+    // ячейки-заглушки не создаются.
+    std::unordered_map<Position, std::vector<Cell*>, PositionHasher> empty_dependents_;
+    // Позиции empty_dependents_ в порядке строк и столбцов
+    PositionIndex<const std::vector<Cell*>*> empty_index_;
+    
+    // Журнал изменений
+    std::deque<Batch> undo_;
+    std::vector<Batch> redo_;
+    Batch current_batch_;
+    int batch_depth_ = 0;
+    bool replaying_ = false;
+    size_t undo_limit_ = DEFAULT_UNDO_LIMIT;
+    bool changing_structure_ = false;
+    // Подписчики на изменения значений и прежние значения изменённых позиций
+    std::vector<std::pair<size_t, ChangeHandler>> subscribers_;
+    size_t next_subscription_id_ = 0;
+    std::unordered_map<Position, CellInterface::Value, PositionHasher> pending_changes_;
+    // Постоянное хранилище для снимков, создаётся при первом снимке
+    std::unique_ptr<VersionedStorage> versions_;
 };
@@ -0,0 +1,381 @@
+#include "sheet_version.h"
+
+#include "cell_index.h"
+#include "memory_usage.h"
+#include "snapshot.h"
+#include "value_cache.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <iostream>
+#include <mutex>
+#include <utility>
+
+using namespace std::literals;
+
+struct VersionedStorage::CellRecord {
+    std::string text;
+    std::shared_ptr<const FormulaInterface> formula;
+};
+
+// Узлы помечаются поколением хранилища, в котором их создал писатель
+struct VersionedStorage::Chunk {
+    uint64_t generation = 0;
+    std::array<std::shared_ptr<const CellRecord>, CHUNK_SIZE * CHUNK_SIZE> cells;
+};
+
+struct VersionedStorage::Band {
+    uint64_t generation = 0;
+    std::array<std::shared_ptr<Chunk>, Position::MAX_COLS / CHUNK_SIZE> chunks;
+};
+
+struct VersionedStorage::Root {
+    uint64_t generation = 0;
+    std::array<std::shared_ptr<Band>, Position::MAX_ROWS / CHUNK_SIZE> bands;
+};
+
+namespace {
+    // Узел, который собираемся изменить, копируется, если он создан до
+    // последнего снимка: такой узел может читаться другими потоками.
+    // Счётчик ссылок для этого не подходит - читатели меняют его
+    // без синхронизации с писателем.
+    template <typename Node>
+    Node& Unshare(std::shared_ptr<Node>& node, uint64_t generation) {
+        if (!node) {
+            node = std::make_shared<Node>();
+            node->generation = generation;
+        }
+        else if (node->generation != generation) {
+            node = std::make_shared<Node>(*node);
+            node->generation = generation;
+        }
+
+        return *node;
+    }
+
+    size_t SlotIndex(Position pos) {
+        const int size = VersionedStorage::CHUNK_SIZE;
+        return static_cast<size_t>(pos.row % size) * size + pos.col % size;
+    }
+}  // namespace
+
+// Неизменяемая таблица поверх корня хранилища
+class VersionedStorage::View : public SheetInterface {
+public:
+    explicit View(std::shared_ptr<const Root> root) : root_(std::move(root)) {}
+
+    ~View() override {
+        for (auto& band : bands_) {
+            delete band.load(std::memory_order_relaxed);
+        }
+    }
+
+    void SetCell(Position, std::string) override {
+        throw ReadOnlySheetException("sheet snapshot is read-only"s);
+    }
+
+    const CellInterface* GetCell(Position pos) const override {
+        if (!pos.IsValid()) {
+            throw InvalidPositionException("invalid position"s);
+        }
+
+        const CellRecord* record = Find(pos);
+        if (record == nullptr) {
+            return nullptr;
+        }
+
+        // Ячейки создаются без блокировок, поэтому читатели снимка, в том
+        // числе ссылки вычисляемых формул, не ждут друг друга
+        ViewBand& band = Materialize(bands_[pos.row / CHUNK_SIZE]);
+        ViewChunk& chunk = Materialize(band.chunks[pos.col / CHUNK_SIZE]);
+        return &Materialize(chunk.cells[SlotIndex(pos)], *record, *this);
+    }
+
+    CellInterface* GetCell(Position pos) override {
+        return const_cast<CellInterface*>(std::as_const(*this).GetCell(pos));
+    }
+
+    void ClearCell(Position) override {
+        throw ReadOnlySheetException("sheet snapshot is read-only"s);
+    }
+
+    Size GetPrintableSize() const override {
+        std::call_once(size_once_, [this] {
+            printable_size_ = ComputePrintableSize();
+        });
+
+        return printable_size_;
+    }
+
+    void PrintValues(std::ostream& output) const override {
+        Print(output, [&output](const CellInterface& cell) {
+            std::visit([&output](const auto& value) {
+                output << value;
+            }, cell.GetValue());
+        });
+    }
+
+    void PrintTexts(std::ostream& output) const override {
+        Print(output, [&output](const CellInterface& cell) {
+            output << cell.GetText();
+        });
+    }
+
+    // Обход только существующих полос и блоков
+    void ForEachCell(const std::function<void(Position, const CellInterface&)>& callback) const {
+        for (size_t b = 0; b < root_->bands.size(); ++b) {
+            const auto& band = root_->bands[b];
+            if (!band) {
+                continue;
+            }
+
+            for (int row = 0; row < CHUNK_SIZE; ++row) {
+                for (size_t c = 0; c < band->chunks.size(); ++c) {
+                    const auto& chunk = band->chunks[c];
+                    if (!chunk) {
+                        continue;
+                    }
+
+                    for (int col = 0; col < CHUNK_SIZE; ++col) {
+                        if (chunk->cells[static_cast<size_t>(row) * CHUNK_SIZE + col]) {
+                            const Position pos{ static_cast<int>(b) * CHUNK_SIZE + row, static_cast<int>(c) * CHUNK_SIZE + col };
+                            callback(pos, *GetCell(pos));
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+private:
+    // Ячейка снимка. Значение формулы вычисляется один раз для снимка.
+    class ViewCell final : public CellInterface {
+    public:
+        ViewCell(const CellRecord& record, const SheetInterface& sheet) : record_(record), sheet_(sheet) {}
+
+        Value GetValue() const override {
+            if (!record_.formula) {
+                if (record_.text[0] == ESCAPE_SIGN) {
+                    return record_.text.substr(1);
+                }
+
+                return record_.text;
+            }
+
+            auto value = cache_.Get();
+            if (!value.has_value()) {
+                // Глубоко в цепочке зависимости вычисляются явным стеком
+                if (GetCellReadDepth() >= MAX_RECURSIVE_READ_DEPTH) {
+                    EvaluateDependencies(*this, [](const ViewCell& cell) {
+                        return cell.GetPendingDependencies();
+                    }, [](const ViewCell& cell) {
+                        cell.GetValue();
+                    });
+                }
+                value = record_.formula->Evaluate(sheet_);
+                cache_.Put(*value);
+            }
+
+            if (std::holds_alternative<double>(*value)) {
+                return std::get<double>(*value);
+            }
+
+            return std::get<FormulaError>(*value);
+        }
+
+        std::string GetText() const override {
+            return record_.text;
+        }
+
+        std::vector<Position> GetReferencedCells() const override {
+            if (!record_.formula) {
+                return {};
+            }
+
+            return record_.formula->GetReferencedCells();
+        }
+
+    private:
+        // Формулы снимка, на которые ссылается формула ячейки и значения
+        // которых ещё не вычислены
+        std::vector<const ViewCell*> GetPendingDependencies() const {
+            std::vector<const ViewCell*> pending;
+            for (const Position& pos : record_.formula->GetReferencedCells()) {
+                if (!pos.IsValid()) {
+                    continue;
+                }
+                const auto* cell = static_cast<const ViewCell*>(sheet_.GetCell(pos));
+                if (cell && cell->record_.formula && !cell->cache_.Get().has_value()) {
+                    pending.push_back(cell);
+                }
+            }
+            return pending;
+        }
+
+        const CellRecord& record_;
+        const SheetInterface& sheet_;
+        ValueCache cache_;
+    };
+
+    // Ячейки снимка, к которым уже обращались, в блоках и полосах, как в
+    // хранилище. Узлы создаются при первом обращении и живут до конца снимка.
+    struct ViewChunk {
+        ~ViewChunk() {
+            for (auto& cell : cells) {
+                delete cell.load(std::memory_order_relaxed);
+            }
+        }
+
+        std::array<std::atomic<ViewCell*>, CHUNK_SIZE * CHUNK_SIZE> cells{};
+    };
+
+    struct ViewBand {
+        ~ViewBand() {
+            for (auto& chunk : chunks) {
+                delete chunk.load(std::memory_order_relaxed);
+            }
+        }
+
+        std::array<std::atomic<ViewChunk*>, Position::MAX_COLS / CHUNK_SIZE> chunks{};
+    };
+
+    // Узел слота, созданный при первом обращении. Потоки, одновременно
+    // создавшие узел, договариваются через compare_exchange: проигравший
+    // удаляет свою копию и берёт установленную.
+    template <typename Node, typename... Args>
+    static Node& Materialize(std::atomic<Node*>& slot, Args&&... args) {
+        Node* node = slot.load(std::memory_order_acquire);
+        if (!node) {
+            auto created = std::make_unique<Node>(std::forward<Args>(args)...);
+            if (slot.compare_exchange_strong(node, created.get(), std::memory_order_acq_rel, std::memory_order_acquire)) {
+                node = created.release();
+            }
+        }
+
+        return *node;
+    }
+
+    const CellRecord* Find(Position pos) const {
+        const auto& band = root_->bands[pos.row / CHUNK_SIZE];
+        if (!band) {
+            return nullptr;
+        }
+
+        const auto& chunk = band->chunks[pos.col / CHUNK_SIZE];
+        if (!chunk) {
+            return nullptr;
+        }
+
+        return chunk->cells[SlotIndex(pos)].get();
+    }
+
+    // Обход только существующих полос и блоков
+    Size ComputePrintableSize() const {
+        Size size;
+        for (size_t b = 0; b < root_->bands.size(); ++b) {
+            const auto& band = root_->bands[b];
+            if (!band) {
+                continue;
+            }
+
+            for (size_t c = 0; c < band->chunks.size(); ++c) {
+                const auto& chunk = band->chunks[c];
+                if (!chunk) {
+                    continue;
+                }
+
+                for (size_t slot = 0; slot < chunk->cells.size(); ++slot) {
+                    if (chunk->cells[slot]) {
+                        const int row = static_cast<int>(b * CHUNK_SIZE + slot / CHUNK_SIZE);
+                        const int col = static_cast<int>(c * CHUNK_SIZE + slot % CHUNK_SIZE);
+                        size.rows = std::max(size.rows, row + 1);
+                        size.cols = std::max(size.cols, col + 1);
+                    }
+                }
+            }
+        }
+
+        return size;
+    }
+
+    // Печать только существующих ячеек: пустые позиции не ищутся
+    template <typename PrintCell>
+    void Print(std::ostream& output, PrintCell print_cell) const {
+        PrintInRowOrder(output, GetPrintableSize(), [this](const auto& callback) {
+            ForEachCell(callback);
+        }, print_cell);
+    }
+
+    std::shared_ptr<const Root> root_;
+    // Ячейки, к которым уже обращались, по полосам
+    mutable std::array<std::atomic<ViewBand*>, Position::MAX_ROWS / CHUNK_SIZE> bands_{};
+    mutable std::once_flag size_once_;
+    mutable Size printable_size_;
+};
+
+VersionedStorage::VersionedStorage() : root_(std::make_shared<Root>()) {}
+
+VersionedStorage::~VersionedStorage() = default;
+
+void VersionedStorage::Set(Position pos, std::string text, std::shared_ptr<const FormulaInterface> formula) {
+    if (text.empty()) {
+        Clear(pos);
+        return;
+    }
+
+    // Копируем узлы на пути к ячейке, если они разделены со снимками
+    Band& band = Unshare(Unshare(root_, generation_).bands[pos.row / CHUNK_SIZE], generation_);
+    Chunk& chunk = Unshare(band.chunks[pos.col / CHUNK_SIZE], generation_);
+    chunk.cells[SlotIndex(pos)] = std::make_shared<const CellRecord>(CellRecord{ std::move(text), std::move(formula) });
+}
+
+void VersionedStorage::Clear(Position pos) {
+    // Отсутствующую ячейку не трогаем, чтобы не копировать путь впустую
+    const auto& band = root_->bands[pos.row / CHUNK_SIZE];
+    if (!band || !band->chunks[pos.col / CHUNK_SIZE] || !band->chunks[pos.col / CHUNK_SIZE]->cells[SlotIndex(pos)]) {
+        return;
+    }
+
+    Band& own_band = Unshare(Unshare(root_, generation_).bands[pos.row / CHUNK_SIZE], generation_);
+    Unshare(own_band.chunks[pos.col / CHUNK_SIZE], generation_).cells[SlotIndex(pos)].reset();
+}
+
+std::shared_ptr<const SheetInterface> VersionedStorage::Snapshot() {
+    auto snapshot = std::make_shared<View>(root_);
+    // Все существующие узлы теперь разделены со снимком
+    ++generation_;
+    return snapshot;
+}
+
+size_t VersionedStorage::GetMemoryUsage() const {
+    using memory_usage::MakeSharedBytes;
+    size_t bytes = MakeSharedBytes<Root>();
+    for (const auto& band : root_->bands) {
+        if (!band) {
+            continue;
+        }
+        bytes += MakeSharedBytes<Band>();
+        for (const auto& chunk : band->chunks) {
+            if (!chunk) {
+                continue;
+            }
+            bytes += MakeSharedBytes<Chunk>();
+            for (const auto& record : chunk->cells) {
+                if (record) {
+                    bytes += MakeSharedBytes<CellRecord>() + memory_usage::StringHeapBytes(record->text);
+                }
+            }
+        }
+    }
+    return bytes;
+}
+
+void VersionedStorage::ForEachCell(const SheetInterface& snapshot,
+                                   const std::function<void(Position, const CellInterface&)>& callback) {
+    const auto* view = dynamic_cast<const View*>(&snapshot);
+    if (!view) {
+        throw std::invalid_argument("not a versioned storage snapshot"s);
+    }
+    view->ForEachCell(callback);
+}
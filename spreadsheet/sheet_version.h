@@ -0,0 +1,61 @@
+#pragma once
+
+#include "common.h"
+#include "formula.h"
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+// Постоянное хранилище содержимого ячеек со структурным разделением.
+// Ячейки лежат в блоках CHUNK_SIZE x CHUNK_SIZE, блоки - в полосах строк,
+// полосы - в корне. Снимок просто разделяет корень с хранилищем, а первое
+// изменение после снимка копирует только путь к изменяемой ячейке: корень,
+// полосу и блок. Узлы помечены поколением: каждый снимок начинает новое
+// поколение, и писатель изменяет на месте только узлы текущего поколения.
+// Разобранные формулы не копируются, а разделяются с ячейками таблицы.
+//
+// Изменения и вызов Snapshot() должны выполняться в одном потоке (потоке
+// писателя). Полученные снимки неизменяемы, их можно читать из любых потоков
+// независимо от дальнейших изменений хранилища. Чтение снимка не берёт
+// блокировок: ячейки снимка создаются при первом обращении через
+// compare_exchange.
+class VersionedStorage {
+public:
+    VersionedStorage();
+    ~VersionedStorage();
+
+    // Запись содержимого ячейки. Для текстовой ячейки formula пуст,
+    // пустой текст удаляет ячейку из хранилища.
+    void Set(Position pos, std::string text, std::shared_ptr<const FormulaInterface> formula);
+    // Удаление ячейки из хранилища
+    void Clear(Position pos);
+
+    // Неизменяемая таблица с текущим содержимым хранилища. Выполняется за O(1).
+    // Методы SetCell() и ClearCell() снимка бросают ReadOnlySheetException.
+    std::shared_ptr<const SheetInterface> Snapshot();
+
+    // Память узлов и записей ячеек, достижимых из текущего состояния. Узлы,
+    // которые остались только у снимков, и разобранные формулы не учитываются.
+    size_t GetMemoryUsage() const;
+
+    // Обход ячеек снимка, полученного от Snapshot(), по строкам. Время
+    // зависит от числа заполненных блоков, а не от размера таблицы.
+    // Для другой таблицы бросает std::invalid_argument.
+    static void ForEachCell(const SheetInterface& snapshot,
+                            const std::function<void(Position, const CellInterface&)>& callback);
+
+    static constexpr int CHUNK_SIZE = 16;
+
+private:
+    struct CellRecord;
+    struct Chunk;
+    struct Band;
+    struct Root;
+    class View;
+
+    std::shared_ptr<Root> root_;
+    // Поколение узлов, созданных после последнего снимка
+    uint64_t generation_ = 0;
+};
@@ -0,0 +1,411 @@
+#include "snapshot.h"
+
+#include "cell_index.h"
+#include "formula.h"
+#include "sheet.h"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#include <iterator>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std::literals;
+
+namespace {
+    constexpr char SNAPSHOT_MAGIC[4] = { 'S', 'S', 'N', 'P' };
+    constexpr std::uint32_t SNAPSHOT_VERSION = 1;
+
+    struct Header {
+        char magic[4];
+        std::uint32_t version;
+        std::uint32_t cell_count;
+        std::int32_t rows;
+        std::int32_t cols;
+    };
+
+    struct IndexEntry {
+        std::uint32_t key;
+        std::uint32_t offset;
+        std::uint32_t length;
+    };
+
+    // Ключ позиции в индексе: сравнение ключей совпадает с порядком Position::operator<
+    std::uint32_t MakeKey(Position pos) {
+        return static_cast<std::uint32_t>(pos.row) * Position::MAX_COLS + static_cast<std::uint32_t>(pos.col);
+    }
+
+    Position KeyToPosition(std::uint32_t key) {
+        return { static_cast<int>(key / Position::MAX_COLS), static_cast<int>(key % Position::MAX_COLS) };
+    }
+
+    template <typename T>
+    void WritePod(std::ostream& output, const T& value) {
+        output.write(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    // Чтение структуры из отображённой памяти без требований к выравниванию
+    template <typename T>
+    T ReadPod(const char* data) {
+        T value;
+        std::memcpy(&value, data, sizeof(value));
+        return value;
+    }
+
+    // Файл, отображённый в память только для чтения.
+    // Если отображение недоступно, файл читается в буфер целиком.
+    class MappedFile {
+    public:
+        explicit MappedFile(const std::string& path) {
+#ifdef _WIN32
+            std::ifstream input(path, std::ios::binary);
+            if (!input) {
+                throw std::runtime_error("cannot open snapshot file: "s + path);
+            }
+            buffer_.assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+            data_ = buffer_.data();
+            size_ = buffer_.size();
+#else
+            const int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                throw std::runtime_error("cannot open snapshot file: "s + path);
+            }
+
+            struct stat st {};
+            if (::fstat(fd, &st) != 0 || st.st_size <= 0) {
+                ::close(fd);
+                throw SnapshotFormatException("empty snapshot file: "s + path);
+            }
+
+            size_ = static_cast<size_t>(st.st_size);
+            void* mapped = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            // Дескриптор после отображения больше не нужен
+            ::close(fd);
+            if (mapped == MAP_FAILED) {
+                throw std::runtime_error("cannot map snapshot file: "s + path);
+            }
+
+            // Ячейки читаются в произвольном порядке - упреждающее чтение только раздувает RSS
+            ::madvise(mapped, size_, MADV_RANDOM);
+            data_ = static_cast<const char*>(mapped);
+#endif
+        }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        ~MappedFile() {
+#ifndef _WIN32
+            ::munmap(const_cast<char*>(data_), size_);
+#endif
+        }
+
+        const char* Data() const {
+            return data_;
+        }
+
+        size_t Size() const {
+            return size_;
+        }
+
+    private:
+        const char* data_ = nullptr;
+        size_t size_ = 0;
+#ifdef _WIN32
+        std::vector<char> buffer_;
+#endif
+    };
+
+    // Ячейка снимка. Текст не копируется и указывает в отображённый файл,
+    // формула разбирается при первом обращении.
+    class SnapshotCell : public CellInterface {
+    public:
+        SnapshotCell(std::string_view text, const SheetInterface& sheet) : text_(text), sheet_(sheet) {}
+
+        Value GetValue() const override {
+            if (!IsFormula()) {
+                if (text_[0] == ESCAPE_SIGN) {
+                    return std::string(text_.substr(1));
+                }
+
+                return std::string(text_);
+            }
+
+            if (!cache_.has_value()) {
+                // Глубоко в цепочке зависимости вычисляются явным стеком
+                if (GetCellReadDepth() >= MAX_RECURSIVE_READ_DEPTH) {
+                    EvaluateDependencies(*this, [](const SnapshotCell& cell) {
+                        return cell.GetPendingDependencies();
+                    }, [](const SnapshotCell& cell) {
+                        cell.GetValue();
+                    });
+                }
+                cache_ = GetFormula().Evaluate(sheet_);
+            }
+
+            if (std::holds_alternative<double>(*cache_)) {
+                return std::get<double>(*cache_);
+            }
+
+            return std::get<FormulaError>(*cache_);
+        }
+
+        std::string GetText() const override {
+            return std::string(text_);
+        }
+
+        std::vector<Position> GetReferencedCells() const override {
+            if (!IsFormula()) {
+                return {};
+            }
+
+            return GetFormula().GetReferencedCells();
+        }
+
+    private:
+        bool IsFormula() const {
+            return text_.size() > 1 && text_[0] == FORMULA_SIGN;
+        }
+
+        const FormulaInterface& GetFormula() const {
+            if (!formula_) {
+                formula_ = ParseFormula(std::string(text_.substr(1)));
+            }
+
+            return *formula_;
+        }
+
+        // Формулы снимка, на которые ссылается формула ячейки и значения
+        // которых ещё не вычислены
+        std::vector<const SnapshotCell*> GetPendingDependencies() const {
+            std::vector<const SnapshotCell*> pending;
+            for (const Position& pos : GetFormula().GetReferencedCells()) {
+                if (!pos.IsValid()) {
+                    continue;
+                }
+                const auto* cell = static_cast<const SnapshotCell*>(sheet_.GetCell(pos));
+                if (cell && cell->IsFormula() && !cell->cache_.has_value()) {
+                    pending.push_back(cell);
+                }
+            }
+            return pending;
+        }
+
+        // Текст ячейки внутри отображённого файла
+        std::string_view text_;
+        // Ссылка на таблицу
+        const SheetInterface& sheet_;
+        // Разобранная формула, создаётся при первом обращении
+        mutable std::unique_ptr<FormulaInterface> formula_;
+        // Кэш вычисленного значения формулы
+        mutable std::optional<FormulaInterface::Value> cache_;
+    };
+
+    class SnapshotSheet : public SheetInterface {
+    public:
+        explicit SnapshotSheet(const std::string& path) : file_(path) {
+            if (file_.Size() < sizeof(Header)) {
+                throw SnapshotFormatException("truncated snapshot header"s);
+            }
+
+            header_ = ReadPod<Header>(file_.Data());
+            if (std::memcmp(header_.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0
+                || header_.version != SNAPSHOT_VERSION) {
+                throw SnapshotFormatException("unknown snapshot format"s);
+            }
+
+            const size_t index_size = static_cast<size_t>(header_.cell_count) * sizeof(IndexEntry);
+            if (file_.Size() - sizeof(Header) < index_size) {
+                throw SnapshotFormatException("truncated snapshot index"s);
+            }
+
+            index_ = file_.Data() + sizeof(Header);
+            texts_ = index_ + index_size;
+            texts_size_ = file_.Size() - sizeof(Header) - index_size;
+
+            // Записи индекса проверяются при обращении к ним, поэтому открытие
+            // не читает весь индекс
+            if (header_.rows < 0 || header_.rows > Position::MAX_ROWS
+                || header_.cols < 0 || header_.cols > Position::MAX_COLS) {
+                throw SnapshotFormatException("snapshot printable size is out of range"s);
+            }
+        }
+
+        void SetCell(Position, std::string) override {
+            throw ReadOnlySheetException("snapshot sheet is read-only"s);
+        }
+
+        const CellInterface* GetCell(Position pos) const override {
+            if (!pos.IsValid()) {
+                throw InvalidPositionException("invalid position"s);
+            }
+
+            // Двоичный поиск позиции в отсортированном индексе
+            const std::uint32_t key = MakeKey(pos);
+            std::uint32_t left = 0;
+            std::uint32_t right = header_.cell_count;
+            while (left < right) {
+                const std::uint32_t middle = left + (right - left) / 2;
+                if (CheckedEntryAt(middle).key < key) {
+                    left = middle + 1;
+                }
+                else {
+                    right = middle;
+                }
+            }
+
+            if (left == header_.cell_count || CheckedEntryAt(left).key != key) {
+                return nullptr;
+            }
+
+            return Materialize(left);
+        }
+
+        CellInterface* GetCell(Position pos) override {
+            return const_cast<CellInterface*>(std::as_const(*this).GetCell(pos));
+        }
+
+        void ClearCell(Position) override {
+            throw ReadOnlySheetException("snapshot sheet is read-only"s);
+        }
+
+        Size GetPrintableSize() const override {
+            return { header_.rows, header_.cols };
+        }
+
+        void PrintValues(std::ostream& output) const override {
+            Print(output, [&output](const CellInterface& cell) {
+                std::visit([&output](const auto& value) {
+                    output << value;
+                }, cell.GetValue());
+            });
+        }
+
+        void PrintTexts(std::ostream& output) const override {
+            Print(output, [&output](const CellInterface& cell) {
+                output << cell.GetText();
+            });
+        }
+
+    private:
+        IndexEntry EntryAt(std::uint32_t index) const {
+            return ReadPod<IndexEntry>(index_ + static_cast<size_t>(index) * sizeof(IndexEntry));
+        }
+
+        // Проверка записи индекса, которую читает двоичный поиск: позиция
+        // лежит в печатной области, а ключ меньше ключа следующей записи
+        IndexEntry CheckedEntryAt(std::uint32_t index) const {
+            const IndexEntry entry = EntryAt(index);
+            CheckInPrintableArea(entry);
+            if (index + 1 < header_.cell_count && EntryAt(index + 1).key <= entry.key) {
+                throw SnapshotFormatException("snapshot index is not sorted"s);
+            }
+            return entry;
+        }
+
+        void CheckInPrintableArea(const IndexEntry& entry) const {
+            const Position pos = KeyToPosition(entry.key);
+            if (pos.row >= header_.rows || pos.col >= header_.cols) {
+                throw SnapshotFormatException("snapshot cell is outside the printable area"s);
+            }
+        }
+
+        // Создание ячейки для записи индекса при первом обращении к ней
+        const CellInterface* Materialize(std::uint32_t index) const {
+            auto& cell = cells_[index];
+            if (!cell) {
+                const IndexEntry entry = EntryAt(index);
+                if (entry.offset > texts_size_ || entry.length > texts_size_ - entry.offset || entry.length == 0) {
+                    throw SnapshotFormatException("snapshot cell text is out of bounds"s);
+                }
+                cell = std::make_unique<SnapshotCell>(std::string_view(texts_ + entry.offset, entry.length), *this);
+            }
+
+            return cell.get();
+        }
+
+        // Печать идёт по индексу, поэтому пустые области таблицы не
+        // просматриваются. Порядок записей проверяется попутно.
+        template <typename PrintCell>
+        void Print(std::ostream& output, PrintCell print_cell) const {
+            PrintInRowOrder(output, GetPrintableSize(), [this](const auto& callback) {
+                for (std::uint32_t i = 0; i < header_.cell_count; ++i) {
+                    const IndexEntry entry = EntryAt(i);
+                    CheckInPrintableArea(entry);
+                    if (i > 0 && EntryAt(i - 1).key >= entry.key) {
+                        throw SnapshotFormatException("snapshot index is not sorted"s);
+                    }
+                    callback(KeyToPosition(entry.key), *Materialize(i));
+                }
+            }, print_cell);
+        }
+
+        MappedFile file_;
+        Header header_{};
+        const char* index_ = nullptr;
+        const char* texts_ = nullptr;
+        size_t texts_size_ = 0;
+        // Ячейки, к которым уже обращались, по номеру записи индекса
+        mutable std::unordered_map<std::uint32_t, std::unique_ptr<SnapshotCell>> cells_;
+    };
+}  // namespace
+
+void SaveSnapshot(const SheetInterface& sheet, std::ostream& output) {
+    const Size size = sheet.GetPrintableSize();
+
+    // Индекс файла упорядочен по строкам - в том же порядке обходит ячейки
+    // таблица. У других реализаций просматривается вся печатная область.
+    std::vector<IndexEntry> index;
+    std::string texts;
+    auto add = [&index, &texts](Position pos, const CellInterface& cell) {
+        std::string text = cell.GetText();
+        if (text.empty()) {
+            return;
+        }
+
+        index.push_back({ MakeKey(pos), static_cast<std::uint32_t>(texts.size()), static_cast<std::uint32_t>(text.size()) });
+        texts += text;
+    };
+    if (const auto* table = dynamic_cast<const Sheet*>(&sheet)) {
+        table->ForEachCell(add);
+    }
+    else {
+        for (int r = 0; r < size.rows; ++r) {
+            for (int c = 0; c < size.cols; ++c) {
+                if (const CellInterface* cell = sheet.GetCell({ r, c })) {
+                    add({ r, c }, *cell);
+                }
+            }
+        }
+    }
+
+    Header header{};
+    std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.cell_count = static_cast<std::uint32_t>(index.size());
+    header.rows = size.rows;
+    header.cols = size.cols;
+
+    WritePod(output, header);
+    for (const auto& entry : index) {
+        WritePod(output, entry);
+    }
+    output.write(texts.data(), static_cast<std::streamsize>(texts.size()));
+}
+
+std::unique_ptr<SheetInterface> OpenSnapshot(const std::string& path) {
+    return std::make_unique<SnapshotSheet>(path);
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "common.h"
+
+#include <iosfwd>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+// Снимок таблицы - двоичный файл, который можно открыть только для чтения.
+// Формат (порядок байт - родной для платформы):
+// * заголовок: сигнатура "SSNP", версия формата, количество ячеек, печатный
+//   размер таблицы (строки и столбцы);
+// * индекс: для каждой непустой ячейки позиция, смещение и длина её текста,
+//   записи отсортированы по строкам, а внутри строки - по столбцам;
+// * тексты ячеек подряд, без разделителей.
+// Индекс позволяет найти ячейку двоичным поиском, не читая файл целиком.
+
+// Исключение, выбрасываемое при попытке изменить таблицу, открытую из снимка
+class ReadOnlySheetException : public std::logic_error {
+public:
+    using std::logic_error::logic_error;
+};
+
+// Исключение, выбрасываемое при чтении повреждённого или чужого файла снимка
+class SnapshotFormatException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Записывает снимок таблицы в поток. Поток должен быть открыт в двоичном режиме.
+void SaveSnapshot(const SheetInterface& sheet, std::ostream& output);
+
+// Открывает снимок таблицы. Файл отображается в память, ячейки создаются
+// только при первом обращении к ним, а формулы разбираются при первом
+// вычислении. Поэтому потребление памяти зависит от числа прочитанных ячеек,
+// а не от размера таблицы. При открытии проверяется только заголовок, а
+// записи индекса - при обращении к ним: для повреждённого файла открытие,
+// GetCell() или печать бросают SnapshotFormatException.
+// Методы SetCell() и ClearCell() полученной таблицы бросают
+// ReadOnlySheetException.
+std::unique_ptr<SheetInterface> OpenSnapshot(const std::string& path);
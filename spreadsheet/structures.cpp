@@ -1,15 +1,11 @@
 #include "common.h"
 
-#include <cctype>
-#include <sstream>
-#include <algorithm>
 #include <cassert>
+#include <tuple>
 
 using namespace std;
 
 const int LETTERS = 26;
-const int MAX_POSITION_LENGTH = 17;
-const int MAX_POS_LETTER_COUNT = 3;
 
 const Position Position::NONE = {-1, -1};
 
@@ -26,52 +22,49 @@ bool Position::IsValid() const {
 }
 
 std::string Position::ToString() const {
-    if (!IsValid()) return {};
+    char buffer[MAX_STRING_LENGTH];
+    // Строка до 15 символов хранится без выделения памяти
+    return std::string(buffer, ToChars(buffer));
+}
+
+size_t Position::ToChars(char* buffer) const {
+    if (!IsValid()) return 0;
 
-    std::string result;
-    result.reserve(MAX_POSITION_LENGTH);
+    // Буквы столбца получаются с конца, поэтому собираются в обратном порядке
+    char letters[MAX_LETTER_COUNT];
+    size_t letter_count = 0;
     int c = col;
     while (c >= 0) {
-        result.insert(result.begin(), 'A' + c % LETTERS);
+        letters[letter_count++] = static_cast<char>('A' + c % LETTERS);
         c = c / LETTERS - 1;
     }
 
-    result += std::to_string(row + 1);
-
-    return result;
-}
-
-Position Position::FromString(std::string_view str) {
-    auto it = std::find_if(str.begin(), str.end(), [](const char c) {
-        return !(std::isalpha(c) && std::isupper(c));
-    });
-    auto letters = str.substr(0, it - str.begin());
-    auto digits = str.substr(it - str.begin());
-
-    if (letters.empty() || digits.empty()) {
-        return Position::NONE;
-    }
-    if (letters.size() > MAX_POS_LETTER_COUNT) {
-        return Position::NONE;
+    size_t length = 0;
+    while (letter_count > 0) {
+        buffer[length++] = letters[--letter_count];
     }
 
-    if (!std::isdigit(digits[0])) {
-        return Position::NONE;
-    }
+    char digits[MAX_STRING_LENGTH];
+    size_t digit_count = 0;
+    int r = row + 1;
+    do {
+        digits[digit_count++] = static_cast<char>('0' + r % 10);
+        r /= 10;
+    } while (r > 0);
 
-    int row;
-    std::istringstream row_in{std::string{digits}};
-    if (!(row_in >> row) || !row_in.eof()) {
-        return Position::NONE;
+    while (digit_count > 0) {
+        buffer[length++] = digits[--digit_count];
     }
 
-    int col = 0;
-    for (char ch: letters) {
-        col *= LETTERS;
-        col += ch - 'A' + 1;
-    }
+    return length;
+}
+
+bool SheetReference::operator==(const SheetReference& rhs) const {
+    return sheet == rhs.sheet && pos == rhs.pos;
+}
 
-    return {row - 1, col - 1};
+bool SheetReference::operator<(const SheetReference& rhs) const {
+    return std::tie(sheet, pos) < std::tie(rhs.sheet, rhs.pos);
 }
 
 bool Size::operator==(Size rhs) const {
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "formula.h"
+
+#include <atomic>
+#include <cstdint>
+#include <optional>
+
+// Кэш вычисленного значения формулы, который можно заполнять из нескольких
+// потоков одновременно без блокировок. Поток, вычисливший значение, пытается
+// занять ячейку кэша атомарной операцией CAS; проигравший поток просто
+// возвращает своё значение, которое совпадает с записанным, так как формула
+// вычисляется по неизменной таблице.
+// Сброс кэша (Reset) выполняется только писателем, когда читателей нет.
+class ValueCache {
+public:
+    ValueCache() = default;
+    ValueCache(const ValueCache&) = delete;
+    ValueCache& operator=(const ValueCache&) = delete;
+
+    // Получение значения, если оно уже вычислено
+    std::optional<FormulaInterface::Value> Get() const {
+        if (state_.load(std::memory_order_acquire) == READY) {
+            return value_;
+        }
+
+        return std::nullopt;
+    }
+
+    // Запись значения, если кэш ещё пуст и никто не записывает его сейчас
+    void Put(const FormulaInterface::Value& value) const {
+        std::uint8_t expected = EMPTY;
+        if (state_.compare_exchange_strong(expected, WRITING, std::memory_order_acquire)) {
+            value_ = value;
+            state_.store(READY, std::memory_order_release);
+        }
+    }
+
+    bool HasValue() const {
+        return state_.load(std::memory_order_acquire) == READY;
+    }
+
+    void Reset() {
+        state_.store(EMPTY, std::memory_order_relaxed);
+    }
+
+private:
+    static constexpr std::uint8_t EMPTY = 0;
+    static constexpr std::uint8_t WRITING = 1;
+    static constexpr std::uint8_t READY = 2;
+
+    mutable std::atomic<std::uint8_t> state_{ EMPTY };
+    mutable FormulaInterface::Value value_;
+};
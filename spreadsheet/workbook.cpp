@@ -0,0 +1,142 @@
+#include "workbook.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <numeric>
+
+using namespace std::literals;
+
+Workbook::Workbook(SheetOptions options) : options_(options) {}
+
+Sheet& Workbook::AddSheet(std::string name) {
+    if (!IsValidSheetName(name)) {
+        throw std::invalid_argument("invalid sheet name: "s + name);
+    }
+    if (index_.count(name) > 0) {
+        throw std::invalid_argument("duplicate sheet name: "s + name);
+    }
+    
+    // Ключ индекса ссылается на имя внутри листа, которое не перемещается
+    sheets_.push_back(std::unique_ptr<Sheet>(new Sheet(options_, this, std::move(name))));
+    Sheet& sheet = *sheets_.back();
+    index_.emplace(sheet.GetName(), sheets_.size() - 1);
+    
+    // Формулы, которые уже ссылались на лист с таким именем, вычислялись в
+    // #REF! и теперь должны зависеть от его ячеек
+    for (const auto& other : sheets_) {
+        other->RelinkReferencesTo(sheet.GetName());
+    }
+    DeliverChanges();
+    
+    return sheet;
+}
+
+Sheet* Workbook::GetSheet(std::string_view name) {
+    const auto it = index_.find(name);
+    return it == index_.end() ? nullptr : sheets_[it->second].get();
+}
+
+const Sheet* Workbook::GetSheet(std::string_view name) const {
+    return const_cast<Workbook*>(this)->GetSheet(name);
+}
+
+std::vector<std::string> Workbook::GetSheetNames() const {
+    std::vector<std::string> names;
+    names.reserve(sheets_.size());
+    for (const auto& sheet : sheets_) {
+        names.push_back(sheet->GetName());
+    }
+    
+    return names;
+}
+
+void Workbook::Recalculate(size_t threads) {
+    // Объединяем листы, связанные ссылками, в группы (система
+    // непересекающихся множеств)
+    std::vector<size_t> parent(sheets_.size());
+    std::iota(parent.begin(), parent.end(), 0);
+    const auto find = [&parent](size_t i) {
+        while (parent[i] != i) {
+            i = parent[i] = parent[parent[i]];
+        }
+        return i;
+    };
+    for (size_t i = 0; i < sheets_.size(); ++i) {
+        for (const auto& name : sheets_[i]->GetReferencedSheetNames()) {
+            const auto it = index_.find(name);
+            if (it != index_.end()) {
+                parent[find(i)] = find(it->second);
+            }
+        }
+    }
+    
+    std::vector<std::vector<Sheet*>> groups;
+    std::vector<size_t> group_of_root(sheets_.size(), sheets_.size());
+    for (size_t i = 0; i < sheets_.size(); ++i) {
+        size_t& group = group_of_root[find(i)];
+        if (group == sheets_.size()) {
+            group = groups.size();
+            groups.emplace_back();
+        }
+        groups[group].push_back(sheets_[i].get());
+    }
+    
+    // Группы не имеют общих ячеек, поэтому их вычисление не пересекается.
+    // Листы одной группы вычисляются последовательно в одном потоке. Первая
+    // ошибка запоминается, остальные потоки не берут новых групп, а ошибка
+    // бросается в вызывающем потоке после завершения всех потоков.
+    std::atomic<size_t> next_group{ 0 };
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    const auto worker = [&groups, &next_group, &error_mutex, &error] {
+        try {
+            for (size_t group = next_group++; group < groups.size(); group = next_group++) {
+                for (Sheet* sheet : groups[group]) {
+                    sheet->Recalculate();
+                }
+            }
+        } catch (...) {
+            next_group = groups.size();
+            std::lock_guard lock(error_mutex);
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+    };
+    
+    const size_t thread_count = std::min(std::max<size_t>(threads, 1), groups.size());
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < thread_count; ++i) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : workers) {
+        thread.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+void Workbook::DeliverChanges() {
+    for (const auto& sheet : sheets_) {
+        if (sheet->batch_depth_ == 0) {
+            sheet->DeliverOwnChanges();
+        }
+    }
+}
+
+bool Workbook::IsValidSheetName(std::string_view name) {
+    const auto is_letter = [](char c) {
+        return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '_';
+    };
+    if (name.empty() || !is_letter(name.front())) {
+        return false;
+    }
+    
+    return std::all_of(name.begin() + 1, name.end(), [&is_letter](char c) {
+        return is_letter(c) || (c >= '0' && c <= '9');
+    });
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "common.h"
+#include "sheet.h"
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Книга из нескольких листов. Формула листа может ссылаться на ячейку
+// другого листа в виде Sheet2!A1: зависимости и сброс кэшей проходят через
+// границы листов, а циклические зависимости через несколько листов
+// обнаруживаются так же, как внутри одного.
+// Ссылки на другие листы не сдвигаются при вставке и удалении строк и
+// столбцов. Ссылка на лист, которого нет в книге, вычисляется в ошибку #REF!
+// и начинает работать, как только лист с таким именем будет добавлен.
+// Снимок листа других листов не видит, и такие ссылки в нём дают #REF!.
+class Workbook {
+public:
+    explicit Workbook(SheetOptions options = {});
+    
+    Workbook(const Workbook&) = delete;
+    Workbook& operator=(const Workbook&) = delete;
+    
+    // Добавление пустого листа. Имя состоит из латинских букв, цифр и знака
+    // подчёркивания и не начинается с цифры. При некорректном или уже занятом
+    // имени бросается std::invalid_argument.
+    Sheet& AddSheet(std::string name);
+    // Лист с заданным именем или nullptr
+    Sheet* GetSheet(std::string_view name);
+    const Sheet* GetSheet(std::string_view name) const;
+    // Имена листов в порядке добавления
+    std::vector<std::string> GetSheetNames() const;
+    
+    // Вычисление всех формул книги (см. Sheet::Recalculate). Листы делятся на
+    // группы, связанные ссылками друг на друга; независимые группы
+    // вычисляются параллельно в threads потоках. Ошибка вычисления (например,
+    // LimitExceededException) бросается в вызывающем потоке после остановки
+    // всех потоков; первая из нескольких ошибок.
+    void Recalculate(size_t threads = std::thread::hardware_concurrency());
+
+private:
+    // Листы передают изменения подписчикам всей книги
+    friend class Sheet;
+    
+    // Передача накопленных дельт подписчикам всех листов, которые не
+    // находятся внутри группы изменений
+    void DeliverChanges();
+    
+    static bool IsValidSheetName(std::string_view name);
+    
+    SheetOptions options_;
+    // Листы в порядке добавления и их индексы по именам
+    std::vector<std::unique_ptr<Sheet>> sheets_;
+    std::unordered_map<std::string_view, size_t> index_;
+};